@@ -0,0 +1,76 @@
+#pragma once
+
+#include <Protocol/ImageProtocol.hpp>
+#include <cstdint>
+#include <vector>
+#include <map>
+
+class FramePool;
+
+//Tile based delta encoding for mostly static scenes
+//Keyframes carry the whole image, other frames only carry the tiles that differ from the last keyframe
+//Patching against the keyframe rather than the previous frame means a lost frame only loses itself
+class DeltaCodec
+{
+public:
+	//Starts the payload of every Delta encoded frame
+	struct __attribute__((packed)) DeltaHeader
+	{
+		uint32_t reference; //keyframe this frame is relative to
+		uint8_t keyframe; //1 = whole image follows, 0 = tile bitmap then changed tiles
+		uint8_t tilesize; //tiles are tilesize x tilesize pixels
+		uint8_t bytesperpixel;
+		uint8_t reserved;
+	};
+
+	//true when both buffers hold the same bytes, SIMD accelerated
+	static bool Equal(const uint8_t* a, const uint8_t* b, size_t length);
+
+protected:
+	struct Reference
+	{
+		std::vector<uint8_t> data;
+		uint16_t width = 0, height = 0;
+		uint8_t bytesperpixel = 0;
+		uint32_t id = 0;
+		int sincekeyframe = 0;
+	};
+
+	std::map<uint8_t, Reference> references; //per identifier
+
+	static int GetTileCount(int pixels, int tilesize)
+	{
+		return (pixels + tilesize - 1) / tilesize;
+	}
+};
+
+class DeltaEncoder : public DeltaCodec
+{
+private:
+	int KeyframeInterval;
+	int TileSize;
+
+public:
+	DeltaEncoder(int InKeyframeInterval = 30, int InTileSize = 16);
+
+	//Encode an image of width*height pixels of bytesperpixel bytes into out
+	//Returns true when a keyframe was produced
+	bool Encode(uint8_t identifier, const uint8_t* pixels, uint16_t width, uint16_t height, int bytesperpixel, std::vector<uint8_t> &out);
+
+	//Next frame of every identifier will be a keyframe, for clients that just joined
+	void ForceKeyframe();
+
+	void SetKeyframeInterval(int InKeyframeInterval)
+	{
+		KeyframeInterval = InKeyframeInterval;
+	}
+};
+
+class DeltaDecoder : public DeltaCodec
+{
+public:
+	//Replace the encoded payload by the decoded pixels
+	//false = the keyframe this frame refers to is missing or the payload is invalid
+	//Output buffers come from pool when given, the encoded buffer goes back to it even when decoding fails
+	bool Decode(ImageProtocol::Image &image, FramePool* pool = nullptr);
+};
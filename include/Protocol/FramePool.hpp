@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <mutex>
+#include <atomic>
+
+//Recycles frame sized buffers so that receiving a frame doesn't allocate and fault in fresh memory
+//Thread safe
+class FramePool
+{
+private:
+	std::mutex poolmutex; //protects buffers
+	std::vector<std::vector<uint8_t>> buffers;
+	size_t MaxBuffers;
+	std::atomic<uint64_t> allocations = 0;
+
+public:
+	FramePool(size_t InMaxBuffers = 16);
+
+	//A buffer of size bytes, its content is undefined
+	std::vector<uint8_t> Acquire(size_t size);
+
+	//Give a buffer back, dropped if the pool is already full
+	void Release(std::vector<uint8_t> &&buffer);
+
+	//Acquires that had to allocate
+	uint64_t GetAllocations() const
+	{
+		return allocations;
+	}
+};
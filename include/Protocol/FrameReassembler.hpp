@@ -0,0 +1,105 @@
+#pragma once
+
+#include <Protocol/ImageProtocol.hpp>
+#include <cstdint>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <optional>
+#include <memory>
+
+class FramePool;
+
+//Rebuilds frames from the fragments sent by ImageProtocol
+//Frames are live : once a frame completes, older frames of the same identifier are dropped
+//Not thread safe
+class FrameReassembler
+{
+private:
+	struct PendingFrame
+	{
+		ImageProtocol::ImageMetadata metadata;
+		std::vector<uint8_t> data;
+		std::vector<bool> received;
+		int missing;
+		uint32_t fragmentsize;
+		uint16_t group;
+		std::vector<uint8_t> parity; //one fragmentsize slot per group
+		std::vector<bool> parityreceived;
+		std::vector<uint16_t> groupmissing;
+		std::chrono::steady_clock::time_point started;
+		std::chrono::steady_clock::time_point lastactivity; //last fragment or NACK
+		size_t bytes; //data and parity storage, counted in pendingbytes
+	};
+
+	std::map<uint32_t, PendingFrame> frames;
+	std::map<uint8_t, uint32_t> lastcompleted; //last frame delivered per identifier
+	std::chrono::milliseconds Timeout;
+	std::shared_ptr<FramePool> Pool; //frame buffers come from there when set
+	size_t pendingbytes = 0;
+	uint64_t dropped = 0;
+	uint64_t recovered = 0;
+
+	bool IsStale(uint8_t identifier, uint32_t frame) const;
+
+	//Forget a pending frame, giving its buffer back
+	std::map<uint32_t, PendingFrame>::iterator Drop(std::map<uint32_t, PendingFrame>::iterator frame);
+
+	//Drop the oldest pending frames until one more of bytes fits in the limits
+	void MakeRoom(size_t bytes);
+
+	//Rebuild the only missing fragment of a group from its parity
+	void Recover(PendingFrame &frame, uint16_t count, int group);
+
+public:
+	//Larger frames are refused before anything is allocated for them
+	static constexpr uint32_t MaxFrameSize = 128*1024*1024;
+	//Past either limit the oldest pending frame is dropped to make room for a new one
+	static constexpr size_t MaxPendingFrames = 64;
+	static constexpr size_t MaxPendingBytes = 256*1024*1024;
+
+	FrameReassembler(std::chrono::milliseconds InTimeout = std::chrono::milliseconds(100));
+
+	//Add a fragment, returns the image if it was the last one missing
+	std::optional<ImageProtocol::Image> AddFragment(const ImageProtocol::FragmentHeader &header, const uint8_t* payload, size_t length);
+
+	struct Nack
+	{
+		uint32_t frame;
+		std::vector<uint16_t> missing; //data fragment indices, ascending
+	};
+
+	//Missing fragments of frames that received nothing for interval, each frame is reported once per interval
+	std::vector<Nack> GetNacks(std::chrono::milliseconds interval);
+
+	//Drop frames that have been incomplete for longer than the timeout
+	void Expire();
+
+	void SetTimeout(std::chrono::milliseconds InTimeout)
+	{
+		Timeout = InTimeout;
+	}
+
+	void SetPool(std::shared_ptr<FramePool> InPool)
+	{
+		Pool = InPool;
+	}
+
+	//Frames that were never completed
+	uint64_t GetDroppedFrames() const
+	{
+		return dropped;
+	}
+
+	//Fragments rebuilt from parity
+	uint64_t GetRecoveredFragments() const
+	{
+		return recovered;
+	}
+
+	//Size of each fragment but the last one for a frame of size bytes split in count fragments
+	static uint32_t GetFragmentSize(uint32_t size, uint16_t count);
+
+	//Number of parity fragments for count data fragments
+	static uint16_t GetParityCount(uint16_t count, uint16_t group);
+};
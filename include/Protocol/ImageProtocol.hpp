@@ -1,37 +1,28 @@
 #pragma once
 
-#include <Transport/UDPTransport.hpp>
+#include <Transport/GenericTransport.hpp>
 #include <string>
 #include <memory>
 #include <atomic>
+#include <mutex>
 #include <vector>
 #include <map>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <sys/uio.h>
+
+class ConnectionToken;
+class FrameReassembler;
+class DeltaEncoder;
+class DeltaDecoder;
+class WorkerPool;
+class SendPipeline;
+class ReceivePipeline;
+class FramePool;
 
 class ImageProtocol
 {
-private:
-	std::string server_ip;
-#if 0
-	class ISteamNetworkingSockets *socket = nullptr;
-
-	typedef uint32_t HSteamNetPollGroup;
-	typedef uint32_t HSteamListenSocket;
-	typedef uint32_t HSteamNetConnection;
-
-	HSteamNetPollGroup poll_group;
-
-	HSteamListenSocket listener = 0;
-	std::vector<HSteamNetConnection> server_connections;
-
-	HSteamNetConnection client_connection = 0;
-
-	static std::map<HSteamListenSocket, ImageProtocol*> port_owner;
-	static std::map<HSteamNetConnection, ImageProtocol*> connection_owner;
-
-	std::atomic<uint16_t> index_counter = 0;
-
-	std::vector<struct SteamNetworkingMessage_t*> pending_messages;
-#endif
 public:
 
 	enum class PacketTypes
@@ -40,12 +31,43 @@ public:
 		Image,
 		Configuration,
 		Status,
-		Handshake
+		Handshake,
+		Nack
+	};
+
+	//Values of ImageMetadata::encoding handled by the protocol, others are passed through untouched
+	enum class Encodings : uint8_t
+	{
+		Raw = 0,
+		Delta = 1, //sent as tile deltas against a keyframe, received as Raw
+		LosslessU8 = 2, //8 bit samples compressed with LosslessCodec, received as Raw
+		LosslessU16 = 3 //16 bit samples compressed with LosslessCodec, received as Raw
 	};
 
+	static constexpr int DefaultPort = 50668;
+	//Socket buffers of the default UDP transport, a whole frame must fit in flight
+	static constexpr int DefaultBufferSize = 8*1024*1024;
+	//Largest datagram sent, fits an ethernet frame once the IP and UDP headers are added
+	static constexpr int MaxDatagramSize = 1472;
+	//On transports with streams, handshakes and NACKs use the control stream, images of identifier i use stream 1+i
+	//so that control messages never wait behind a frame, nor a camera behind another
+	static constexpr uint16_t ControlStream = 0;
+
 private:
 	static const std::map<PacketTypes, std::string> TypeMap;
 
+	std::string server_ip;
+	std::shared_ptr<GenericTransport> transport;
+	std::shared_ptr<ConnectionToken> server; //null when we are the server
+	std::atomic<uint32_t> frame_counter = 0;
+	std::unique_ptr<FrameReassembler> reassembler;
+	std::unique_ptr<DeltaEncoder> delta_encoder;
+	std::unique_ptr<DeltaDecoder> delta_decoder;
+	std::unique_ptr<WorkerPool> workers; //codec slices, created on first use
+	std::atomic<bool> keyframe_requested = false;
+	std::atomic<size_t> client_count = 0;
+	std::atomic<float> fec_overhead = 0; //read when frames are built, on the fragment thread with the pipeline
+
 public:
 
 	struct __attribute__((packed)) Header
@@ -59,43 +81,203 @@ public:
 
 	struct __attribute__((packed)) ImageMetadata
 	{
-		uint64_t timestamp;
+		uint64_t timestamp; //capture time in microseconds since the unix epoch, 0 = unknown
 		uint16_t width, height;
 		uint8_t encoding;
 		uint8_t identifier;
 	};
 
+	//Follows the Header of every Image packet, the packet payload is a slice of the frame data
+	//Indices past count are parity fragments, the XOR of a group of data fragments
+	struct __attribute__((packed)) FragmentHeader
+	{
+		uint32_t frame; //sender frame counter
+		uint16_t index; //index of this fragment in the frame
+		uint16_t count; //number of data fragments in the frame
+		uint16_t group; //data fragments covered by each parity fragment, 0 = no parity
+		uint32_t size; //size of the whole frame data
+		ImageMetadata metadata;
+	};
+
+	static constexpr int MaxFragmentPayload = MaxDatagramSize - sizeof(Header) - sizeof(FragmentHeader);
+
+	//Sent by clients for fragments that didn't arrive, followed by a bitmap of (count+7)/8 bytes
+	//Bit i set = data fragment first+i is missing
+	struct __attribute__((packed)) NackHeader
+	{
+		uint32_t frame;
+		uint16_t first;
+		uint16_t count;
+	};
+
+	static constexpr int MaxNackBits = (MaxDatagramSize - sizeof(Header) - sizeof(NackHeader)) * 8;
+
 	struct Image
 	{
 		ImageMetadata metadata;
 		std::vector<uint8_t> data;
 	};
-	
-	
 
+	//Called from a decode thread with every decoded image, the buffer is recycled when the last reference goes away
+	typedef std::function<void(std::shared_ptr<Image>)> ImageCallback;
+
+	struct SendQueueStatistics
+	{
+		uint64_t sent; //frames fully handed to the transport
+		uint64_t conflated; //frames replaced by a newer one before being sent
+		uint64_t dropped; //frames lost because the client went away
+	};
+
+private:
+	//A frame split in fragments, shared by the client queues and the retransmit cache
+	struct OutgoingFrame
+	{
+		Header head = Header(PacketTypes::Image);
+		std::vector<uint8_t> data;
+		std::vector<uint8_t> parity;
+		std::vector<FragmentHeader> fragments; //data fragments first, then parity
+		std::vector<iovec> iovs; //3 per fragment, pointing into this frame
+		std::vector<uint16_t> order; //order in which fragments are sent
+		std::chrono::system_clock::time_point deadline; //end of retransmission
+		bool keyframe = true; //false when it can't be decoded without an earlier frame
+	};
+
+	//Frames waiting for a client, at most one per identifier
+	struct ClientQueue
+	{
+		std::shared_ptr<ConnectionToken> token;
+		std::shared_ptr<OutgoingFrame> current; //being sent
+		size_t position = 0; //in current->order
+		std::deque<std::shared_ptr<OutgoingFrame>> pending;
+		SendQueueStatistics statistics = {0, 0, 0};
+	};
+
+	//protects clients, the retransmit cache and the settings read while sending, the pipeline's send thread holds it too
+	mutable std::mutex sendmutex;
+	std::vector<ClientQueue> clients; //clients that sent an handshake
+
+	std::deque<std::shared_ptr<OutgoingFrame>> sent_frames; //retransmit cache
+	size_t sent_bytes = 0;
+	size_t retransmit_cache_size = 0;
+	std::atomic<std::chrono::milliseconds> retransmit_deadline{std::chrono::milliseconds(0)}; //read when frames are built
+	std::chrono::milliseconds nack_interval{0};
+	std::atomic<uint64_t> retransmitted = 0;
+	std::chrono::milliseconds frame_lifetime{0};
+
+	//Image copied out of the caller's buffer, waiting to be encoded
+	struct PendingImage
+	{
+		ImageMetadata metadata;
+		std::vector<uint8_t> data;
+		bool keyframe = true;
+	};
+
+	std::unique_ptr<SendPipeline> pipeline; //last so that their threads stop first
+	friend class SendPipeline;
+	std::unique_ptr<ReceivePipeline> receive_pipeline;
+	friend class ReceivePipeline;
+
+	//Encode the pixels according to metadata.encoding into out, unknown encodings are copied as they are
+	bool EncodeImage(const void* buffer, size_t length, const ImageMetadata &metadata, std::vector<uint8_t> &out, bool &keyframe);
+	std::shared_ptr<OutgoingFrame> BuildFrame(std::vector<uint8_t> data, ImageMetadata metadata);
+	//Hand a built frame to every client queue
+	void QueueFrame(const std::shared_ptr<OutgoingFrame> &frame);
+	//Flush and ServerReceive, sendmutex must be held
+	void FlushClients();
+	void ReceiveRequests();
+	//Whether a client has fragments the transport didn't take yet, sendmutex must be held
+	bool HasQueuedFragments() const;
+	void Enqueue(ClientQueue &client, const std::shared_ptr<OutgoingFrame> &frame);
+	void CacheFrame(const std::shared_ptr<OutgoingFrame> &frame);
+	GenericTransport::MessageOptions GetImageOptions(const OutgoingFrame &frame) const;
+	WorkerPool* GetWorkers();
+	void HandleNack(const uint8_t* message, size_t length, std::shared_ptr<ConnectionToken> client);
+	void SendNacks();
+	//Drain the transport until a frame is complete, the frame is still encoded
+	std::optional<Image> ReceiveFrame();
+	//Turn a complete frame into Raw pixels, false if it can't be decoded
+	//Buffers come from pool and the encoded one goes back to it when given, even if decoding fails
+	bool DecodeImage(Image &image, DeltaDecoder &decoder, FramePool* pool);
+
+public:
+
+	//Empty server ip = server listening on DefaultPort, otherwise client of that server over UDP
 	ImageProtocol(std::string InServerIP);
+	//Use an existing transport. No server token = server
+	ImageProtocol(std::shared_ptr<GenericTransport> InTransport, std::shared_ptr<ConnectionToken> InServer);
 	~ImageProtocol();
 
 	bool IsServer() const
 	{
-		return server_ip.size() == 0;
+		return server == nullptr;
 	}
 
 	static PacketTypes GetPacketType(const char buffer[8]);
 
 	void Handshake();
 
-	void SendImage(void* buffer, size_t length, ImageMetadata metadata);
+	//Split the image in fragments and queue them for every client that sent an handshake
+	//A queued frame that wasn't sent yet is replaced by a newer one with the same identifier
+	//Raw pixels with a Delta or Lossless encoding are encoded here, width*height must divide length
+	void SendImage(const void* buffer, size_t length, ImageMetadata metadata);
+
+	//Send queued fragments until the transport would block, called by SendImage and ServerReceive
+	void Flush();
+
+	//Encode, fragment and send on three threads linked by queues of queuedepth frames
+	//SendImage then only copies the image, and drops it if the pipeline is full
+	//The send thread calls ServerReceive and Flush itself, don't call them while the pipeline runs
+	//It attaches the transport to its own event loop, replacing any loop the transport was attached to
+	void StartPipeline(int queuedepth = 4);
+	void StopPipeline();
+
+	//Frames SendImage dropped because the pipeline was full
+	uint64_t GetPipelineDroppedFrames() const;
+
+	//Counters of a client's send queue, nothing if the client isn't known
+	std::optional<SendQueueStatistics> GetSendQueueStatistics(std::shared_ptr<ConnectionToken> client) const;
 
 	void ServerReceive();
 
+	//Returns the next complete image, incomplete frames are dropped after the reassembly timeout
 	std::optional<Image> ReceiveImage();
 
-private:
-#if 0
-	static void SteamNetConnectionStatusChangedCallback( struct SteamNetConnectionStatusChangedCallback_t *pInfo );
-	void OnSteamNetConnectionStatusChanged( struct SteamNetConnectionStatusChangedCallback_t *pInfo );
-#endif
-};
+	//Receive on a dedicated thread and decode on a pool of decodethreads (0 = one per hardware thread)
+	//Images of an identifier reach callback in order, different identifiers are decoded in parallel
+	//Don't call ReceiveImage while the pipeline runs
+	void StartReceivePipeline(ImageCallback callback, int decodethreads = 0);
+	void StopReceivePipeline();
+
+	//Frames dropped because the decoders couldn't keep up
+	uint64_t GetReceivePipelineDroppedFrames() const;
+
+	void SetReassemblyTimeout(std::chrono::milliseconds timeout);
+
+	//Frames between two Delta keyframes, a keyframe is also sent when a client joins
+	void SetKeyframeInterval(int frames);
 
+	//Send one parity fragment per group of data fragments so that a single loss per group can be rebuilt
+	//overhead is the ratio of parity to data fragments, 0 disables it
+	void SetFEC(float overhead);
 
+	uint64_t GetDroppedFrames() const;
+
+	uint64_t GetRecoveredFragments() const;
+
+	//Server : keep the last frames, up to cachesize bytes, and resend the fragments clients NACK
+	//Fragments are only resent until deadline after the frame timestamp, 0 disables retransmission
+	//NACKs are handled in ServerReceive
+	void SetRetransmission(std::chrono::milliseconds deadline, size_t cachesize = 16*1024*1024);
+
+	//Fragments are sent unordered on transports that support it. With a lifetime, transports with partial reliability
+	//stop retransmitting a fragment that couldn't be delivered in time instead of holding newer frames behind it. 0 = reliable
+	void SetFrameLifetime(std::chrono::milliseconds lifetime);
+
+	//Client : NACK fragments missing for longer than interval, 0 disables NACKs
+	void SetNackInterval(std::chrono::milliseconds interval);
+
+	uint64_t GetRetransmittedFragments() const
+	{
+		return retransmitted;
+	}
+};
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+class WorkerPool;
+
+//Lossless codec for 8 and 16 bit images, camera or depth
+//Each sample is predicted from its left, up and up-left neighbours (gradient, modulo the sample range),
+//the zigzagged residuals are then bit packed by blocks of BlockSize samples
+//The image is cut in slices of SliceRows rows that are coded independently, in parallel when given a pool
+class LosslessCodec
+{
+public:
+	static constexpr int BlockSize = 32;
+	static constexpr int SliceRows = 64;
+
+	//Starts the payload, followed by one uint32_t size per slice then the slices
+	struct __attribute__((packed)) LosslessHeader
+	{
+		uint8_t samplesize; //1 or 2 bytes
+		uint8_t channels; //interleaved samples per pixel
+		uint16_t slices;
+	};
+
+	//Encode width*height pixels of channels samples of samplesize bytes into out
+	static bool Encode(const void* pixels, uint16_t width, uint16_t height, int channels, int samplesize, 
+		std::vector<uint8_t> &out, WorkerPool* pool = nullptr);
+
+	//Decode into out, false if the payload doesn't match the dimensions or is corrupted
+	static bool Decode(const uint8_t* encoded, size_t length, uint16_t width, uint16_t height, 
+		std::vector<uint8_t> &out, WorkerPool* pool = nullptr);
+};
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <Protocol/ImageProtocol.hpp>
+#include <Transport/PipelineStage.hpp>
+#include <Transport/WorkerPool.hpp>
+#include <atomic>
+#include <mutex>
+#include <deque>
+#include <map>
+
+class DeltaDecoder;
+class FramePool;
+
+//Receiver side of ImageProtocol : one thread drains the transport and reassembles frames,
+//a worker pool decodes them and hands them to the callback
+//Frames of an identifier are decoded and delivered in order, different identifiers in parallel
+class ReceivePipeline
+{
+private:
+	//Frames of one identifier waiting for a worker, at most one worker runs a strand at a time
+	struct Strand
+	{
+		std::mutex strandmutex; //protects pending and running
+		std::deque<ImageProtocol::Image> pending;
+		bool running = false;
+		std::unique_ptr<DeltaDecoder> delta;
+	};
+
+	//Frames of an identifier that can wait, the oldest is dropped past that
+	static constexpr size_t MaxPendingPerIdentifier = 4;
+
+	ImageProtocol* Protocol;
+	ImageProtocol::ImageCallback Callback;
+	std::shared_ptr<FramePool> Pool;
+	std::atomic<uint64_t> dropped = 0;
+	std::map<uint8_t, std::unique_ptr<Strand>> strands; //only touched by the receive thread
+
+	//after the strands, stopped before they go away
+	WorkerPool decoders;
+	PipelineStage receiver;
+
+	bool ReceiveStep();
+	void Dispatch(ImageProtocol::Image &&image);
+	void RunStrand(Strand* strand);
+
+public:
+	ReceivePipeline(ImageProtocol* InProtocol, ImageProtocol::ImageCallback InCallback, std::shared_ptr<FramePool> InPool, int InNumThreads);
+	~ReceivePipeline();
+
+	uint64_t GetDroppedFrames() const
+	{
+		return dropped;
+	}
+};
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <Protocol/ImageProtocol.hpp>
+#include <Transport/SPSCQueue.hpp>
+#include <Transport/PipelineStage.hpp>
+#include <Transport/EventLoop.hpp>
+#include <atomic>
+
+//Sender side of ImageProtocol split in encode, fragment and send stages
+//so that frame N+1 is encoded while frame N goes out
+//While it runs the transport is attached to the pipeline's event loop, the idle send thread sleeps on it
+class SendPipeline
+{
+private:
+	ImageProtocol* Protocol;
+	std::atomic<uint64_t> dropped = 0;
+
+	SPSCQueue<ImageProtocol::PendingImage> rawqueue; //SendImage -> encode
+	SPSCQueue<ImageProtocol::PendingImage> encodedqueue; //encode -> fragment
+	SPSCQueue<std::shared_ptr<ImageProtocol::OutgoingFrame>> framequeue; //fragment -> send
+
+	EventLoop loop; //transport events and frames wake the send thread
+	bool attached = false; //false = the transport has no events, the send thread polls
+
+	//after the queues, stopped before they go away
+	PipelineStage encoder;
+	PipelineStage fragmenter;
+	PipelineStage sender;
+
+	bool EncodeStep();
+	bool FragmentStep();
+	bool SendStep();
+
+	void WakeSender();
+
+public:
+	SendPipeline(ImageProtocol* InProtocol, int InQueueDepth);
+	~SendPipeline();
+
+	//Called from the thread calling SendImage, false if the pipeline is full
+	bool Push(ImageProtocol::PendingImage &&image);
+
+	uint64_t GetDroppedFrames() const
+	{
+		return dropped;
+	}
+};
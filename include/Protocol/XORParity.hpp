@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+//XOR parity used to rebuild a lost fragment from the rest of its group
+//Uses AVX2 or SSE2 when the CPU has them, plain C++ otherwise
+class XORParity
+{
+public:
+	//parity ^= data over length bytes
+	static void Accumulate(uint8_t* parity, const uint8_t* data, size_t length);
+
+	//Name of the implementation picked for this CPU
+	static const char* GetImplementation();
+};
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <netinet/in.h>
+
+class ConnectionToken;
+
+//Open addressing hash table from an (address, port) pair to a token
+//Not thread safe, the owning transport is expected to guard it with its connection lock
+class AddressIndex
+{
+private:
+	struct Slot
+	{
+		uint64_t key;
+		std::shared_ptr<ConnectionToken> token; //null when the slot is empty
+	};
+
+	std::vector<Slot> slots;
+	size_t count;
+	int shift; //64 - log2(slots.size())
+
+	static uint64_t MakeKey(const sockaddr_in &address);
+	size_t Home(uint64_t key) const;
+	//Index of the slot holding key, or of the empty slot where it would go
+	size_t Probe(uint64_t key) const;
+	void Rehash(size_t capacity);
+
+public:
+	AddressIndex(size_t initialCapacity = 16);
+
+	std::shared_ptr<ConnectionToken> Find(const sockaddr_in &address) const;
+
+	//Insert or replace the token for this address
+	void Insert(const sockaddr_in &address, std::shared_ptr<ConnectionToken> token);
+
+	void Erase(const sockaddr_in &address);
+
+	void Clear();
+
+	size_t Size() const
+	{
+		return count;
+	}
+};
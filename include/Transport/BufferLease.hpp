@@ -0,0 +1,54 @@
+#pragma once
+
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+
+//Read only view on memory owned by a transport
+//The memory stays valid until the lease is destroyed or released, then goes back to its owner
+class BufferLease
+{
+public:
+	//Whoever lent the memory, told when it's given back
+	class Owner
+	{
+	public:
+		virtual ~Owner() = default;
+		virtual void ReleaseLease(uint64_t handle) = 0;
+	};
+
+private:
+	std::shared_ptr<Owner> LeaseOwner;
+	uint64_t Handle;
+	const uint8_t* Data;
+	size_t Size;
+
+public:
+	//Empty lease, no data
+	BufferLease();
+	BufferLease(std::shared_ptr<Owner> InOwner, uint64_t InHandle, const uint8_t* InData, size_t InSize);
+	~BufferLease();
+
+	BufferLease(const BufferLease&) = delete;
+	BufferLease& operator=(const BufferLease&) = delete;
+	BufferLease(BufferLease &&other);
+	BufferLease& operator=(BufferLease &&other);
+
+	const uint8_t* GetData() const
+	{
+		return Data;
+	}
+
+	size_t GetSize() const
+	{
+		return Size;
+	}
+
+	bool IsEmpty() const
+	{
+		return Size == 0;
+	}
+
+	//Give the memory back early
+	void Release();
+};
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#include <Transport/BufferLease.hpp>
+
+//Fixed size buffers, allocated on first use and recycled through a free list
+//Thread safe. A buffer is only touched by whoever acquired it until it's released
+//Must be owned by a shared_ptr to hand out leases
+class BufferPool : public BufferLease::Owner, public std::enable_shared_from_this<BufferPool>
+{
+private:
+	std::mutex poolmutex; //protects buffers and freelist
+	size_t BufferSize;
+	std::vector<std::unique_ptr<uint8_t[]>> buffers; //MaxBuffers entries, null until first used
+	std::vector<int> freelist;
+	int allocated;
+	int inuse;
+public:
+	BufferPool(size_t InBufferSize, int InMaxBuffers);
+
+	//Get a buffer index, -1 if all the buffers are in use
+	int Acquire();
+	//Give a buffer back to the pool
+	void Release(int index);
+
+	//Hand an acquired buffer over to a lease, which releases it when done
+	BufferLease Lease(int index, size_t length);
+
+	virtual void ReleaseLease(uint64_t handle) override;
+
+	uint8_t* GetBuffer(int index) const
+	{
+		return buffers[index].get();
+	}
+
+	size_t GetBufferSize() const
+	{
+		return BufferSize;
+	}
+
+	int GetMaxBuffers() const
+	{
+		return buffers.size();
+	}
+
+	//Number of buffers currently acquired
+	int GetInUse();
+};
@@ -5,7 +5,10 @@
 #include <memory>
 #include <optional>
 
-class GenericTransport;
+#include <Transport/BufferLease.hpp>
+#include <Transport/GenericTransport.hpp>
+
+struct iovec;
 
 class ConnectionToken : public std::enable_shared_from_this<ConnectionToken>
 {
@@ -43,7 +46,17 @@ public:
 	//If disconnected, the transport forgets the token
 	std::optional<int> Receive(void* buffer, int maxlength);
 
+	//receive data using token without copying it out of the transport. No return value = disconnected
+	//An empty lease means nothing was received
+	std::optional<BufferLease> ReceiveView();
+
 	//send data using token. false = disconnected
 	//If disconnected, the transport forgets the token
 	bool Send(const void* buffer, int length);
+
+	//send the concatenation of iovcnt buffers as a single message. false = disconnected
+	bool Send(const iovec* iov, int iovcnt);
+
+	//same, with delivery options the transport may honour
+	bool Send(const iovec* iov, int iovcnt, const GenericTransport::MessageOptions &options);
 };
\ No newline at end of file
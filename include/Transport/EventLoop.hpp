@@ -0,0 +1,48 @@
+#pragma once
+
+#include <Transport/Task.hpp>
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <map>
+#include <cstdint>
+
+//epoll reactor : watches file descriptors and dispatches their events to callbacks
+//Either call Poll from your own thread, or Start it as a Task
+//Must outlive the transports attached to it
+class EventLoop : public Task
+{
+public:
+	//Receives the epoll event mask (EPOLLIN, EPOLLOUT, EPOLLRDHUP...)
+	typedef std::function<void(uint32_t events)> Callback;
+
+private:
+	int epollfd;
+	int wakefd; //eventfd used to interrupt epoll_wait
+	std::mutex callbackmutex; //protects callbacks
+	std::map<int, std::shared_ptr<Callback>> callbacks;
+
+public:
+	static constexpr int MaxEventsPerPoll = 64;
+
+	EventLoop();
+	virtual ~EventLoop();
+
+	//Watch a file descriptor. Events are edge triggered : the callback must read or write until EAGAIN
+	bool Add(int fd, uint32_t events, Callback callback);
+	//Change the events watched on a file descriptor
+	bool Modify(int fd, uint32_t events);
+	//Stop watching a file descriptor, call before closing it
+	void Remove(int fd);
+
+	//Wait up to timeoutms (-1 = forever) for events and dispatch them
+	//Returns the number of events dispatched
+	int Poll(int timeoutms);
+
+	//Make a Poll in progress return early
+	void Wake();
+
+protected:
+	virtual void ThreadEntryPoint() override;
+};
@@ -7,8 +7,16 @@
 #include <set>
 #include <memory>
 #include <optional>
+#include <functional>
+#include <cstdint>
+#include <chrono>
+#include <sys/uio.h>
+
+#include <Transport/BufferLease.hpp>
 
 class ConnectionToken;
+class BufferPool;
+class EventLoop;
 
 //Generic class to send data to other programs
 class GenericTransport
@@ -16,6 +24,9 @@ class GenericTransport
 private:
 	static std::mutex TransportListMutex;
 	static std::set<GenericTransport*> ActiveTransportList;
+
+	std::once_flag ViewPoolFlag;
+	std::shared_ptr<BufferPool> ViewPool; //backs the default ReceiveView
 public:
 
 	GenericTransport();
@@ -26,25 +37,101 @@ public:
 
 	static const std::string BroadcastClient;
 
+	//How a transport talks to the kernel
+	enum class IOBackend
+	{
+		Sockets, //plain socket syscalls
+		IOUring //io_uring with multishot requests, falls back to Sockets when unavailable
+	};
+
 	static void printBuffer(const void *buffer, int length);
 
 	//Get all connected clients
 	virtual std::vector<std::shared_ptr<ConnectionToken>> GetClients() const;
 
+	//Receive from whichever client has data, no token = nothing received
+	//The default tries every client in turn
+	virtual std::pair<int, std::shared_ptr<ConnectionToken>> ReceiveAny(void *buffer, int maxlength);
+
+	//How a message should be delivered, transports that can't honour it send it normally
+	struct MessageOptions
+	{
+		uint16_t stream = 0; //messages are ordered within a stream, a stream doesn't wait on the others
+		bool unordered = false; //deliver as soon as it arrives, even before earlier messages of its stream
+		std::chrono::milliseconds lifetime{0}; //give up sending the message after that long, 0 = keep trying
+	};
+
+	struct Datagram
+	{
+		void* buffer;
+		int maxlength; //size of buffer, used on receive
+		int length; //length of the payload : filled on receive, read on send
+		std::shared_ptr<ConnectionToken> token;
+		const iovec* iov = nullptr; //gathered payload, sent instead of buffer when set
+		int iovcnt = 0;
+		MessageOptions options;
+	};
+
+	//Send several messages, possibly to different tokens, in as few syscalls as the transport allows
+	//Returns the number of messages sent, stops at the first one that can't be sent
+	virtual int SendBatch(const Datagram* datagrams, int count);
+
+	//Same as SendBatch, but stops instead of blocking when the transport can't take more data
+	//Transports that can't tell just block
+	virtual int TrySendBatch(const Datagram* datagrams, int count);
+
 	//Check the validity of a token. If disconnected, returns false.
 	bool CheckToken(const std::shared_ptr<ConnectionToken> &token);
 
+	enum class TransportEvent
+	{
+		Accepted, //a new client connected
+		Readable, //data is waiting, receive until nothing comes out
+		Writable //the socket can take more data
+	};
+
+	//token is null when the socket is shared and the sender is only known once the data is read
+	typedef std::function<void(std::shared_ptr<ConnectionToken> token, TransportEvent event)> EventCallback;
+
+	//Have loop watch this transport's sockets instead of polling them. callback runs on the thread polling the loop
+	//Returns false if this transport can't be driven by an event loop
+	virtual bool AttachEventLoop(EventLoop* loop, EventCallback callback);
+	//Stop being watched by the loop, done automatically when the transport is destroyed
+	virtual void DetachEventLoop();
+
+	//Size the kernel buffers of the transport's sockets, 0 keeps the current size
+	//Returns false if this transport can't set them
+	virtual bool SetBufferSizes(int sendsize, int receivesize);
+
 protected:
+	//Set SO_SNDBUF/SO_RCVBUF, going past the system maximum when we have the privilege to
+	static bool SetSocketBufferSizes(int fd, int sendsize, int receivesize);
+
+	EventLoop* Loop = nullptr;
+	EventCallback OnEvent;
+
 	//receive data using token. No return value = disconnected
 	//If disconnected, the transport forgets the token
 	virtual std::optional<int> Receive(void* buffer, int maxlength, std::shared_ptr<ConnectionToken> token);
+	//receive data using token into transport owned memory. No return value = disconnected, empty lease = no data
+	//The default receives into a pooled buffer, transports that already hold the data lend it without copying
+	virtual std::optional<BufferLease> ReceiveView(std::shared_ptr<ConnectionToken> token);
 	//send data using token. false = disconnected
 	//If disconnected, the transport forgets the token
 	virtual bool Send(const void* buffer, int length,  std::shared_ptr<ConnectionToken> token);
+	//send data gathered from several buffers as a single message. false = disconnected
+	//The default copies the pieces together, transports override it with sendmsg
+	virtual bool Send(const iovec* iov, int iovcnt, std::shared_ptr<ConnectionToken> token);
+	//send a message with delivery options. false = disconnected
+	//The default ignores the options
+	virtual bool Send(const iovec* iov, int iovcnt, const MessageOptions &options, std::shared_ptr<ConnectionToken> token);
 
 	//Disconnect a client : the transport forgets about the client and the token
 	virtual void DisconnectClient(std::shared_ptr<ConnectionToken> token);
 
+	//Largest message a single Receive can return, sizes the buffers of the default ReceiveView
+	virtual size_t GetMaxMessageSize() const;
+
 public:
 
 	struct NetworkInterface
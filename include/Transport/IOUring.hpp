@@ -0,0 +1,132 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <functional>
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+
+#include <Transport/BufferLease.hpp>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct io_uring_buf;
+struct msghdr;
+
+//Minimal io_uring engine, talks to the kernel directly without liburing
+//Receives pick their memory from a ring of provided buffers, so multishot requests keep running without resubmission
+//Must be owned by a shared_ptr to lend its buffers
+class IOUring : public BufferLease::Owner
+{
+public:
+	struct Completion
+	{
+		uint64_t userdata;
+		int result; //bytes or fd on success, -errno on failure
+		bool more; //the multishot request is still armed
+		const uint8_t* buffer; //provided buffer holding the data, null if none was used
+		int bufferid; //of buffer, -1 if none
+		bool keep; //set by the callback to hold on to buffer until ReleaseBuffer
+	};
+
+	//Receives each completion. The provided buffer goes back to the kernel once it returns, unless it's kept
+	typedef std::function<void(Completion &completion)> CompletionCallback;
+
+private:
+	int ringfd;
+	std::mutex ringmutex; //protects the submission queue and the buffer ring
+	std::mutex reapmutex; //one reaper at a time, so that completions are handled in order
+
+	void* sqring;
+	size_t sqringsize;
+	void* cqring;
+	size_t cqringsize;
+	io_uring_sqe* sqes;
+	size_t sqessize;
+	unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+	unsigned *cqhead, *cqtail, *cqmask;
+	io_uring_cqe* cqes;
+	unsigned sqentries;
+	unsigned pending; //sqes queued but not submitted yet
+
+	io_uring_buf* bufring; //io_uring_buf_ring's layout is off in C++, it's addressed as a plain array
+	size_t bufringsize;
+	std::vector<uint8_t> bufstorage;
+	int BufferCount;
+	int BufferSize;
+	std::atomic<int> held = 0; //provided buffers kept by callbacks, the kernel can't use them
+
+	IOUring();
+	bool Setup(unsigned entries, int bufferCount, int bufferSize);
+	//Check that multishot receive with provided buffers works on this kernel
+	bool Probe();
+	io_uring_sqe* GetSQE(); //ringmutex must be held
+	void RecycleBuffer(int bufferid);
+
+public:
+	static constexpr uint16_t BufferGroup = 0;
+
+	//Returns null if io_uring or the features used here aren't available, use the socket path then
+	//bufferCount must be a power of two
+	static std::unique_ptr<IOUring> Create(unsigned entries = 256, int bufferCount = 64, int bufferSize = UINT16_MAX + 1);
+
+	virtual ~IOUring();
+
+	IOUring(const IOUring&) = delete;
+	IOUring& operator=(const IOUring&) = delete;
+
+	//Readable when completions are waiting, can be watched by an EventLoop
+	int GetFileDescriptor() const
+	{
+		return ringfd;
+	}
+
+	int GetBufferSize() const
+	{
+		return BufferSize;
+	}
+
+	int GetBufferCount() const
+	{
+		return BufferCount;
+	}
+
+	const uint8_t* GetBuffer(int bufferid) const
+	{
+		return bufstorage.data() + (size_t)bufferid * BufferSize;
+	}
+
+	//Provided buffers kept and not released yet
+	int GetHeldBuffers() const
+	{
+		return held;
+	}
+
+	//Give a kept provided buffer back to the kernel
+	void ReleaseBuffer(int bufferid);
+
+	//Hand a kept provided buffer over to a lease, which releases it when done
+	BufferLease Lend(const std::shared_ptr<IOUring> &self, int bufferid, size_t offset, size_t length);
+
+	virtual void ReleaseLease(uint64_t handle) override;
+
+	//Queue requests, they're sent to the kernel by the next Submit
+	//Each data carrying completion has a provided buffer, the request stays armed while Completion::more is set
+	bool RecvMultishot(int fd, uint64_t userdata);
+	//The buffer starts with an io_uring_recvmsg_out, followed by msg_namelen bytes of address then the payload
+	//message must outlive the request
+	bool RecvMsgMultishot(int fd, msghdr* message, uint64_t userdata);
+	bool AcceptMultishot(int fd, uint64_t userdata);
+	//Completes once, with the poll events that fd reported
+	bool PollAdd(int fd, uint32_t events, uint64_t userdata);
+	bool Cancel(uint64_t userdata);
+
+	//Hand the queued requests to the kernel, optionally waiting for completions
+	int Submit(unsigned waitfor = 0);
+
+	//Run callback on every waiting completion, returns how many there were
+	//Callers are serialized, completions of a request are handled in the order the kernel posted them
+	int Reap(const CompletionCallback &callback);
+};
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <Transport/Task.hpp>
+
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <string>
+
+//Task that runs a step function over and over, sleeping when the step had nothing to do
+//The sleep ends on Wake or after the idle wait, so steps can also poll
+class PipelineStage : public Task
+{
+public:
+	//Returns false when there was nothing to do
+	typedef std::function<bool()> Step;
+
+private:
+	std::string Name;
+	Step Body;
+	std::chrono::microseconds IdleWait;
+	std::mutex wakemutex;
+	std::condition_variable wakecondition;
+	bool woken = false;
+
+public:
+	PipelineStage(std::string InName, Step InBody, std::chrono::microseconds InIdleWait = std::chrono::milliseconds(1));
+	virtual ~PipelineStage();
+
+	//Make the stage run its step now, call after feeding its input
+	void Wake();
+
+protected:
+	virtual void ThreadEntryPoint() override;
+};
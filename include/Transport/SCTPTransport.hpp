@@ -3,10 +3,16 @@
 #include <Transport/GenericTransport.hpp>
 
 #include <shared_mutex>
+#include <mutex>
 #include <vector>
 #include <map>
 #include <list>
+#include <deque>
+#include <chrono>
+#include <atomic>
+#include <tuple>
 #include <netinet/in.h>
+#include <linux/sctp.h>
 
 #include <Transport/Task.hpp>
 
@@ -17,22 +23,64 @@
 class SCTPTransport : public GenericTransport
 {
 private:
+	//Message drained from the socket while receiving for another association
+	struct QueuedMessage
+	{
+		std::vector<uint8_t> data;
+		MessageOptions options;
+	};
+
 	struct SCTPConnection
 	{
 		sockaddr_in address;
 		std::string name;
+		sctp_assoc_t association = 0; //0 until the association is known
+		int outstreams = 0; //streams we may send on, settled with the peer. 0 until the association is known
+		bool multihomed = false; //the peer has several addresses, the heartbeat settings apply
+		std::deque<QueuedMessage> backlog;
+		uint64_t dropped = 0;
 	};
 
+	//Messages read from the socket in one drain
+	static constexpr int DrainBatch = 64;
+	//Messages kept per association, the oldest is dropped past that
+	static constexpr size_t BacklogCapacity = 256;
+	//Read size of the socket, longer messages come in several reads and are put back together
+	static constexpr size_t ReceiveChunkSize = 256*1024;
+
 	bool Server;
 	std::string IP, Interface;
 	int Port;
+	int Streams; //asked for in both directions when associations are set up
 	int sockfd;
 	bool Connected;
-	mutable std::shared_mutex listenmutex; //protects connections
+	mutable std::shared_mutex listenmutex; //protects connections and associations
 	std::map<std::shared_ptr<ConnectionToken>, SCTPConnection> connections;
+	std::map<sctp_assoc_t, std::shared_ptr<ConnectionToken>> associations;
+	std::mutex drainmutex; //serializes socket drains so that backlogs keep arrival order, protects scratch
+	std::vector<uint8_t> scratch;
+	//Messages delivered in pieces, by association, stream and unordered flag. Protected by drainmutex
+	std::map<std::tuple<sctp_assoc_t, uint16_t, bool>, std::vector<uint8_t>> partials;
+	std::atomic<int> SendBufferSize; //as reported by the kernel, grown to fit the largest message sent
+	std::atomic<int> SendBufferLimit; //the kernel wouldn't grow the send buffer past that, larger messages can't be sent
+	std::vector<sockaddr_in> LocalAddresses; //bound together, empty = every address of the host
+	std::vector<sockaddr_in> ServerAddresses; //the client sets its association up over all of them, the first is the primary path
+	std::chrono::milliseconds HeartbeatInterval; //protected by listenmutex
+	int PathMaxRetransmits; //protected by listenmutex
 public:
 
-	SCTPTransport(bool inServer, std::string inIP, int inPort, std::string inInterface);
+	static constexpr int DefaultStreams = 16;
+	//Messages are split in chunks by SCTP and interleaved with the other streams, up to that size
+	static constexpr size_t MaxMessageSize = 8*1024*1024;
+	static constexpr int DefaultSocketBufferSize = 2*1024*1024;
+	//On associations with several peer addresses, traffic leaves a path as soon as a heartbeat or retransmission goes unanswered,
+	//it is given up after PathMaxRetransmits. Single homed associations keep the kernel defaults, they have no path to fail over to
+	static constexpr std::chrono::milliseconds DefaultHeartbeatInterval{200};
+	static constexpr int DefaultPathMaxRetransmits = 2;
+
+	//inIP and inInterface may list several addresses separated by commas for multi-homing, eg "127.0.0.1,127.0.0.2"
+	//inInterface takes interface names or local addresses, empty binds every address of the host
+	SCTPTransport(bool inServer, std::string inIP, int inPort, std::string inInterface, int inStreams = DefaultStreams);
 
 	virtual ~SCTPTransport(); //frees all allocated sockets
 
@@ -41,18 +89,78 @@ private:
 	bool Connect(); //attempt to connect to server
 	void CheckConnection(); //create socket and connect if needed
 	void DeleteSocket(int fd); //free socket
+	void WatchSocket(); //have the event loop watch sockfd, Loop must be set
+	//Read the socket, queuing messages in the backlog of their association. drainmutex must be held
+	//The first message for target (any association if null) is copied to buffer instead, its length is returned
+	std::optional<int> DrainSocket(const std::shared_ptr<ConnectionToken> &target, void* buffer, int maxlength,
+		MessageOptions &options, std::shared_ptr<ConnectionToken> &sender);
+	//Token of the association a message came from, registering new peers. listenmutex must be held exclusively
+	std::shared_ptr<ConnectionToken> ResolveAssociation(sctp_assoc_t association, const sockaddr_in &address);
+	//Take the oldest queued message of a connection, listenmutex must be held exclusively
+	int PopBacklog(SCTPConnection &connection, void* buffer, int maxlength, MessageOptions &options);
+	//Outbound streams the peer accepted on an association, 0 if unknown
+	int GetOutboundStreams(sctp_assoc_t association) const;
+	//Number of addresses the peer of an association has, 0 if unknown
+	int GetPeerAddressCount(sctp_assoc_t association) const;
+	//Settings of a connection whose association just became known, listenmutex must be held exclusively
+	void SetupAssociation(SCTPConnection &connection);
+	//Read the send buffer size back from the kernel, which may have capped it
+	void UpdateSendBufferSize();
+	//Heartbeat and path failure thresholds of an association, listenmutex must be held
+	void ApplyHeartbeat(sctp_assoc_t association);
+	//Addresses of a comma separated list of addresses or interface names
+	static std::vector<sockaddr_in> ParseAddresses(const std::string &list, int port);
+	//Association changes, returns the associations that are gone
+	std::vector<std::shared_ptr<ConnectionToken>> HandleNotification(const uint8_t* notification, int length);
 public:
 
+	//BroadcastClient gives a token whose messages go to every association in a single SCTP_SENDALL send
 	std::shared_ptr<ConnectionToken> Connect(std::string address);
 	std::shared_ptr<ConnectionToken> Connect(sockaddr_in address);
 
 	virtual std::vector<std::shared_ptr<ConnectionToken>> GetClients() const override;
 
+	//Send to the peer through one of its addresses by default, false if it isn't one of them
+	bool SetPrimaryPath(std::shared_ptr<ConnectionToken> token, std::string address);
+
+	virtual bool SetBufferSizes(int sendsize, int receivesize) override;
+
+	//How fast a dead path is detected on multi-homed associations, current and to come
+	bool SetHeartbeat(std::chrono::milliseconds interval, int pathmaxretransmits);
+
+	//Receive like a token would, and tell which stream the message came on and whether it was unordered
+	std::optional<int> ReceiveMessage(void* buffer, int maxlength, std::shared_ptr<ConnectionToken> token, MessageOptions &options);
+
+	//Receive the next message of any association, no token = nothing received
+	//Messages read for other associations while looking are queued for them
+	virtual std::pair<int, std::shared_ptr<ConnectionToken>> ReceiveAny(void *buffer, int maxlength) override;
+
+	//Number of messages of this association dropped because its backlog was full
+	uint64_t GetDroppedMessages(std::shared_ptr<ConnectionToken> token) const;
+
+	//Streams asked for. The peer may accept fewer, streams past its last one are sent on its last one
+	int GetStreamCount() const
+	{
+		return Streams;
+	}
+
+	//The server's one-to-many socket is shared, its readiness is reported with a null token
+	virtual bool AttachEventLoop(EventLoop* loop, EventCallback callback) override;
+	virtual void DetachEventLoop() override;
+
 protected:
 
 	virtual std::optional<int> Receive(void* buffer, int maxlength, std::shared_ptr<ConnectionToken> token) override;
 
 	virtual bool Send(const void* buffer, int length,  std::shared_ptr<ConnectionToken> token) override;
 
+	virtual bool Send(const iovec* iov, int iovcnt, std::shared_ptr<ConnectionToken> token) override;
+
+	//options.stream picks the SCTP stream, so that a large message only delays its own stream
+	//Unordered messages skip the stream's ordering, messages with a lifetime use PR-SCTP and are abandoned once it runs out
+	virtual bool Send(const iovec* iov, int iovcnt, const MessageOptions &options, std::shared_ptr<ConnectionToken> token) override;
+
 	virtual void DisconnectClient(std::shared_ptr<ConnectionToken> token) override;
+
+	virtual size_t GetMaxMessageSize() const override;
 };
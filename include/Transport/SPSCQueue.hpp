@@ -0,0 +1,74 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <optional>
+#include <cstddef>
+
+//Bounded lock-free queue for exactly one producer thread and one consumer thread
+template<typename T>
+class SPSCQueue
+{
+private:
+	std::vector<T> slots;
+	size_t mask;
+	//each index is written by one side only, keep them on separate cache lines
+	alignas(64) std::atomic<size_t> head{0}; //next slot to pop, written by the consumer
+	alignas(64) std::atomic<size_t> tail{0}; //next slot to push, written by the producer
+
+public:
+	//Capacity is rounded up to a power of two
+	SPSCQueue(size_t InCapacity)
+	{
+		size_t capacity = 1;
+		while (capacity < InCapacity)
+		{
+			capacity <<= 1;
+		}
+		slots.resize(capacity);
+		mask = capacity - 1;
+	}
+
+	//Producer side, false if the queue is full
+	bool Push(T&& value)
+	{
+		size_t position = tail.load(std::memory_order_relaxed);
+		if (position - head.load(std::memory_order_acquire) > mask)
+		{
+			return false;
+		}
+		slots[position & mask] = std::move(value);
+		tail.store(position + 1, std::memory_order_release);
+		return true;
+	}
+
+	//Producer side : once false, stays false until the producer pushes
+	bool IsFull() const
+	{
+		return tail.load(std::memory_order_relaxed) - head.load(std::memory_order_acquire) > mask;
+	}
+
+	//Consumer side, nothing if the queue is empty
+	std::optional<T> Pop()
+	{
+		size_t position = head.load(std::memory_order_relaxed);
+		if (position == tail.load(std::memory_order_acquire))
+		{
+			return std::nullopt;
+		}
+		std::optional<T> value = std::move(slots[position & mask]);
+		slots[position & mask] = T();
+		head.store(position + 1, std::memory_order_release);
+		return value;
+	}
+
+	size_t Size() const
+	{
+		return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+	}
+
+	size_t GetCapacity() const
+	{
+		return slots.size();
+	}
+};
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <Transport/GenericTransport.hpp>
+
+#include <shared_mutex>
+#include <mutex>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <chrono>
+#include <sys/types.h>
+
+//Shared memory transport for processes on the same host
+//The server creates a named segment holding a ring that every client reads in place,
+//each client also gets a small ring of its own to talk back to the server
+//Messages are written once : a message for one client is skipped by the others, a broadcast is read by all of them
+//Dead peers are found by pid, both sides must share the pid namespace
+
+class SharedMemoryTransport : public GenericTransport
+{
+public:
+	static constexpr size_t DefaultRingSize = 32*1024*1024;
+	static constexpr int DefaultMaxClients = 16;
+	//Ring of each client to the server, for handshakes and acknowledgements
+	static constexpr size_t UpstreamRingSize = 256*1024;
+	static constexpr std::chrono::milliseconds AliveCheckInterval{100};
+	//Only the user running the server can connect by default
+	static constexpr mode_t DefaultMode = 0600;
+
+private:
+	struct SharedRing;
+	struct Segment;
+	struct ClientSlot;
+
+	//A mapped segment, unmapped when the last connection or lease using it goes away
+	class Mapping
+	{
+	public:
+		Segment* segment;
+		size_t size;
+		Mapping(Segment* InSegment, size_t InSize);
+		~Mapping();
+	};
+
+	//Reading end of a ring. Records stay in place until their lease is released
+	class Channel : public BufferLease::Owner
+	{
+	private:
+		std::shared_ptr<Mapping> Memory;
+		SharedRing* Ring;
+		std::atomic<uint64_t>* Tail; //position published to the writer
+		const uint8_t* Data;
+		uint64_t Capacity;
+		uint32_t Destination; //records for other destinations are skipped
+		ClientSlot* Gate; //our slot, reading starts once the server accepted it and stops if it changes hands. null = open
+		uint32_t Generation; //of Gate when we claimed it
+		bool started = false; //readposition was taken from the tail
+		std::mutex channelmutex; //protects readposition and leases
+		uint64_t readposition = 0;
+		std::deque<uint64_t> leases; //start of the records lent out, oldest first
+		std::atomic<bool> broken = false; //the writer left a record that doesn't fit in the ring, nothing more is read
+
+		//Give the space up to the oldest lease back to the writer, channelmutex must be held
+		void Publish();
+
+	public:
+		Channel(std::shared_ptr<Mapping> InMemory, SharedRing* InRing, std::atomic<uint64_t>* InTail,
+			const uint8_t* InData, uint64_t InCapacity, uint32_t InDestination, ClientSlot* InGate, uint32_t InGeneration);
+
+		//Copy the next record out, 0 if there is none. Longer records are truncated
+		int Read(void* buffer, int maxlength);
+		//Lend the next record, empty lease if there is none
+		BufferLease Lend(const std::shared_ptr<Channel> &self);
+		bool HasData();
+		bool IsBroken() const;
+		//Block until a record may have arrived or timeout expires
+		bool Wait(std::chrono::microseconds timeout);
+		virtual void ReleaseLease(uint64_t handle) override;
+
+	private:
+		//Find the next record for us, skipping the others. channelmutex must be held
+		std::optional<std::pair<uint64_t, uint32_t>> Next();
+	};
+
+	struct SharedMemoryConnection
+	{
+		std::shared_ptr<Mapping> memory;
+		std::shared_ptr<Channel> inbound; //null for the broadcast token
+		int slot; //our slot on a client, the client's slot on the server, -1 for broadcast
+		bool server; //true when the token leads to a server
+		uint32_t generation; //of the slot when it was claimed
+	};
+
+	std::string Name;
+	std::shared_ptr<Mapping> Own; //segment we serve, null if we only connect to servers
+	mutable std::shared_mutex listenmutex; //protects connections and slottokens
+	std::map<std::shared_ptr<ConnectionToken>, SharedMemoryConnection> connections;
+	std::vector<std::shared_ptr<ConnectionToken>> slottokens; //client token of each slot of our segment
+	std::mutex writemutex; //serializes writers of our downstream ring and of our upstream rings
+	std::atomic<int64_t> lastreap = 0; //steady clock time of the last ReapPeers, in nanoseconds
+	std::atomic<size_t> nextreceive = 0; //where ReceiveAny starts, so that every peer gets its turn
+
+	//Register clients that claimed a slot and forget those that left
+	void AdoptClients();
+	//Write a message on the ring the token sends to, false if it doesn't fit right now
+	bool WriteMessage(const SharedMemoryConnection &connection, const iovec* iov, int iovcnt, size_t length);
+	//Write, waiting for room as long as the destination is alive. false = disconnected or too large
+	bool SendMessage(std::shared_ptr<ConnectionToken> token, const iovec* iov, int iovcnt);
+	//Check that the other end of a connection still exists, listenmutex must be held
+	bool IsAlive(const SharedMemoryConnection &connection) const;
+	//Disconnect the peers that went away, at most every AliveCheckInterval
+	void ReapPeers();
+	//Bytes that can't be written yet in our downstream ring, held by the slowest client
+	uint64_t GetDownstreamTail(const Segment* segment) const;
+
+	//Segment name as given to shm_open
+	static std::string GetSegmentPath(const std::string &name);
+	//The segment at path was left by a server that is gone, it can be replaced
+	static bool IsAbandoned(const std::string &path);
+
+public:
+	//Empty name = no segment of our own, only Connect to servers
+	//Fails if a live server already serves the name. InMode sets who may open the segment, any of them can write to its rings
+	SharedMemoryTransport(std::string InName, size_t InRingSize = DefaultRingSize, int InMaxClients = DefaultMaxClients,
+		mode_t InMode = DefaultMode);
+
+	virtual ~SharedMemoryTransport();
+
+	//Connect to the server serving the named segment, nothing if it doesn't exist or is full
+	//BroadcastClient gives a token that sends to every client of our own segment
+	std::shared_ptr<ConnectionToken> Connect(std::string name);
+
+	virtual std::vector<std::shared_ptr<ConnectionToken>> GetClients() const override;
+
+	virtual std::pair<int, std::shared_ptr<ConnectionToken>> ReceiveAny(void *buffer, int maxlength) override;
+
+	//Stops at the first message that doesn't fit in the ring instead of waiting for the readers
+	virtual int TrySendBatch(const Datagram* datagrams, int count) override;
+
+	//Block until a message arrives from token or timeout expires, false on timeout
+	bool WaitForData(std::shared_ptr<ConnectionToken> token, std::chrono::microseconds timeout);
+
+protected:
+	virtual std::optional<int> Receive(void* buffer, int maxlength, std::shared_ptr<ConnectionToken> token) override;
+
+	//Lends the message where it is in the shared ring, no copy. The writer can't reuse the space until the lease is released
+	virtual std::optional<BufferLease> ReceiveView(std::shared_ptr<ConnectionToken> token) override;
+
+	virtual bool Send(const void* buffer, int length,  std::shared_ptr<ConnectionToken> token) override;
+
+	virtual bool Send(const iovec* iov, int iovcnt, std::shared_ptr<ConnectionToken> token) override;
+
+	virtual void DisconnectClient(std::shared_ptr<ConnectionToken> token) override;
+};
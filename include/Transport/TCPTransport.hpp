@@ -3,11 +3,15 @@
 #include <Transport/GenericTransport.hpp>
 
 #include <shared_mutex>
+#include <mutex>
+#include <atomic>
 #include <vector>
+#include <deque>
 #include <map>
 #include <netinet/in.h>
 
 #include <Transport/Task.hpp>
+#include <Transport/IOUring.hpp>
 
 //TCP transport layer
 
@@ -15,14 +19,75 @@
 
 class TCPTransport : public GenericTransport
 {
+public:
+	//How the byte stream is cut into messages, both ends must agree
+	enum class Framing
+	{
+		Stream, //Receive returns whatever bytes came in
+		LengthPrefixed //every message is preceded by its length on 4 bytes, Receive returns whole messages
+	};
+
+	//Largest length prefixed message, a peer announcing more is disconnected
+	//Sending a larger one returns false without disconnecting, check IsConnected to tell it apart
+	static constexpr size_t MaxMessageSize = 64*1024*1024;
+	//Bytes kept per connection when the socket can't take them, messages past that are dropped
+	static constexpr size_t DefaultMaxQueuedBytes = 64*1024*1024;
+
 private:
+	//Bytes received in LengthPrefixed framing, waiting to make whole messages
+	struct ReceiveRing
+	{
+		std::mutex ringmutex; //protects the ring, a connection is read by one thread at a time
+		std::vector<uint8_t> data; //power of two size
+		size_t start = 0, used = 0;
+
+		//Copy length bytes from offset past start, wrapping around
+		void Peek(size_t offset, void* destination, size_t length) const;
+		//Make room for at least size bytes, keeping what's buffered
+		void Reserve(size_t size);
+		void Write(const uint8_t* source, size_t length);
+		//Free space as at most two regions, returns how many
+		int GetFreeRegions(iovec regions[2]);
+	};
+
+	//Bytes the socket didn't take yet, written when it becomes writable
+	struct SendQueue
+	{
+		std::mutex queuemutex; //protects the queue, also serializes the writes to the socket
+		std::deque<std::vector<uint8_t>> chunks;
+		size_t sentfront = 0; //bytes of the first chunk already written
+		size_t queued = 0; //bytes in chunks not written yet
+		uint64_t dropped = 0; //messages refused because the queue was full
+	};
+
 	struct TCPConnection
 	{
 		int filedescriptor;
 		sockaddr_in address;
 		std::string name;
+		uint64_t ringid = 0; //id of the io_uring receive, 0 if none
+		std::vector<uint8_t> inbound; //received by the ring, not read yet
+		size_t inboundread = 0;
+		bool closed = false; //the ring saw the end of the stream
+		bool armed = false; //the multishot receive is running
+		bool paused = false; //inbound is full, the receive was cancelled until it's read
+		bool writepolled = false; //the ring waits for the socket to take the send queue
+		std::shared_ptr<ReceiveRing> framed; //LengthPrefixed framing, created on first receive
+		std::shared_ptr<SendQueue> outbound = std::make_shared<SendQueue>();
 	};
 
+	//Chunks written with one writev
+	static constexpr int MaxFlushChunks = 64;
+
+	//Bytes read per receive at least, so that many small messages come in with one syscall
+	static constexpr size_t MinimumRead = 64*1024;
+
+	static constexpr uint64_t AcceptRingId = 0;
+	//Set on the ring id of a connection for its writability poll
+	static constexpr uint64_t WritableRingFlag = 1ull << 63;
+	//Bytes received by the ring and not read yet, past that the connection stops receiving
+	static constexpr size_t MaxInboundBytes = 4*1024*1024;
+
 	bool Server;
 	std::string IP, Interface;
 	int Port;
@@ -30,9 +95,17 @@ private:
 	bool Connected;
 	mutable std::shared_mutex listenmutex; //protects connections
 	std::map<std::shared_ptr<ConnectionToken>, TCPConnection> connections;
+	std::unique_ptr<IOUring> Ring; //null when using plain sockets
+	uint64_t nextringid = AcceptRingId + 1;
+	std::map<uint64_t, std::shared_ptr<ConnectionToken>> ringtokens; //protected by listenmutex
+	std::vector<std::shared_ptr<ConnectionToken>> ringaccepted; //accepted by the ring, not reported yet
+	std::vector<std::shared_ptr<ConnectionToken>> ringwritable; //flushed by the ring, not reported yet, only with an event loop
+	std::atomic<Framing> MessageFraming;
+	std::atomic<size_t> MaxQueuedBytes;
 public:
 
-	TCPTransport(bool inServer, std::string inIP, int inPort, std::string inInterface);
+	TCPTransport(bool inServer, std::string inIP, int inPort, std::string inInterface, IOBackend inBackend = IOBackend::Sockets,
+		Framing inFraming = Framing::Stream);
 
 	virtual ~TCPTransport();
 
@@ -42,16 +115,62 @@ private:
 	void CheckConnection();
 	void LowerLatency(int fd);
 	void DeleteSocket(int fd);
+	//Have the event loop watch a connection, Loop must be set
+	void WatchConnection(const std::shared_ptr<ConnectionToken> &token, int fd);
+	//Register an accepted client, listenmutex must be held exclusively
+	std::shared_ptr<ConnectionToken> AddClient(const TCPConnection &connection);
+	//Start the multishot receive of a connection, listenmutex must be held exclusively
+	void ArmReceive(const std::shared_ptr<ConnectionToken> &token, TCPConnection &connection);
+	//Process the ring's completions : accepted clients, received data and writable sockets
+	void PumpRing();
+	//Have the ring tell when the socket of token can take its send queue, listenmutex must not be held
+	void PollWritable(const std::shared_ptr<ConnectionToken> &token);
+	//Receive again once enough of inbound was read, listenmutex must be held exclusively
+	void ResumeReceive(const std::shared_ptr<ConnectionToken> &token, TCPConnection &connection);
+	//Report what the ring brought in to the event loop
+	void NotifyRingEvents();
+	//Take the oldest whole message of the ring, longer messages are truncated to maxlength
+	//Returns -1 if there is none yet, -2 if the peer announced a message that's too large
+	static int PopMessage(ReceiveRing &ring, void* buffer, int maxlength);
+	//Receive in LengthPrefixed framing
+	std::optional<int> ReceiveFramed(void* buffer, int maxlength, std::shared_ptr<ConnectionToken> token);
+	//Queue of a connection and its socket, null if the token is unknown
+	std::shared_ptr<SendQueue> GetSendQueue(const std::shared_ptr<ConnectionToken> &token, int &fd) const;
+	//Write as much of the queue as the socket takes, queuemutex must be held. false if the socket failed
+	static bool FlushQueue(SendQueue &queue, int fd);
 public:
 
 	virtual std::vector<std::shared_ptr<ConnectionToken>> GetClients() const override;
 
 	std::vector<std::shared_ptr<ConnectionToken>> AcceptNewConnections();
 
+	//Change the framing of every connection, before any message is exchanged
+	void SetFraming(Framing inFraming);
+
+	//Sends never block : what the socket can't take is queued and written when it becomes writable
+	//With io_uring the ring polls for writability, the queue moves on when the event loop or a Receive reaps it
+	//Write what's queued for token, false if disconnected
+	bool Flush(std::shared_ptr<ConnectionToken> token);
+	//Bytes waiting to be written to token, for backpressure
+	size_t GetQueuedBytes(std::shared_ptr<ConnectionToken> token) const;
+	//Messages refused because the queue of token was full
+	uint64_t GetDroppedMessages(std::shared_ptr<ConnectionToken> token) const;
+	void SetMaxQueuedBytes(size_t inMaxQueuedBytes);
+
+	//Stops at the first message whose connection still has bytes queued
+	virtual int TrySendBatch(const Datagram* datagrams, int count) override;
+
+	virtual bool AttachEventLoop(EventLoop* loop, EventCallback callback) override;
+	virtual void DetachEventLoop() override;
+
 protected:
+	//In LengthPrefixed framing, several messages may come in with one readable event : receive until nothing is returned
 	virtual std::optional<int> Receive(void* buffer, int maxlength, std::shared_ptr<ConnectionToken> token) override;
 
 	virtual bool Send(const void* buffer, int length,  std::shared_ptr<ConnectionToken> token) override;
 
+	//In LengthPrefixed framing, false with the token still connected = message over MaxMessageSize, not sent
+	virtual bool Send(const iovec* iov, int iovcnt, std::shared_ptr<ConnectionToken> token) override;
+
 	virtual void DisconnectClient(std::shared_ptr<ConnectionToken> token) override;
 };
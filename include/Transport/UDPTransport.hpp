@@ -1,24 +1,46 @@
 #pragma once
 
 #include <Transport/GenericTransport.hpp>
+#include <Transport/AddressIndex.hpp>
+#include <Transport/BufferPool.hpp>
+#include <Transport/IOUring.hpp>
 
 #include <thread>
+#include <mutex>
 #include <shared_mutex>
 #include <vector>
-#include <list>
 #include <map>
 #include <netinet/in.h>
+#include <sys/socket.h>
 #include <optional>
 
 //UDP transport layer
 
 class UDPTransport : public GenericTransport
 {
+public:
+	//What to do with a packet when a connection's backlog is full
+	enum class OverflowPolicy
+	{
+		DropOldest, //make room by discarding the oldest packet of the backlog
+		DropNewest //discard the packet that doesn't fit
+	};
+
 private:
+	struct BacklogEntry
+	{
+		int buffer; //index in the pool, or of the ring's provided buffer when kernel is set
+		int length;
+		bool kernel = false; //the datagram is still where the ring received it, no copy was made
+	};
+
 	struct UDPConnection
 	{
 		sockaddr_in address;
-		std::list<std::vector<uint8_t>> payloads;
+		std::vector<BacklogEntry> backlog; //ring of BacklogCapacity entries, allocated on first use
+		int head = 0; //oldest entry of the ring
+		int size = 0;
+		uint64_t dropped = 0;
 	};
 	
 	std::optional<NetworkInterface> Interface;
@@ -28,9 +50,23 @@ private:
 	std::thread* ReceiveThreadHandle;
 	mutable std::shared_mutex listenmutex;
 	std::map<std::shared_ptr<ConnectionToken>, UDPConnection> connections;
+	AddressIndex peers; //(address, port) to token, protected by listenmutex
+	std::mutex drainmutex; //serializes socket drains so backlogs keep arrival order
+	std::vector<uint8_t> discard; //receives what the exhausted pool can't hold, protected by drainmutex
+	std::shared_ptr<BufferPool> pool; //backs the backlog of every connection
+	int BacklogCapacity;
+	OverflowPolicy Overflow;
+	std::shared_ptr<IOUring> Ring; //null when using plain sockets, shared with the leases of its buffers
+	msghdr ringmessage; //template of the multishot recvmsg, must outlive it
+	static constexpr uint64_t ReceiveRingId = 1;
 public:
 
-	UDPTransport(int inPort, std::optional<NetworkInterface> inInterface);
+	//Maximum number of datagrams moved by a single recvmmsg/sendmmsg call
+	static constexpr int BatchSize = 32;
+
+	UDPTransport(int inPort, std::optional<NetworkInterface> inInterface,
+		int inBacklogCapacity = 64, OverflowPolicy inOverflow = OverflowPolicy::DropOldest, int inPoolBuffers = 256,
+		IOBackend inBackend = IOBackend::Sockets);
 
 	virtual ~UDPTransport();
 
@@ -41,14 +77,67 @@ public:
 
 	//Receive any data accumulated in the connections
 	std::pair<int, std::shared_ptr<ConnectionToken>> ReceiveBacklog(void *buffer, int maxlength);
-	//Receive data fresh from the socket
+	//Receive data fresh from the socket, bypasses io_uring
 	std::pair<int, std::shared_ptr<ConnectionToken>> ReceiveFresh(void *buffer, int maxlength);
 	//Receive old or new data, don't care
-	std::pair<int, std::shared_ptr<ConnectionToken>> ReceiveAny(void *buffer, int maxlength);
+	virtual std::pair<int, std::shared_ptr<ConnectionToken>> ReceiveAny(void *buffer, int maxlength) override;
+
+	//Receive up to count datagrams fresh from the socket, in as few syscalls as possible. Bypasses io_uring
+	//Returns the number of datagrams received, length and token are filled for each of them
+	int ReceiveBatch(Datagram* datagrams, int count);
+	//Send up to count datagrams in as few syscalls as possible
+	//Returns the number of datagrams sent, stops at the first one that can't be sent
+	virtual int SendBatch(const Datagram* datagrams, int count) override;
+
+	virtual int TrySendBatch(const Datagram* datagrams, int count) override;
 
 	virtual std::optional<int> Receive(void *buffer, int maxlength, std::shared_ptr<ConnectionToken> token) override;
+
+	//Lends the buffer the datagram was received into, no copy. With io_uring it's the ring's provided buffer,
+	//it goes back to the kernel when the lease is released
+	virtual std::optional<BufferLease> ReceiveView(std::shared_ptr<ConnectionToken> token) override;
 	
 	virtual bool Send(const void* buffer, int length, std::shared_ptr<ConnectionToken> token) override;
 
+	virtual bool Send(const iovec* iov, int iovcnt, std::shared_ptr<ConnectionToken> token) override;
+
+	virtual void DisconnectClient(std::shared_ptr<ConnectionToken> token) override;
+
+	//Incoming datagrams are drained into the backlogs, Readable is reported for every token with a backlog
+	virtual bool AttachEventLoop(EventLoop* loop, EventCallback callback) override;
+	virtual void DetachEventLoop() override;
+
+	virtual bool SetBufferSizes(int sendsize, int receivesize) override;
+
+	void SetOverflowPolicy(OverflowPolicy inOverflow);
+
+	//Number of packets for this token that were dropped because its backlog was full
+	uint64_t GetDroppedPackets(std::shared_ptr<ConnectionToken> token) const;
+
 	void receiveThread();
+
+private:
+	//Backlog ring handling, listenmutex must be held exclusively
+	void PushBacklog(UDPConnection &connection, const BacklogEntry &entry);
+	std::optional<BacklogEntry> PopBacklog(UDPConnection &connection);
+	void ClearBacklog(UDPConnection &connection);
+	//Payload of a backlog entry, and giving its buffer back to the pool or the ring
+	const uint8_t* GetEntryData(const BacklogEntry &entry) const;
+	void ReleaseEntry(const BacklogEntry &entry);
+	//Copy a backlog entry out and give its buffer back
+	int EvacuateBacklog(const BacklogEntry &entry, void *buffer, int maxlength);
+	//Drain the socket in batches into the backlogs. The first datagram for token is returned instead of queued.
+	//If the pool is exhausted and scratch is given, datagrams are received into it and dropped unless they are for token,
+	//in which case the returned entry has no pool buffer (-1). Without scratch they are all dropped until the socket is empty
+	std::optional<BacklogEntry> DrainSocket(const std::shared_ptr<ConnectionToken> &token, void *scratch, int scratchlength);
+	//Move what the ring received into the backlogs
+	void PumpRing();
+	//Report Readable for every token with a backlog
+	void NotifyBacklogs();
+
+	//Find the token of a sender, registering it if it's new
+	std::shared_ptr<ConnectionToken> ResolveSender(const sockaddr_in &address);
+
+	//sendmmsg in chunks of BatchSize, stops at the first unknown token or short send
+	int SendMessages(const Datagram* datagrams, int count, int flags);
 };
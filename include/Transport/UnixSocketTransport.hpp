@@ -0,0 +1,94 @@
+#pragma once
+
+#include <Transport/GenericTransport.hpp>
+#include <Transport/BufferPool.hpp>
+
+#include <shared_mutex>
+#include <mutex>
+#include <vector>
+#include <map>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+//Unix domain socket transport, SOCK_SEQPACKET so that message boundaries are kept
+//Messages above the inline threshold are written to a sealed memfd whose descriptor is passed instead of the bytes,
+//the receiver maps it and reads it in place
+//Paths starting with @ are in the abstract namespace
+
+class UnixSocketTransport : public GenericTransport
+{
+public:
+	static constexpr size_t DefaultInlineThreshold = 64*1024;
+
+private:
+	struct UnixConnection
+	{
+		int filedescriptor;
+		std::string name;
+	};
+
+	//Memfds received and mapped, unmapped when their lease goes away
+	class MappedMessages : public BufferLease::Owner
+	{
+	private:
+		std::mutex mappedmutex; //protects mapped
+		std::map<uint64_t, size_t> mapped; //address to length
+	public:
+		virtual ~MappedMessages();
+		BufferLease Lease(std::shared_ptr<MappedMessages> self, void* address, size_t length);
+		virtual void ReleaseLease(uint64_t handle) override;
+	};
+
+	bool Server;
+	std::string Path;
+	size_t InlineThreshold;
+	int sockfd;
+	mutable std::shared_mutex listenmutex; //protects connections
+	std::map<std::shared_ptr<ConnectionToken>, UnixConnection> connections;
+	std::shared_ptr<BufferPool> pool; //inline messages received as views
+	std::shared_ptr<MappedMessages> mappings;
+	int SendBufferSize = 0, ReceiveBufferSize = 0; //applied to new connections too, 0 = system default
+
+	//Fill a sockaddr_un from Path, returns its length
+	socklen_t GetAddress(sockaddr_un &address) const;
+	int GetFileDescriptor(const std::shared_ptr<ConnectionToken> &token) const;
+
+	//Send a message on fd, inline or through a memfd. Returns false and sets errno on failure
+	bool SendMessage(int fd, const iovec* iov, int iovcnt, int flags);
+	//Receive a message in buffer, or the descriptor of the memfd holding it
+	//Returns the received length like recvmsg, memfd is -1 for inline messages
+	int ReceiveMessage(int fd, void* buffer, int maxlength, int &memfd);
+	//Map a received memfd read only, after checking that the sender can't change it anymore
+	void* MapMessage(int memfd, size_t &length);
+	//Disconnect if a receive or send failed for good
+	std::optional<int> HandleResult(int result, const std::shared_ptr<ConnectionToken> &token);
+
+public:
+	//A server only replaces a socket left by a server that is gone, it fails if the path is served or isn't a socket
+	UnixSocketTransport(bool inServer, std::string inPath, size_t inInlineThreshold = DefaultInlineThreshold);
+
+	virtual ~UnixSocketTransport();
+
+	virtual std::vector<std::shared_ptr<ConnectionToken>> GetClients() const override;
+
+	std::vector<std::shared_ptr<ConnectionToken>> AcceptNewConnections();
+
+	//Accepts waiting clients before receiving
+	virtual std::pair<int, std::shared_ptr<ConnectionToken>> ReceiveAny(void *buffer, int maxlength) override;
+
+	virtual int TrySendBatch(const Datagram* datagrams, int count) override;
+
+	virtual bool SetBufferSizes(int sendsize, int receivesize) override;
+
+protected:
+	virtual std::optional<int> Receive(void* buffer, int maxlength, std::shared_ptr<ConnectionToken> token) override;
+
+	//Large messages are lent straight from their memfd mapping
+	virtual std::optional<BufferLease> ReceiveView(std::shared_ptr<ConnectionToken> token) override;
+
+	virtual bool Send(const void* buffer, int length,  std::shared_ptr<ConnectionToken> token) override;
+
+	virtual bool Send(const iovec* iov, int iovcnt, std::shared_ptr<ConnectionToken> token) override;
+
+	virtual void DisconnectClient(std::shared_ptr<ConnectionToken> token) override;
+};
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <Transport/Task.hpp>
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <string>
+
+//Fixed set of Task threads running submitted jobs in order
+class WorkerPool
+{
+public:
+	typedef std::function<void()> Job;
+
+private:
+	class Worker : public Task
+	{
+	private:
+		WorkerPool* Pool;
+	public:
+		Worker(WorkerPool* InPool);
+		virtual ~Worker();
+	protected:
+		virtual void ThreadEntryPoint() override;
+	};
+
+	std::string Name;
+	std::mutex jobmutex; //protects jobs and stopping
+	std::condition_variable jobcondition;
+	std::deque<Job> jobs;
+	bool stopping = false;
+	std::vector<std::unique_ptr<Worker>> workers;
+
+	//Blocks until a job is available, false when the pool is stopping
+	bool NextJob(Job &job);
+
+public:
+	//0 threads = one per hardware thread
+	WorkerPool(int InNumThreads = 0, std::string InName = "Worker");
+	~WorkerPool();
+
+	void Submit(Job job);
+
+	//Run job(0) to job(count-1) on the pool and the calling thread, returns when they are all done
+	void ParallelFor(int count, const std::function<void(int)> &job);
+
+	int GetThreadCount() const
+	{
+		return workers.size();
+	}
+};
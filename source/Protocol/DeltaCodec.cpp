@@ -0,0 +1,259 @@
+#include <Protocol/DeltaCodec.hpp>
+#include <Protocol/FramePool.hpp>
+#include <string.h>
+#include <iostream>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DELTACODEC_X86 1
+#else
+#define DELTACODEC_X86 0
+#endif
+
+using namespace std;
+
+namespace
+{
+	bool EqualScalar(const uint8_t* a, const uint8_t* b, size_t length)
+	{
+		return memcmp(a, b, length) == 0;
+	}
+
+#if DELTACODEC_X86
+	__attribute__((target("sse2")))
+	bool EqualSSE2(const uint8_t* a, const uint8_t* b, size_t length)
+	{
+		size_t i = 0;
+		for (; i + 16 <= length; i += 16)
+		{
+			__m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+			__m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+			if (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xFFFF)
+			{
+				return false;
+			}
+		}
+		return EqualScalar(a + i, b + i, length - i);
+	}
+
+	__attribute__((target("avx2")))
+	bool EqualAVX2(const uint8_t* a, const uint8_t* b, size_t length)
+	{
+		size_t i = 0;
+		for (; i + 32 <= length; i += 32)
+		{
+			__m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+			__m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+			if ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb)) != 0xFFFFFFFFu)
+			{
+				return false;
+			}
+		}
+		return EqualSSE2(a + i, b + i, length - i);
+	}
+#endif
+
+	typedef bool (*EqualFunction)(const uint8_t*, const uint8_t*, size_t);
+
+	EqualFunction Select()
+	{
+#if DELTACODEC_X86
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+		{
+			return EqualAVX2;
+		}
+		if (__builtin_cpu_supports("sse2"))
+		{
+			return EqualSSE2;
+		}
+#endif
+		return EqualScalar;
+	}
+}
+
+bool DeltaCodec::Equal(const uint8_t* a, const uint8_t* b, size_t length)
+{
+	static const EqualFunction selected = Select();
+	return selected(a, b, length);
+}
+
+DeltaEncoder::DeltaEncoder(int InKeyframeInterval, int InTileSize)
+	:KeyframeInterval(InKeyframeInterval), TileSize(InTileSize)
+{
+}
+
+bool DeltaEncoder::Encode(uint8_t identifier, const uint8_t* pixels, uint16_t width, uint16_t height, int bytesperpixel, std::vector<uint8_t> &out)
+{
+	Reference &reference = references[identifier];
+	size_t size = (size_t)width * height * bytesperpixel;
+	bool keyframe = reference.data.empty() 
+		|| reference.width != width || reference.height != height || reference.bytesperpixel != bytesperpixel
+		|| (KeyframeInterval > 0 && reference.sincekeyframe + 1 >= KeyframeInterval);
+
+	DeltaHeader header;
+	header.keyframe = keyframe;
+	header.tilesize = TileSize;
+	header.bytesperpixel = bytesperpixel;
+	header.reserved = 0;
+	if (keyframe)
+	{
+		reference.id++;
+		reference.data.assign(pixels, pixels + size);
+		reference.width = width;
+		reference.height = height;
+		reference.bytesperpixel = bytesperpixel;
+		reference.sincekeyframe = 0;
+		header.reference = reference.id;
+		out.resize(sizeof(header) + size);
+		memcpy(out.data(), &header, sizeof(header));
+		memcpy(out.data() + sizeof(header), pixels, size);
+		return true;
+	}
+	reference.sincekeyframe++;
+	header.reference = reference.id;
+
+	int tilesx = GetTileCount(width, TileSize), tilesy = GetTileCount(height, TileSize);
+	size_t bitmapsize = ((size_t)tilesx * tilesy + 7) / 8;
+	size_t stride = (size_t)width * bytesperpixel;
+	out.resize(sizeof(header) + bitmapsize);
+	memcpy(out.data(), &header, sizeof(header));
+	memset(out.data() + sizeof(header), 0, bitmapsize);
+	for (int ty = 0; ty < tilesy; ty++)
+	{
+		int y0 = ty * TileSize, y1 = min<int>(y0 + TileSize, height);
+		for (int tx = 0; tx < tilesx; tx++)
+		{
+			int x0 = tx * TileSize, x1 = min<int>(x0 + TileSize, width);
+			size_t rowoffset = (size_t)x0 * bytesperpixel;
+			size_t rowlength = (size_t)(x1 - x0) * bytesperpixel;
+			bool changed = false;
+			for (int y = y0; y < y1 && !changed; y++)
+			{
+				size_t offset = y * stride + rowoffset;
+				changed = !Equal(pixels + offset, reference.data.data() + offset, rowlength);
+			}
+			if (!changed)
+			{
+				continue;
+			}
+			int tile = ty * tilesx + tx;
+			out[sizeof(header) + tile / 8] |= 1 << (tile % 8);
+			size_t position = out.size();
+			out.resize(position + rowlength * (y1 - y0));
+			for (int y = y0; y < y1; y++)
+			{
+				memcpy(out.data() + position, pixels + y * stride + rowoffset, rowlength);
+				position += rowlength;
+			}
+		}
+	}
+	return false;
+}
+
+void DeltaEncoder::ForceKeyframe()
+{
+	for (auto &reference : references)
+	{
+		reference.second.data.clear();
+	}
+}
+
+bool DeltaDecoder::Decode(ImageProtocol::Image &image, FramePool* pool)
+{
+	const vector<uint8_t> &encoded = image.data;
+	//the encoded buffer goes back to the pool whatever happens, the pixels too if decoding fails halfway
+	auto fail = [&image, pool](vector<uint8_t> &&pixels)
+	{
+		if (pool)
+		{
+			pool->Release(std::move(pixels));
+			pool->Release(std::move(image.data));
+		}
+		return false;
+	};
+	if (encoded.size() < sizeof(DeltaHeader))
+	{
+		cerr << "Delta frame too small, length " << encoded.size() << endl;
+		return fail({});
+	}
+	DeltaHeader header;
+	memcpy(&header, encoded.data(), sizeof(header));
+	uint16_t width = image.metadata.width, height = image.metadata.height;
+	size_t size = (size_t)width * height * header.bytesperpixel;
+	Reference &reference = references[image.metadata.identifier];
+	if (header.keyframe)
+	{
+		if (encoded.size() != sizeof(header) + size)
+		{
+			cerr << "Delta keyframe has length " << encoded.size() << ", expected " << sizeof(header) + size << endl;
+			return fail({});
+		}
+		reference.data.assign(encoded.begin() + sizeof(header), encoded.end());
+		reference.width = width;
+		reference.height = height;
+		reference.bytesperpixel = header.bytesperpixel;
+		reference.id = header.reference;
+		vector<uint8_t> pixels = pool ? pool->Acquire(size) : vector<uint8_t>(size);
+		memcpy(pixels.data(), reference.data.data(), size);
+		if (pool)
+		{
+			pool->Release(std::move(image.data));
+		}
+		image.data = std::move(pixels);
+		image.metadata.encoding = (uint8_t)ImageProtocol::Encodings::Raw;
+		return true;
+	}
+	if (reference.data.empty() || reference.id != header.reference 
+		|| reference.width != width || reference.height != height || reference.bytesperpixel != header.bytesperpixel
+		|| header.tilesize == 0)
+	{
+		//keyframe lost, wait for the next one
+		return fail({});
+	}
+
+	int tilesx = GetTileCount(width, header.tilesize), tilesy = GetTileCount(height, header.tilesize);
+	size_t bitmapsize = ((size_t)tilesx * tilesy + 7) / 8;
+	if (encoded.size() < sizeof(header) + bitmapsize)
+	{
+		cerr << "Delta frame bitmap truncated" << endl;
+		return fail({});
+	}
+	const uint8_t* bitmap = encoded.data() + sizeof(header);
+	size_t position = sizeof(header) + bitmapsize;
+	size_t stride = (size_t)width * header.bytesperpixel;
+	vector<uint8_t> pixels = pool ? pool->Acquire(size) : vector<uint8_t>(size);
+	memcpy(pixels.data(), reference.data.data(), size);
+	for (int ty = 0; ty < tilesy; ty++)
+	{
+		int y0 = ty * header.tilesize, y1 = min<int>(y0 + header.tilesize, height);
+		for (int tx = 0; tx < tilesx; tx++)
+		{
+			int tile = ty * tilesx + tx;
+			if ((bitmap[tile / 8] & (1 << (tile % 8))) == 0)
+			{
+				continue;
+			}
+			int x0 = tx * header.tilesize, x1 = min<int>(x0 + header.tilesize, width);
+			size_t rowoffset = (size_t)x0 * header.bytesperpixel;
+			size_t rowlength = (size_t)(x1 - x0) * header.bytesperpixel;
+			if (position + rowlength * (y1 - y0) > encoded.size())
+			{
+				cerr << "Delta frame tiles truncated" << endl;
+				return fail(std::move(pixels));
+			}
+			for (int y = y0; y < y1; y++)
+			{
+				memcpy(pixels.data() + y * stride + rowoffset, encoded.data() + position, rowlength);
+				position += rowlength;
+			}
+		}
+	}
+	if (pool)
+	{
+		pool->Release(std::move(image.data));
+	}
+	image.data = std::move(pixels);
+	image.metadata.encoding = (uint8_t)ImageProtocol::Encodings::Raw;
+	return true;
+}
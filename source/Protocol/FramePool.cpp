@@ -0,0 +1,44 @@
+#include <Protocol/FramePool.hpp>
+
+using namespace std;
+
+FramePool::FramePool(size_t InMaxBuffers)
+	:MaxBuffers(InMaxBuffers)
+{
+}
+
+std::vector<uint8_t> FramePool::Acquire(size_t size)
+{
+	vector<uint8_t> buffer;
+	{
+		unique_lock lock(poolmutex);
+		for (auto it = buffers.begin(); it != buffers.end(); it++)
+		{
+			if (it->capacity() >= size)
+			{
+				buffer = std::move(*it);
+				buffers.erase(it);
+				break;
+			}
+		}
+	}
+	if (buffer.capacity() < size)
+	{
+		allocations++;
+	}
+	buffer.resize(size);
+	return buffer;
+}
+
+void FramePool::Release(std::vector<uint8_t> &&buffer)
+{
+	if (buffer.capacity() == 0)
+	{
+		return;
+	}
+	unique_lock lock(poolmutex);
+	if (buffers.size() < MaxBuffers)
+	{
+		buffers.push_back(std::move(buffer));
+	}
+}
@@ -0,0 +1,283 @@
+#include <Protocol/FrameReassembler.hpp>
+#include <Protocol/XORParity.hpp>
+#include <Protocol/FramePool.hpp>
+#include <string.h>
+#include <iostream>
+
+using namespace std;
+
+FrameReassembler::FrameReassembler(std::chrono::milliseconds InTimeout)
+	:Timeout(InTimeout)
+{
+}
+
+uint32_t FrameReassembler::GetFragmentSize(uint32_t size, uint16_t count)
+{
+	if (count == 0)
+	{
+		return 0;
+	}
+	return ((uint64_t)size + count - 1) / count;
+}
+
+std::map<uint32_t, FrameReassembler::PendingFrame>::iterator FrameReassembler::Drop(std::map<uint32_t, PendingFrame>::iterator frame)
+{
+	if (Pool)
+	{
+		Pool->Release(std::move(frame->second.data));
+	}
+	pendingbytes -= frame->second.bytes;
+	return frames.erase(frame);
+}
+
+void FrameReassembler::MakeRoom(size_t bytes)
+{
+	while (!frames.empty() && (frames.size() >= MaxPendingFrames || pendingbytes + bytes > MaxPendingBytes))
+	{
+		auto oldest = frames.begin();
+		for (auto pending = frames.begin(); pending != frames.end(); pending++)
+		{
+			if (pending->second.started < oldest->second.started)
+			{
+				oldest = pending;
+			}
+		}
+		cerr << "Too many pending frames, dropping frame " << oldest->first << endl;
+		Drop(oldest);
+		dropped++;
+	}
+}
+
+bool FrameReassembler::IsStale(uint8_t identifier, uint32_t frame) const
+{
+	auto last = lastcompleted.find(identifier);
+	if (last == lastcompleted.end())
+	{
+		return false;
+	}
+	//wrap around safe
+	return (int32_t)(frame - last->second) <= 0;
+}
+
+uint16_t FrameReassembler::GetParityCount(uint16_t count, uint16_t group)
+{
+	if (group == 0)
+	{
+		return 0;
+	}
+	return (count + group - 1) / group;
+}
+
+void FrameReassembler::Recover(PendingFrame &frame, uint16_t count, int group)
+{
+	if (frame.groupmissing[group] != 1 || !frame.parityreceived[group])
+	{
+		return;
+	}
+	int first = group * frame.group;
+	int last = min<int>(first + frame.group, count);
+	int lost = -1;
+	//the parity already holds the XOR of the whole group, remove what we have
+	uint8_t* rebuilt = frame.parity.data() + (size_t)group * frame.fragmentsize;
+	for (int i = first; i < last; i++)
+	{
+		if (!frame.received[i])
+		{
+			lost = i;
+			continue;
+		}
+		size_t offset = (size_t)i * frame.fragmentsize;
+		XORParity::Accumulate(rebuilt, frame.data.data() + offset, min<size_t>(frame.fragmentsize, frame.data.size() - offset));
+	}
+	size_t offset = (size_t)lost * frame.fragmentsize;
+	memcpy(frame.data.data() + offset, rebuilt, min<size_t>(frame.fragmentsize, frame.data.size() - offset));
+	frame.received[lost] = true;
+	frame.groupmissing[group] = 0;
+	frame.missing--;
+	recovered++;
+}
+
+std::optional<ImageProtocol::Image> FrameReassembler::AddFragment(const ImageProtocol::FragmentHeader &header, const uint8_t* payload, size_t length)
+{
+	uint16_t paritycount = GetParityCount(header.count, header.group);
+	if (header.count == 0 || header.index >= header.count + paritycount)
+	{
+		cerr << "Invalid fragment " << header.index << "/" << header.count << endl;
+		return nullopt;
+	}
+	if (IsStale(header.metadata.identifier, header.frame))
+	{
+		return nullopt;
+	}
+	auto it = frames.find(header.frame);
+	if (it == frames.end())
+	{
+		if (header.size > MaxFrameSize)
+		{
+			cerr << "Frame " << header.frame << " announces " << header.size << " bytes, over the limit of " << MaxFrameSize << endl;
+			return nullopt;
+		}
+		//every data fragment has to start inside the frame and fit in a datagram
+		uint32_t fragmentsize = GetFragmentSize(header.size, header.count);
+		if (fragmentsize > ImageProtocol::MaxFragmentPayload)
+		{
+			cerr << "Frame " << header.frame << " of " << header.size << " bytes can't fit in " << header.count << " fragments" << endl;
+			return nullopt;
+		}
+		if (header.count > 1 && (size_t)(header.count - 1) * fragmentsize >= header.size)
+		{
+			cerr << "Frame " << header.frame << " of " << header.size << " bytes can't be split in " << header.count << " fragments" << endl;
+			return nullopt;
+		}
+		size_t bytes = (size_t)header.size + (size_t)paritycount * fragmentsize;
+		MakeRoom(bytes);
+		PendingFrame frame;
+		frame.metadata = header.metadata;
+		frame.bytes = bytes;
+		if (Pool)
+		{
+			frame.data = Pool->Acquire(header.size);
+		}
+		else
+		{
+			frame.data.resize(header.size);
+		}
+		frame.received.resize(header.count, false);
+		frame.missing = header.count;
+		frame.fragmentsize = fragmentsize;
+		frame.group = header.group;
+		frame.parity.resize((size_t)paritycount * frame.fragmentsize);
+		frame.parityreceived.resize(paritycount, false);
+		frame.groupmissing.resize(paritycount);
+		for (int group = 0; group < paritycount; group++)
+		{
+			frame.groupmissing[group] = min<int>(header.group, header.count - group * header.group);
+		}
+		frame.started = chrono::steady_clock::now();
+		frame.lastactivity = frame.started;
+		it = frames.emplace(header.frame, std::move(frame)).first;
+		pendingbytes += bytes;
+	}
+	PendingFrame &frame = it->second;
+	frame.lastactivity = chrono::steady_clock::now();
+	if (frame.received.size() != header.count || frame.data.size() != header.size || frame.group != header.group)
+	{
+		cerr << "Fragment doesn't match frame " << header.frame << endl;
+		return nullopt;
+	}
+	if (header.index >= header.count)
+	{
+		int group = header.index - header.count;
+		if (length != frame.fragmentsize)
+		{
+			cerr << "Parity fragment " << group << " of frame " << header.frame << " has length " << length << ", expected " << frame.fragmentsize << endl;
+			return nullopt;
+		}
+		if (frame.parityreceived[group])
+		{
+			return nullopt;
+		}
+		memcpy(frame.parity.data() + (size_t)group * frame.fragmentsize, payload, length);
+		frame.parityreceived[group] = true;
+		Recover(frame, header.count, group);
+	}
+	else
+	{
+		size_t offset = (size_t)header.index * frame.fragmentsize;
+		if (header.size > 0 && offset >= header.size)
+		{
+			cerr << "Fragment " << header.index << " of frame " << header.frame << " is past its end" << endl;
+			return nullopt;
+		}
+		size_t expected = min<size_t>(frame.fragmentsize, header.size - offset);
+		if (length != expected)
+		{
+			cerr << "Fragment " << header.index << " of frame " << header.frame << " has length " << length << ", expected " << expected << endl;
+			return nullopt;
+		}
+		if (frame.received[header.index])
+		{
+			return nullopt;
+		}
+		memcpy(frame.data.data() + offset, payload, length);
+		frame.received[header.index] = true;
+		frame.missing--;
+		if (frame.group != 0)
+		{
+			int group = header.index / frame.group;
+			frame.groupmissing[group]--;
+			Recover(frame, header.count, group);
+		}
+	}
+	if (frame.missing > 0)
+	{
+		return nullopt;
+	}
+
+	ImageProtocol::Image image;
+	image.metadata = frame.metadata;
+	image.data = std::move(frame.data);
+	pendingbytes -= frame.bytes;
+	frames.erase(it);
+	lastcompleted[image.metadata.identifier] = header.frame;
+
+	//anything older from the same source will never be shown
+	for (auto pending = frames.begin(); pending != frames.end();)
+	{
+		if (pending->second.metadata.identifier == image.metadata.identifier 
+			&& IsStale(image.metadata.identifier, pending->first))
+		{
+			pending = Drop(pending);
+			dropped++;
+		}
+		else
+		{
+			pending++;
+		}
+	}
+	return image;
+}
+
+std::vector<FrameReassembler::Nack> FrameReassembler::GetNacks(std::chrono::milliseconds interval)
+{
+	vector<Nack> nacks;
+	auto now = chrono::steady_clock::now();
+	for (auto &pending : frames)
+	{
+		PendingFrame &frame = pending.second;
+		if (now - frame.lastactivity < interval)
+		{
+			continue;
+		}
+		frame.lastactivity = now;
+		Nack nack;
+		nack.frame = pending.first;
+		nack.missing.reserve(frame.missing);
+		for (size_t i = 0; i < frame.received.size(); i++)
+		{
+			if (!frame.received[i])
+			{
+				nack.missing.push_back(i);
+			}
+		}
+		nacks.push_back(std::move(nack));
+	}
+	return nacks;
+}
+
+void FrameReassembler::Expire()
+{
+	auto now = chrono::steady_clock::now();
+	for (auto pending = frames.begin(); pending != frames.end();)
+	{
+		if (now - pending->second.started > Timeout)
+		{
+			pending = Drop(pending);
+			dropped++;
+		}
+		else
+		{
+			pending++;
+		}
+	}
+}
@@ -1,19 +1,25 @@
 #include <Protocol/ImageProtocol.hpp>
-#include <string.h>
+#include <Protocol/FrameReassembler.hpp>
+#include <Protocol/XORParity.hpp>
+#include <Protocol/DeltaCodec.hpp>
+#include <Protocol/LosslessCodec.hpp>
+#include <Protocol/SendPipeline.hpp>
+#include <Protocol/ReceivePipeline.hpp>
+#include <Protocol/FramePool.hpp>
+#include <Transport/WorkerPool.hpp>
+#include <Transport/UDPTransport.hpp>
 #include <Transport/ConnectionToken.hpp>
+#include <string.h>
 #include <iostream>
 #include <array>
 #include <algorithm>
-#include <cassert>
-#if 0
-#include <steam/steamnetworkingsockets.h>
-#include <steam/isteamnetworkingsockets.h>
-#include <steam/isteamnetworkingutils.h>
-#endif
+#include <cmath>
+#include <arpa/inet.h>
+#include <sys/uio.h>
 
 using namespace std;
 
-#define PROTOCOL_VERSION 0
+#define PROTOCOL_VERSION 2
 
 const std::map<ImageProtocol::PacketTypes, std::string> ImageProtocol::TypeMap
 {
@@ -22,85 +28,49 @@ const std::map<ImageProtocol::PacketTypes, std::string> ImageProtocol::TypeMap
 	{ImageProtocol::PacketTypes::Configuration, "CONFIGURATION"},
 	{ImageProtocol::PacketTypes::Status, "STATUS"},
 	{ImageProtocol::PacketTypes::Handshake, "HANDSHAKE"},
+	{ImageProtocol::PacketTypes::Nack, "NACK"},
 	
 };
 
-
-#if 0
-std::map<HSteamListenSocket, ImageProtocol*> ImageProtocol::port_owner;
-std::map<HSteamNetConnection, ImageProtocol*> ImageProtocol::connection_owner;
-#endif
-
-
 ImageProtocol::ImageProtocol(std::string InServerIP)
-	:server_ip(InServerIP)
+	:server_ip(InServerIP),
+	reassembler(make_unique<FrameReassembler>()),
+	delta_encoder(make_unique<DeltaEncoder>()),
+	delta_decoder(make_unique<DeltaDecoder>())
 {
-	#if 0
-	socket = SteamNetworkingSockets();
-	if (socket == nullptr)
-	{
-		SteamDatagramErrMsg errMsg;
-		if ( !GameNetworkingSockets_Init( nullptr, errMsg ) )
-		{
-			cerr << "GameNetworkingSockets_Init failed. " << errMsg <<endl;
-		}
-
-		SteamNetworkingUtils()->SetGlobalConfigValueInt32( k_ESteamNetworkingConfig_IP_AllowWithoutAuth, 1 );
-		socket = SteamNetworkingSockets();
-	}
-	poll_group = socket->CreatePollGroup();
-	if (poll_group == k_HSteamNetPollGroup_Invalid)
-	{
-		cerr << "Failed to create poll group !" << endl;
-	}
-	
-	SteamNetworkingIPAddr ipaddr;
-	ipaddr.Clear();
-	SteamNetworkingConfigValue_t opt[3];
-	opt[0].SetPtr( k_ESteamNetworkingConfig_Callback_ConnectionStatusChanged, (void*)SteamNetConnectionStatusChangedCallback );
-	opt[1].SetInt32( k_ESteamNetworkingConfig_SendBufferSize, 1280*850*4);
-	opt[2].SetInt32( k_ESteamNetworkingConfig_RecvBufferSize, 1280*850*4);
-	opt[2].SetInt32( k_ESteamNetworkingConfig_Unencrypted, 3); //disable encryption
 	if (server_ip.size() == 0)
 	{
-		ipaddr.m_port = 50668;
-		listener = socket->CreateListenSocketIP(ipaddr, sizeof(opt)/sizeof(opt[0]), opt);
-		if (listener == k_HSteamListenSocket_Invalid)
-		{
-			cerr << "Failed to create listen socket !" <<endl;
-		}
-		
-		port_owner[listener] = this;
+		transport = make_shared<UDPTransport>(DefaultPort, nullopt);
+		transport->SetBufferSizes(DefaultBufferSize, 0);
+		return;
 	}
-	else
+	auto udp = make_shared<UDPTransport>(0, nullopt);
+	udp->SetBufferSizes(0, DefaultBufferSize);
+	sockaddr_in address;
+	address.sin_family = AF_INET;
+	address.sin_port = htons(DefaultPort);
+	if (inet_pton(AF_INET, server_ip.c_str(), &address.sin_addr) <= 0)
 	{
-		ipaddr.ParseString(server_ip.c_str());
-		ipaddr.m_port = 50668;
-		client_connection = socket->ConnectByIPAddress(ipaddr, sizeof(opt)/sizeof(opt[0]), opt);
-		if (client_connection == k_HSteamNetConnection_Invalid)
-		{
-			cerr << "Failed to create connection !" <<endl;
-		}
-		
-		connection_owner[client_connection] = this;
+		cerr << "Invalid image server address " << server_ip << endl;
 	}
-	#endif
+	server = udp->Connect(address);
+	transport = udp;
 }
 
-ImageProtocol::~ImageProtocol()
+ImageProtocol::ImageProtocol(std::shared_ptr<GenericTransport> InTransport, std::shared_ptr<ConnectionToken> InServer)
+	:transport(InTransport), server(InServer),
+	reassembler(make_unique<FrameReassembler>()),
+	delta_encoder(make_unique<DeltaEncoder>()),
+	delta_decoder(make_unique<DeltaDecoder>())
 {
-	#if 0
-	if (listener != k_HSteamListenSocket_Invalid)
+	if (server)
 	{
-		port_owner.erase(listener);
-		socket->CloseListenSocket(listener);
+		server_ip = server->GetConnectionName();
 	}
-	if (client_connection != k_HSteamNetConnection_Invalid)
-	{
-		connection_owner.erase(client_connection);
-		socket->CloseConnection(client_connection, k_ESteamNetConnectionEnd_AppException_Generic, "Disconnected", false);
-	}
-	#endif
+}
+
+ImageProtocol::~ImageProtocol()
+{
 }
 
 ImageProtocol::PacketTypes ImageProtocol::GetPacketType(const char buffer[8])
@@ -145,126 +115,420 @@ void ImageProtocol::Handshake()
 		return;
 	}
 
-	std::vector<uint8_t> message(sizeof(Header));
-	Header &head = *reinterpret_cast<Header*>(message.data());
-	head = Header(PacketTypes::Handshake);
-	#if 0
-	socket->SendMessageToConnection(client_connection, message.data(), message.size(), 0, nullptr);
-	#endif
+	Header head(PacketTypes::Handshake);
+	server->Send(&head, sizeof(head));
+}
+
+std::shared_ptr<ImageProtocol::OutgoingFrame> ImageProtocol::BuildFrame(std::vector<uint8_t> data, ImageMetadata metadata)
+{
+	size_t length = data.size();
+	size_t numdata = max<size_t>((length + MaxFragmentPayload - 1) / MaxFragmentPayload, 1);
+	uint16_t group = 0;
+	float overhead = fec_overhead; //SetFEC may change it meanwhile
+	if (overhead > 0)
+	{
+		group = min<size_t>(max<long>(lround(1.f / overhead), 1), numdata);
+	}
+	size_t numparity = group == 0 ? 0 : (numdata + group - 1) / group;
+	size_t numfragments = numdata + numparity;
+	if (numfragments > UINT16_MAX || length > UINT32_MAX)
+	{
+		cerr << "Image too large to send, length " << length << endl;
+		return nullptr;
+	}
+
+	auto frame = make_shared<OutgoingFrame>();
+	uint32_t frameindex = frame_counter++;
+	uint32_t fragmentsize = FrameReassembler::GetFragmentSize(length, numdata);
+	frame->data = std::move(data);
+	uint8_t* pixels = frame->data.data();
+	frame->fragments.resize(numfragments);
+	frame->iovs.resize(numfragments*3);
+	frame->parity.resize(numparity * fragmentsize, 0);
+	vector<iovec> &iovs = frame->iovs;
+	for (size_t i = 0; i < numdata; i++)
+	{
+		size_t offset = i * fragmentsize;
+		size_t fragmentlength = min<size_t>(fragmentsize, length - offset);
+		iovs[i*3 + 2] = {pixels + offset, fragmentlength};
+		if (group != 0)
+		{
+			XORParity::Accumulate(frame->parity.data() + (i / group) * fragmentsize, pixels + offset, fragmentlength);
+		}
+	}
+	for (size_t i = 0; i < numparity; i++)
+	{
+		iovs[(numdata + i)*3 + 2] = {frame->parity.data() + i * fragmentsize, fragmentsize};
+	}
+	for (size_t i = 0; i < numfragments; i++)
+	{
+		FragmentHeader &fragment = frame->fragments[i];
+		fragment.frame = frameindex;
+		fragment.index = i;
+		fragment.count = numdata;
+		fragment.group = group;
+		fragment.size = length;
+		fragment.metadata = metadata;
+		iovs[i*3] = {&frame->head, sizeof(frame->head)};
+		iovs[i*3 + 1] = {&fragment, sizeof(fragment)};
+	}
+	//each parity fragment goes right after its group so it can be used as soon as possible
+	frame->order.reserve(numfragments);
+	for (size_t i = 0; i < numdata; i++)
+	{
+		frame->order.push_back(i);
+		if (group != 0 && ((i + 1) % group == 0 || i + 1 == numdata))
+		{
+			frame->order.push_back(numdata + i / group);
+		}
+	}
+	auto base = metadata.timestamp != 0 ? 
+		chrono::system_clock::time_point(chrono::microseconds(metadata.timestamp)) : 
+		chrono::system_clock::now();
+	frame->deadline = base + retransmit_deadline.load();
+	return frame;
 }
 
-void ImageProtocol::SendImage(void* buffer, size_t length, ImageMetadata metadata)
+void ImageProtocol::Enqueue(ClientQueue &client, const std::shared_ptr<OutgoingFrame> &frame)
+{
+	uint8_t identifier = frame->fragments[0].metadata.identifier;
+	for (auto &pending : client.pending)
+	{
+		//a keyframe can only be replaced by another one, deltas need it
+		if (pending->fragments[0].metadata.identifier == identifier && (frame->keyframe || !pending->keyframe))
+		{
+			//keep the queue position, only the content gets fresher
+			pending = frame;
+			client.statistics.conflated++;
+			return;
+		}
+	}
+	client.pending.push_back(frame);
+}
+
+bool ImageProtocol::EncodeImage(const void* buffer, size_t length, const ImageMetadata &metadata, std::vector<uint8_t> &out, bool &keyframe)
+{
+	keyframe = true;
+	Encodings encoding = (Encodings)metadata.encoding;
+	if (encoding != Encodings::Delta && encoding != Encodings::LosslessU8 && encoding != Encodings::LosslessU16)
+	{
+		out.assign((const uint8_t*)buffer, (const uint8_t*)buffer + length);
+		return true;
+	}
+	size_t pixels = (size_t)metadata.width * metadata.height;
+	int samplesize = encoding == Encodings::LosslessU16 ? 2 : 1;
+	if (pixels == 0 || length % (pixels * samplesize) != 0 || length / pixels > UINT8_MAX)
+	{
+		cerr << "Encoding " << (int)metadata.encoding << " needs whole pixels, length " << length << " for " << metadata.width << "x" << metadata.height << endl;
+		return false;
+	}
+	if (encoding == Encodings::Delta)
+	{
+		if (keyframe_requested.exchange(false))
+		{
+			delta_encoder->ForceKeyframe();
+		}
+		keyframe = delta_encoder->Encode(metadata.identifier, (const uint8_t*)buffer, metadata.width, metadata.height, length / pixels, out);
+		return true;
+	}
+	return LosslessCodec::Encode(buffer, metadata.width, metadata.height, length / (pixels * samplesize), samplesize, out, GetWorkers());
+}
+
+void ImageProtocol::QueueFrame(const std::shared_ptr<OutgoingFrame> &frame)
+{
+	lock_guard lock(sendmutex);
+	if (retransmit_deadline.load().count() > 0)
+	{
+		CacheFrame(frame);
+	}
+	for (auto &client : clients)
+	{
+		Enqueue(client, frame);
+	}
+	ReceiveRequests();
+}
+
+void ImageProtocol::SendImage(const void* buffer, size_t length, ImageMetadata metadata)
 {
 	if (!IsServer())
 	{
 		cerr << "Client can't send images !" <<endl;
 		return;
 	}
-	#if 0
-	if (server_connections.size() == 0)
+	if (client_count == 0)
 	{
-		ServerReceive();
+		if (!pipeline)
+		{
+			ServerReceive();
+		}
 		return;
 	}
-	
-	
-	//std::array<uint8_t, sizeof(Header) + sizeof(metadata)> message;
-	Header &head = *reinterpret_cast<Header*>(buffer);
-	head = Header(PacketTypes::Image);
-	ImageMetadata &met = *reinterpret_cast<ImageMetadata*>(((uint8_t*)buffer) + sizeof(head));
-	met = metadata;
-	for (auto client : server_connections)
-	{
-		//socket->SendMessageToConnection(client, message.data(), message.size(), k_nSteamNetworkingSend_Unreliable, nullptr);
-		EResult result = socket->SendMessageToConnection(client, buffer, length, k_nSteamNetworkingSend_Unreliable, nullptr);
-		/// - k_EResultInvalidParam: invalid connection handle, or the individual message is too big.
-		///   (See k_cbMaxSteamNetworkingSocketsMessageSizeSend)
-		/// - k_EResultInvalidState: connection is in an invalid state
-		/// - k_EResultNoConnection: connection has ended
-		/// - k_EResultIgnored: You used k_nSteamNetworkingSend_NoDelay, and the message was dropped because
-		///   we were not ready to send it.
-		/// - k_EResultLimitExceeded: there was already too much data queued to be sent.
-		///   (See k_ESteamNetworkingConfig_SendBufferSize)
-		switch (result)
+	if (pipeline)
+	{
+		PendingImage image;
+		image.metadata = metadata;
+		image.data.assign((const uint8_t*)buffer, (const uint8_t*)buffer + length);
+		pipeline->Push(std::move(image));
+		return;
+	}
+	vector<uint8_t> data;
+	bool keyframe;
+	if (!EncodeImage(buffer, length, metadata, data, keyframe))
+	{
+		return;
+	}
+	auto frame = BuildFrame(std::move(data), metadata);
+	if (!frame)
+	{
+		return;
+	}
+	frame->keyframe = keyframe;
+	QueueFrame(frame);
+}
+
+void ImageProtocol::StartPipeline(int queuedepth)
+{
+	if (!IsServer())
+	{
+		cerr << "Client can't send images !" <<endl;
+		return;
+	}
+	pipeline.reset();
+	pipeline = make_unique<SendPipeline>(this, queuedepth);
+}
+
+void ImageProtocol::StopPipeline()
+{
+	pipeline.reset();
+}
+
+uint64_t ImageProtocol::GetPipelineDroppedFrames() const
+{
+	return pipeline ? pipeline->GetDroppedFrames() : 0;
+}
+
+void ImageProtocol::Flush()
+{
+	lock_guard lock(sendmutex);
+	FlushClients();
+}
+
+void ImageProtocol::FlushClients()
+{
+	static constexpr int FlushBatch = 32;
+	GenericTransport::Datagram datagrams[FlushBatch];
+	//round robin so that every client progresses, until nobody can
+	bool progress = true;
+	while (progress)
+	{
+		progress = false;
+		for (auto &client : clients)
 		{
-		case k_EResultInvalidParam:
-			cout << "Send Image Invalid param" << endl;
-			break;
-		case k_EResultInvalidState:
-			cout << "Send image invalid state" << endl;
-			break;
-		case k_EResultNoConnection:
-			cout << "Send image no connection" << endl;
-			break;
-		case k_EResultIgnored:
-			cout << "Send image ignored" << endl;
-			break;
-		case k_EResultLimitExceeded:
-			cout << "Send image limit exceeded" << endl;
-			break;
+			if (!client.current)
+			{
+				if (client.pending.empty())
+				{
+					continue;
+				}
+				client.current = client.pending.front();
+				client.pending.pop_front();
+				client.position = 0;
+			}
+			OutgoingFrame &frame = *client.current;
+			int batch = min<size_t>(FlushBatch, frame.order.size() - client.position);
+			for (int i = 0; i < batch; i++)
+			{
+				GenericTransport::Datagram &datagram = datagrams[i];
+				datagram.buffer = nullptr;
+				datagram.maxlength = 0;
+				datagram.length = 0;
+				datagram.token = client.token;
+				datagram.iov = &frame.iovs[frame.order[client.position + i]*3];
+				datagram.iovcnt = 3;
+				datagram.options = GetImageOptions(frame);
+			}
+			int sent = transport->TrySendBatch(datagrams, batch);
+			client.position += sent;
+			if (client.position == frame.order.size())
+			{
+				client.statistics.sent++;
+				client.current.reset();
+				progress = true;
+			}
+			else if (sent > 0)
+			{
+				progress = true;
+			}
+			else if (!client.token->IsConnected())
+			{
+				client.statistics.dropped += 1 + client.pending.size();
+				client.current.reset();
+				client.pending.clear();
+			}
+		}
+	}
+}
 
-		default:
-			break;
+bool ImageProtocol::HasQueuedFragments() const
+{
+	for (auto &client : clients)
+	{
+		if (client.current || !client.pending.empty())
+		{
+			return true;
 		}
 	}
-	#endif
-	ServerReceive();
+	return false;
+}
+
+std::optional<ImageProtocol::SendQueueStatistics> ImageProtocol::GetSendQueueStatistics(std::shared_ptr<ConnectionToken> client) const
+{
+	lock_guard lock(sendmutex);
+	for (auto &queue : clients)
+	{
+		if (queue.token == client)
+		{
+			return queue.statistics;
+		}
+	}
+	return nullopt;
 }
 
 void ImageProtocol::ServerReceive()
 {
-	#if 0
-	socket->RunCallbacks();
-	SteamNetworkingMessage_t *message;
+	lock_guard lock(sendmutex);
+	ReceiveRequests();
+}
 
+void ImageProtocol::ReceiveRequests()
+{
+	array<uint8_t, MaxDatagramSize> message;
 	do
 	{
-		int numreceived = socket->ReceiveMessagesOnPollGroup(poll_group, &message, 1);
-		//auto received = transport.ReceiveAny(message.data(), message.size());
-		if (numreceived == 0)
+		auto received = transport->ReceiveAny(message.data(), message.size());
+		if (received.second == nullptr)
 		{
 			break;
 		}
-		if (message->GetSize() < sizeof(Header))
+		if (received.first < (int)sizeof(Header))
 		{
-			cerr << "Packet too small for header, length " << message->GetSize() << endl;
-			message->Release();
-			break;
+			cerr << "Packet too small for header, length " << received.first << endl;
+			continue;
 		}
-		const Header &head = *reinterpret_cast<const Header*>(message->GetData());
+		const Header &head = *reinterpret_cast<const Header*>(message.data());
 		auto type = head.GetPacketType();
 		if (head.version != PROTOCOL_VERSION)
 		{
 			cerr << "Unknown Image Protocol version " << head.version << endl;
-			message->Release();
-			break;
+			continue;
 		}
 		if (type == PacketTypes::None)
 		{
-			cerr << "Received an invalid packet type " << head.type << endl;
-			message->Release();
-			break;
+			cerr << "Received an invalid packet type " << string(head.type, sizeof(head.type)) << endl;
+			continue;
 		}
-		SteamNetConnectionInfo_t info;
-		char ipaddr[64];
-		socket->GetConnectionInfo(message->GetConnection(), &info);
-		info.m_addrRemote.ToString(ipaddr, sizeof(ipaddr), true);
 		
 		switch (type)
 		{
 		case PacketTypes::Handshake :
-			cout << "Received handshake from " << ipaddr << endl;
+			cout << "Received handshake from " << received.second->GetConnectionName() << endl;
+			if (find_if(clients.begin(), clients.end(), 
+				[&received](const ClientQueue &client){return client.token == received.second;}) == clients.end())
+			{
+				ClientQueue client;
+				client.token = received.second;
+				clients.push_back(client);
+				keyframe_requested = true;
+			}
+			break;
+
+		case PacketTypes::Nack :
+			HandleNack(message.data(), received.first, received.second);
 			break;
 		
 		default:
 			cout << "Packet type not supported yet" << endl;
 			break;
 		}
-		message->Release();
 	} while (1);
-	
-	#endif
 
+	FlushClients();
+
+	//forget clients the transport dropped
+	clients.erase(remove_if(clients.begin(), clients.end(), 
+		[](const ClientQueue &client){return !client.token->IsConnected();}), clients.end());
+	client_count = clients.size();
+}
+
+std::optional<ImageProtocol::Image> ImageProtocol::ReceiveFrame()
+{
+	optional<Image> image;
+	while (!image.has_value())
+	{
+		auto lease = server->ReceiveView();
+		if (!lease.has_value() || lease->IsEmpty())
+		{
+			break;
+		}
+		const uint8_t* data = reinterpret_cast<const uint8_t*>(lease->GetData());
+		size_t size = lease->GetSize();
+		if (size < sizeof(Header) + sizeof(FragmentHeader))
+		{
+			cerr << "Packet too small for image fragment, length " << size << endl;
+			continue;
+		}
+		const Header &head = *reinterpret_cast<const Header*>(data);
+		if (head.version != PROTOCOL_VERSION)
+		{
+			cerr << "Unknown Image Protocol version " << head.version << endl;
+			continue;
+		}
+		auto type = head.GetPacketType();
+		if (type != PacketTypes::Image)
+		{
+			cerr << "Unhandled packet type " << string(head.type, sizeof(head.type)) << endl;
+			continue;
+		}
+		const FragmentHeader &fragment = *reinterpret_cast<const FragmentHeader*>(data + sizeof(Header));
+		size_t offset = sizeof(Header) + sizeof(FragmentHeader);
+		image = reassembler->AddFragment(fragment, data + offset, size - offset);
+	}
+	if (nack_interval.count() > 0)
+	{
+		SendNacks();
+	}
+	reassembler->Expire();
+	return image;
+}
+
+bool ImageProtocol::DecodeImage(Image &image, DeltaDecoder &decoder, FramePool* pool)
+{
+	Encodings encoding = (Encodings)image.metadata.encoding;
+	if (encoding == Encodings::Delta)
+	{
+		return decoder.Decode(image, pool);
+	}
+	if (encoding != Encodings::LosslessU8 && encoding != Encodings::LosslessU16)
+	{
+		return true;
+	}
+	vector<uint8_t> decoded = pool ? pool->Acquire(0) : vector<uint8_t>();
+	if (!LosslessCodec::Decode(image.data.data(), image.data.size(), image.metadata.width, image.metadata.height, decoded, GetWorkers()))
+	{
+		if (pool)
+		{
+			pool->Release(std::move(decoded));
+			pool->Release(std::move(image.data));
+		}
+		return false;
+	}
+	if (pool)
+	{
+		pool->Release(std::move(image.data));
+	}
+	image.data = std::move(decoded);
+	image.metadata.encoding = (uint8_t)Encodings::Raw;
+	return true;
 }
 
 std::optional<ImageProtocol::Image> ImageProtocol::ReceiveImage()
@@ -274,183 +538,193 @@ std::optional<ImageProtocol::Image> ImageProtocol::ReceiveImage()
 		cerr << "Server can't receive images !" <<endl;
 		return nullopt;
 	}
-	#if 0
-	SteamNetworkingMessage_t *message;
-	int numreceived = socket->ReceiveMessagesOnConnection(client_connection, &message, 1);
-	if (numreceived == 0)
+	while (true)
 	{
-		return nullopt;
+		auto image = ReceiveFrame();
+		if (!image.has_value())
+		{
+			return nullopt;
+		}
+		if (DecodeImage(image.value(), *delta_decoder, nullptr))
+		{
+			return image;
+		}
 	}
-	const uint8_t* data = reinterpret_cast<const uint8_t*>(message->GetData());
-	const Header &head = *reinterpret_cast<const Header*>(data);
-	switch (head.version)
+}
+
+void ImageProtocol::StartReceivePipeline(ImageCallback callback, int decodethreads)
+{
+	if (IsServer())
 	{
-	case PROTOCOL_VERSION:
-		//ok
-		break;
-	
-	default:
-		cerr << "Unknown Image Protocol version " << head.version << endl;
-		return nullopt;
+		cerr << "Server can't receive images !" <<endl;
+		return;
 	}
-	auto type = head.GetPacketType();
-	if (type != PacketTypes::Image)
+	receive_pipeline.reset();
+	auto pool = make_shared<FramePool>();
+	reassembler->SetPool(pool);
+	GetWorkers(); //created now, the decode threads would race to create it
+	receive_pipeline = make_unique<ReceivePipeline>(this, callback, pool, decodethreads);
+}
+
+void ImageProtocol::StopReceivePipeline()
+{
+	receive_pipeline.reset();
+	reassembler->SetPool(nullptr);
+}
+
+uint64_t ImageProtocol::GetReceivePipelineDroppedFrames() const
+{
+	return receive_pipeline ? receive_pipeline->GetDroppedFrames() : 0;
+}
+
+GenericTransport::MessageOptions ImageProtocol::GetImageOptions(const OutgoingFrame &frame) const
+{
+	GenericTransport::MessageOptions options;
+	options.stream = ControlStream + 1 + frame.fragments[0].metadata.identifier;
+	options.unordered = true; //the reassembler takes fragments in any order
+	options.lifetime = frame_lifetime;
+	return options;
+}
+
+void ImageProtocol::CacheFrame(const std::shared_ptr<OutgoingFrame> &frame)
+{
+	sent_bytes += frame->data.size();
+	sent_frames.push_back(frame);
+	//always keep the last frame
+	while (sent_frames.size() > 1 && sent_bytes > retransmit_cache_size)
 	{
-		cerr << "Unhandled packet type " << head.type << endl;
-		return nullopt;
+		sent_bytes -= sent_frames.front()->data.size();
+		sent_frames.pop_front();
 	}
-
-	Image im;
-	im.metadata = *reinterpret_cast<const ImageMetadata*>(data+sizeof(Header));
-	im.data = std::vector<uint8_t>(data, data+message->GetSize());
-	return im;
-	#else
-	return nullopt;
-	#endif
 }
 
-#if 0
-void ImageProtocol::SteamNetConnectionStatusChangedCallback( SteamNetConnectionStatusChangedCallback_t *pInfo )
+void ImageProtocol::HandleNack(const uint8_t* message, size_t length, std::shared_ptr<ConnectionToken> client)
 {
-	if (pInfo->m_info.m_hListenSocket != k_HSteamListenSocket_Invalid)
+	if (length < sizeof(Header) + sizeof(NackHeader))
 	{
-		port_owner.at(pInfo->m_info.m_hListenSocket)->OnSteamNetConnectionStatusChanged(pInfo);
+		cerr << "NACK too small, length " << length << endl;
+		return;
 	}
-	else
+	const NackHeader &nack = *reinterpret_cast<const NackHeader*>(message + sizeof(Header));
+	const uint8_t* bitmap = message + sizeof(Header) + sizeof(NackHeader);
+	if (length < sizeof(Header) + sizeof(NackHeader) + (nack.count + 7) / 8)
+	{
+		cerr << "NACK bitmap truncated, " << nack.count << " bits" << endl;
+		return;
+	}
+	auto sent = find_if(sent_frames.rbegin(), sent_frames.rend(), 
+		[&nack](const shared_ptr<OutgoingFrame> &frame){return frame->fragments[0].frame == nack.frame;});
+	if (sent == sent_frames.rend() || chrono::system_clock::now() > (*sent)->deadline)
 	{
-		connection_owner.at(pInfo->m_hConn)->OnSteamNetConnectionStatusChanged(pInfo);
+		//too old, the client will give up on it
+		return;
 	}
+
+	const OutgoingFrame &frame = **sent;
+	int numdata = frame.fragments[0].count;
+	vector<GenericTransport::Datagram> datagrams;
+	datagrams.reserve(nack.count);
+	for (int i = 0; i < nack.count; i++)
+	{
+		int index = nack.first + i;
+		if ((bitmap[i/8] & (1 << (i%8))) == 0 || index >= numdata)
+		{
+			continue;
+		}
+		GenericTransport::Datagram datagram;
+		datagram.buffer = nullptr;
+		datagram.maxlength = 0;
+		datagram.length = 0;
+		datagram.token = client;
+		datagram.iov = &frame.iovs[index*3];
+		datagram.iovcnt = 3;
+		datagram.options = GetImageOptions(frame);
+		datagrams.push_back(datagram);
+	}
+	retransmitted += transport->SendBatch(datagrams.data(), datagrams.size());
 }
 
-void ImageProtocol::OnSteamNetConnectionStatusChanged( SteamNetConnectionStatusChangedCallback_t *pInfo )
+void ImageProtocol::SendNacks()
 {
-	if (IsServer())
+	array<uint8_t, MaxDatagramSize> message;
+	Header &head = *reinterpret_cast<Header*>(message.data());
+	head = Header(PacketTypes::Nack);
+	NackHeader &nack = *reinterpret_cast<NackHeader*>(message.data() + sizeof(Header));
+	uint8_t* bitmap = message.data() + sizeof(Header) + sizeof(NackHeader);
+	for (auto &missing : reassembler->GetNacks(nack_interval))
 	{
-		switch (pInfo->m_info.m_eState)
+		//one packet per span of MaxNackBits fragments
+		size_t i = 0;
+		while (i < missing.missing.size())
 		{
-		case k_ESteamNetworkingConnectionState_Connecting:
+			nack.frame = missing.frame;
+			nack.first = missing.missing[i];
+			nack.count = 0;
+			memset(bitmap, 0, MaxNackBits / 8);
+			for (; i < missing.missing.size() && missing.missing[i] - nack.first < MaxNackBits; i++)
 			{
-				char ipbuf[64];
-				pInfo->m_info.m_addrRemote.ToString(ipbuf, sizeof(ipbuf), true);
-				socket->AcceptConnection(pInfo->m_hConn);
-
-				//set poll group
-				if( !socket->SetConnectionPollGroup(pInfo->m_hConn, poll_group))
-				{
-					socket->CloseConnection(pInfo->m_hConn, 0, nullptr, false);
-					cerr << "Failed to set poll group on " << ipbuf << endl;
-					break;
-				}
-
-				server_connections.push_back(pInfo->m_hConn);
-				cout << ipbuf << " just connected" << endl;
+				int bit = missing.missing[i] - nack.first;
+				bitmap[bit/8] |= 1 << (bit%8);
+				nack.count = bit + 1;
 			}
-			break;
-		case k_ESteamNetworkingConnectionState_None:
-			// NOTE: We will get callbacks here when we destroy connections.  You can ignore these.
-			break;
-		case k_ESteamNetworkingConnectionState_ClosedByPeer:
-		case k_ESteamNetworkingConnectionState_ProblemDetectedLocally:
-			{
-				// Ignore if they were not previously connected.  (If they disconnected
-				// before we accepted the connection.)
-				if ( pInfo->m_eOldState == k_ESteamNetworkingConnectionState_Connected )
-				{
+			server->Send(message.data(), sizeof(Header) + sizeof(NackHeader) + (nack.count + 7) / 8);
+		}
+	}
+}
 
-					// Locate the client.  Note that it should have been found, because this
-					// is the only codepath where we remove clients (except on shutdown),
-					// and connection change callbacks are dispatched in queue order.
-					auto itClient = std::find(server_connections.begin(), server_connections.end(), pInfo->m_hConn);
-					assert( itClient != server_connections.end() );
-
-					char ipbuf[64];
-					pInfo->m_info.m_addrRemote.ToString(ipbuf, sizeof(ipbuf), true);
-
-					if ( pInfo->m_info.m_eState == k_ESteamNetworkingConnectionState_ProblemDetectedLocally )
-					{
-						cout << ipbuf << " disconnected dut to problem" <<endl;
-					}
-					else
-					{
-						cout << ipbuf << " disconnected by peer" <<endl;
-					}
-
-					server_connections.erase( itClient );
-				}
-				else
-				{
-					assert( pInfo->m_eOldState == k_ESteamNetworkingConnectionState_Connecting );
-				}
+void ImageProtocol::SetReassemblyTimeout(std::chrono::milliseconds timeout)
+{
+	reassembler->SetTimeout(timeout);
+}
 
-				// Clean up the connection.  This is important!
-				// The connection is "closed" in the network sense, but
-				// it has not been destroyed.  We must close it on our end, too
-				// to finish up.  The reason information do not matter in this case,
-				// and we cannot linger because it's already closed on the other end,
-				// so we just pass 0's.
-				socket->CloseConnection( pInfo->m_hConn, 0, nullptr, false );
-				break;
-			}
-			break;
-		default:
-			break;
-		}
+WorkerPool* ImageProtocol::GetWorkers()
+{
+	if (!workers)
+	{
+		workers = make_unique<WorkerPool>(0, "ImageCodec");
 	}
-	else
+	return workers.get();
+}
+
+void ImageProtocol::SetKeyframeInterval(int frames)
+{
+	delta_encoder->SetKeyframeInterval(frames);
+}
+
+void ImageProtocol::SetRetransmission(std::chrono::milliseconds deadline, size_t cachesize)
+{
+	lock_guard lock(sendmutex);
+	retransmit_deadline = deadline;
+	retransmit_cache_size = cachesize;
+	if (deadline.count() <= 0)
 	{
-		assert( pInfo->m_hConn == client_connection || client_connection == k_HSteamNetConnection_Invalid );
-		switch ( pInfo->m_info.m_eState )
-		{
-			case k_ESteamNetworkingConnectionState_None:
-				// NOTE: We will get callbacks here when we destroy connections.  You can ignore these.
-				break;
+		sent_frames.clear();
+		sent_bytes = 0;
+	}
+}
 
-			case k_ESteamNetworkingConnectionState_ClosedByPeer:
-			case k_ESteamNetworkingConnectionState_ProblemDetectedLocally:
-			{
-				// Print an appropriate message
-				if ( pInfo->m_eOldState == k_ESteamNetworkingConnectionState_Connecting )
-				{
-					// Note: we could distinguish between a timeout, a rejected connection,
-					// or some other transport problem.
-					cout << "We got rejected during connection" << endl;
-				}
-				else if ( pInfo->m_info.m_eState == k_ESteamNetworkingConnectionState_ProblemDetectedLocally )
-				{
-					cout << "Host lost" << endl;
-				}
-				else
-				{
-					// NOTE: We could check the reason code for a normal disconnection
-					cout << "Disconnected" << endl;
-				}
+void ImageProtocol::SetFrameLifetime(std::chrono::milliseconds lifetime)
+{
+	lock_guard lock(sendmutex);
+	frame_lifetime = lifetime;
+}
 
-				// Clean up the connection.  This is important!
-				// The connection is "closed" in the network sense, but
-				// it has not been destroyed.  We must close it on our end, too
-				// to finish up.  The reason information do not matter in this case,
-				// and we cannot linger because it's already closed on the other end,
-				// so we just pass 0's.
-				socket->CloseConnection( pInfo->m_hConn, 0, nullptr, false );
-				client_connection = k_HSteamNetConnection_Invalid;
-				break;
-			}
+void ImageProtocol::SetNackInterval(std::chrono::milliseconds interval)
+{
+	nack_interval = interval;
+}
 
-			case k_ESteamNetworkingConnectionState_Connecting:
-				// We will get this callback when we start connecting.
-				// We can ignore this.
-				break;
+void ImageProtocol::SetFEC(float overhead)
+{
+	fec_overhead = overhead;
+}
 
-			case k_ESteamNetworkingConnectionState_Connected:
-				cout << "Connected to server OK" << endl;
-				socket->SetConnectionPollGroup(pInfo->m_hConn, poll_group);
-				break;
+uint64_t ImageProtocol::GetDroppedFrames() const
+{
+	return reassembler->GetDroppedFrames();
+}
 
-			default:
-				// Silences -Wswitch
-				break;
-			
-		}
-	}
+uint64_t ImageProtocol::GetRecoveredFragments() const
+{
+	return reassembler->GetRecoveredFragments();
 }
-#endif
\ No newline at end of file
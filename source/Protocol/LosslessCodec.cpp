@@ -0,0 +1,533 @@
+#include <Protocol/LosslessCodec.hpp>
+#include <Transport/WorkerPool.hpp>
+#include <string.h>
+#include <iostream>
+#include <algorithm>
+#include <type_traits>
+#include <atomic>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+namespace
+{
+	template<typename T>
+	inline T ZigZag(T value)
+	{
+		typedef typename make_signed<T>::type S;
+		S r = (S)value;
+		return (T)(((unsigned)r << 1) ^ (unsigned)(r >> (sizeof(T)*8 - 1)));
+	}
+
+	template<typename T>
+	inline T UnZigZag(T value)
+	{
+		return (T)((value >> 1) ^ (T)(-(int)(value & 1)));
+	}
+
+	//Vectorized part of the rows that have an up neighbour, returns the first index left to do
+	inline int ResidualRowSIMD(const uint8_t* cur, const uint8_t* up, int length, int channels, uint8_t* out, int i)
+	{
+#ifdef __SSE2__
+		const __m128i zero = _mm_setzero_si128();
+		for (; i + 16 <= length; i += 16)
+		{
+			__m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(cur + i));
+			__m128i l = _mm_loadu_si128(reinterpret_cast<const __m128i*>(cur + i - channels));
+			__m128i u = _mm_loadu_si128(reinterpret_cast<const __m128i*>(up + i));
+			__m128i ul = _mm_loadu_si128(reinterpret_cast<const __m128i*>(up + i - channels));
+			__m128i r = _mm_sub_epi8(c, _mm_sub_epi8(_mm_add_epi8(l, u), ul));
+			__m128i zz = _mm_xor_si128(_mm_add_epi8(r, r), _mm_cmpgt_epi8(zero, r));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), zz);
+		}
+#endif
+		return i;
+	}
+
+	inline int ResidualRowSIMD(const uint16_t* cur, const uint16_t* up, int length, int channels, uint16_t* out, int i)
+	{
+#ifdef __SSE2__
+		for (; i + 8 <= length; i += 8)
+		{
+			__m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(cur + i));
+			__m128i l = _mm_loadu_si128(reinterpret_cast<const __m128i*>(cur + i - channels));
+			__m128i u = _mm_loadu_si128(reinterpret_cast<const __m128i*>(up + i));
+			__m128i ul = _mm_loadu_si128(reinterpret_cast<const __m128i*>(up + i - channels));
+			__m128i r = _mm_sub_epi16(c, _mm_sub_epi16(_mm_add_epi16(l, u), ul));
+			__m128i zz = _mm_xor_si128(_mm_add_epi16(r, r), _mm_srai_epi16(r, 15));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), zz);
+		}
+#endif
+		return i;
+	}
+
+	//cur[i] = residual + up - upleft, the left neighbour is added afterwards
+	inline int PartialRowSIMD(const uint8_t* residuals, const uint8_t* up, int length, int channels, uint8_t* cur, int i)
+	{
+#ifdef __SSE2__
+		const __m128i one = _mm_set1_epi8(1);
+		const __m128i low7 = _mm_set1_epi8(0x7F);
+		for (; i + 16 <= length; i += 16)
+		{
+			__m128i zz = _mm_loadu_si128(reinterpret_cast<const __m128i*>(residuals + i));
+			__m128i r = _mm_xor_si128(_mm_and_si128(_mm_srli_epi16(zz, 1), low7), 
+				_mm_sub_epi8(_mm_setzero_si128(), _mm_and_si128(zz, one)));
+			__m128i u = _mm_loadu_si128(reinterpret_cast<const __m128i*>(up + i));
+			__m128i ul = _mm_loadu_si128(reinterpret_cast<const __m128i*>(up + i - channels));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(cur + i), _mm_sub_epi8(_mm_add_epi8(r, u), ul));
+		}
+#endif
+		return i;
+	}
+
+	inline int PartialRowSIMD(const uint16_t* residuals, const uint16_t* up, int length, int channels, uint16_t* cur, int i)
+	{
+#ifdef __SSE2__
+		const __m128i one = _mm_set1_epi16(1);
+		for (; i + 8 <= length; i += 8)
+		{
+			__m128i zz = _mm_loadu_si128(reinterpret_cast<const __m128i*>(residuals + i));
+			__m128i r = _mm_xor_si128(_mm_srli_epi16(zz, 1), _mm_sub_epi16(_mm_setzero_si128(), _mm_and_si128(zz, one)));
+			__m128i u = _mm_loadu_si128(reinterpret_cast<const __m128i*>(up + i));
+			__m128i ul = _mm_loadu_si128(reinterpret_cast<const __m128i*>(up + i - channels));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(cur + i), _mm_sub_epi16(_mm_add_epi16(r, u), ul));
+		}
+#endif
+		return i;
+	}
+
+	//up is null on the first row of a slice
+	template<typename T>
+	void ResidualRow(const T* cur, const T* up, int length, int channels, T* out)
+	{
+		int i = 0;
+		for (; i < channels && i < length; i++)
+		{
+			out[i] = ZigZag<T>(cur[i] - (up ? up[i] : 0));
+		}
+		if (up == nullptr)
+		{
+			for (; i < length; i++)
+			{
+				out[i] = ZigZag<T>(cur[i] - cur[i - channels]);
+			}
+			return;
+		}
+		i = ResidualRowSIMD(cur, up, length, channels, out, i);
+		for (; i < length; i++)
+		{
+			out[i] = ZigZag<T>(cur[i] - (T)(cur[i - channels] + up[i] - up[i - channels]));
+		}
+	}
+
+	//cur[i] += cur[i - C], with the left neighbours kept in registers
+	template<typename T, int C>
+	void AddLeft(T* cur, int start, int length)
+	{
+		T left[C];
+		for (int c = 0; c < C; c++)
+		{
+			left[c] = cur[start - C + c];
+		}
+		int i = start;
+		for (; i + C <= length; i += C)
+		{
+			for (int c = 0; c < C; c++)
+			{
+				left[c] = cur[i + c] += left[c];
+			}
+		}
+		for (int c = 0; i < length; i++, c++)
+		{
+			cur[i] += left[c];
+		}
+	}
+
+	template<typename T>
+	void ReconstructRow(const T* residuals, const T* up, int length, int channels, T* cur)
+	{
+		int i = 0;
+		for (; i < channels && i < length; i++)
+		{
+			cur[i] = UnZigZag<T>(residuals[i]) + (up ? up[i] : 0);
+		}
+		if (up == nullptr)
+		{
+			for (; i < length; i++)
+			{
+				cur[i] = UnZigZag<T>(residuals[i]) + cur[i - channels];
+			}
+			return;
+		}
+		int start = i;
+		i = PartialRowSIMD(residuals, up, length, channels, cur, i);
+		for (; i < length; i++)
+		{
+			cur[i] = UnZigZag<T>(residuals[i]) + up[i] - up[i - channels];
+		}
+		//the left neighbour has to be final, this part is serial
+		switch (channels)
+		{
+		case 1:
+			AddLeft<T, 1>(cur, start, length);
+			break;
+		case 2:
+			AddLeft<T, 2>(cur, start, length);
+			break;
+		case 3:
+			AddLeft<T, 3>(cur, start, length);
+			break;
+		case 4:
+			AddLeft<T, 4>(cur, start, length);
+			break;
+		default:
+			for (i = start; i < length; i++)
+			{
+				cur[i] += cur[i - channels];
+			}
+			break;
+		}
+	}
+
+	template<typename T>
+	size_t GetMaxPackedSize(size_t count)
+	{
+		return count * sizeof(T) + (count + LosslessCodec::BlockSize - 1) / LosslessCodec::BlockSize;
+	}
+
+	//Pack a full block on Bits bits. Fully unrolled, every shift and store is known at compile time
+	template<typename T, int Bits>
+	uint8_t* PackBlock(const T* values, uint8_t* out)
+	{
+		uint64_t accumulator = 0;
+		int accumulated = 0;
+#pragma GCC unroll 32
+		for (int i = 0; i < LosslessCodec::BlockSize; i++)
+		{
+			accumulator |= (uint64_t)values[i] << accumulated;
+			accumulated += Bits;
+			if (accumulated >= 32)
+			{
+				uint32_t word = accumulator;
+				memcpy(out, &word, sizeof(word));
+				out += sizeof(word);
+				accumulator >>= 32;
+				accumulated -= 32;
+			}
+		}
+		return out;
+	}
+
+	template<typename T, int Bits>
+	const uint8_t* UnpackBlock(const uint8_t* in, T* values)
+	{
+		constexpr uint64_t mask = (1ull << Bits) - 1;
+		uint64_t accumulator = 0;
+		int accumulated = 0;
+#pragma GCC unroll 32
+		for (int i = 0; i < LosslessCodec::BlockSize; i++)
+		{
+			if (accumulated < Bits)
+			{
+				uint32_t word;
+				memcpy(&word, in, sizeof(word));
+				in += sizeof(word);
+				accumulator |= (uint64_t)word << accumulated;
+				accumulated += 32;
+			}
+			values[i] = accumulator & mask;
+			accumulator >>= Bits;
+			accumulated -= Bits;
+		}
+		return in;
+	}
+
+	//Bit widths are only known at runtime, pick the unrolled version
+	template<typename T, int Bits = 1>
+	uint8_t* PackBlockDispatch(int bits, const T* values, uint8_t* out)
+	{
+		if constexpr (Bits <= (int)sizeof(T)*8)
+		{
+			if (bits == Bits)
+			{
+				return PackBlock<T, Bits>(values, out);
+			}
+			return PackBlockDispatch<T, Bits + 1>(bits, values, out);
+		}
+		return out;
+	}
+
+	template<typename T, int Bits = 1>
+	const uint8_t* UnpackBlockDispatch(int bits, const uint8_t* in, T* values)
+	{
+		if constexpr (Bits <= (int)sizeof(T)*8)
+		{
+			if (bits == Bits)
+			{
+				return UnpackBlock<T, Bits>(in, values);
+			}
+			return UnpackBlockDispatch<T, Bits + 1>(bits, in, values);
+		}
+		return in;
+	}
+
+	//Last, partial block of a slice
+	template<typename T>
+	uint8_t* PackBits(const T* values, int n, int bits, uint8_t* out)
+	{
+		uint64_t accumulator = 0;
+		int accumulated = 0;
+		for (int i = 0; i < n; i++)
+		{
+			accumulator |= (uint64_t)values[i] << accumulated;
+			accumulated += bits;
+			while (accumulated >= 8)
+			{
+				*out++ = accumulator;
+				accumulator >>= 8;
+				accumulated -= 8;
+			}
+		}
+		if (accumulated > 0)
+		{
+			*out++ = accumulator;
+		}
+		return out;
+	}
+
+	template<typename T>
+	const uint8_t* UnpackBits(const uint8_t* in, int n, int bits, T* values)
+	{
+		const uint64_t mask = (1ull << bits) - 1;
+		uint64_t accumulator = 0;
+		int accumulated = 0;
+		for (int i = 0; i < n; i++)
+		{
+			while (accumulated < bits)
+			{
+				accumulator |= (uint64_t)*in++ << accumulated;
+				accumulated += 8;
+			}
+			values[i] = accumulator & mask;
+			accumulator >>= bits;
+			accumulated -= bits;
+		}
+		return in;
+	}
+
+	//Each block is its bit width followed by the values packed on that many bits
+	template<typename T>
+	uint8_t* PackBlocks(const T* values, size_t count, uint8_t* out)
+	{
+		for (size_t block = 0; block < count; block += LosslessCodec::BlockSize)
+		{
+			int n = min<size_t>(LosslessCodec::BlockSize, count - block);
+			unsigned all = 0;
+			for (int i = 0; i < n; i++)
+			{
+				all |= values[block + i];
+			}
+			int bits = all == 0 ? 0 : 32 - __builtin_clz(all);
+			*out++ = bits;
+			if (bits == 0)
+			{
+				continue;
+			}
+			if (n == LosslessCodec::BlockSize)
+			{
+				//a full block is exactly 4*bits bytes
+				out = PackBlockDispatch<T>(bits, values + block, out);
+			}
+			else
+			{
+				out = PackBits<T>(values + block, n, bits, out);
+			}
+		}
+		return out;
+	}
+
+	template<typename T>
+	const uint8_t* UnpackBlocks(const uint8_t* in, const uint8_t* end, size_t count, T* values)
+	{
+		for (size_t block = 0; block < count; block += LosslessCodec::BlockSize)
+		{
+			int n = min<size_t>(LosslessCodec::BlockSize, count - block);
+			if (in >= end)
+			{
+				return nullptr;
+			}
+			int bits = *in++;
+			if (bits > (int)sizeof(T)*8 || end - in < (n * bits + 7) / 8)
+			{
+				return nullptr;
+			}
+			if (bits == 0)
+			{
+				memset(values + block, 0, n * sizeof(T));
+				continue;
+			}
+			if (n == LosslessCodec::BlockSize)
+			{
+				in = UnpackBlockDispatch<T>(bits, in, values + block);
+			}
+			else
+			{
+				in = UnpackBits<T>(in, n, bits, values + block);
+			}
+		}
+		return in;
+	}
+
+	template<typename T>
+	void EncodeSlice(const T* pixels, int rowlength, int firstrow, int numrows, vector<uint8_t> &out, int channels)
+	{
+		//reused from frame to frame to avoid faulting fresh pages in
+		thread_local vector<T> residuals;
+		residuals.resize((size_t)rowlength * numrows);
+		for (int row = 0; row < numrows; row++)
+		{
+			const T* cur = pixels + (size_t)(firstrow + row) * rowlength;
+			ResidualRow<T>(cur, row == 0 ? nullptr : cur - rowlength, rowlength, channels, residuals.data() + (size_t)row * rowlength);
+		}
+		out.resize(GetMaxPackedSize<T>(residuals.size()));
+		uint8_t* end = PackBlocks<T>(residuals.data(), residuals.size(), out.data());
+		out.resize(end - out.data());
+	}
+
+	template<typename T>
+	bool DecodeSlice(const uint8_t* in, size_t length, int rowlength, int firstrow, int numrows, T* pixels, int channels)
+	{
+		thread_local vector<T> residuals;
+		residuals.resize((size_t)rowlength * numrows);
+		if (UnpackBlocks<T>(in, in + length, residuals.size(), residuals.data()) == nullptr)
+		{
+			return false;
+		}
+		for (int row = 0; row < numrows; row++)
+		{
+			T* cur = pixels + (size_t)(firstrow + row) * rowlength;
+			ReconstructRow<T>(residuals.data() + (size_t)row * rowlength, row == 0 ? nullptr : cur - rowlength, rowlength, channels, cur);
+		}
+		return true;
+	}
+
+	void RunSlices(int slices, WorkerPool* pool, const function<void(int)> &job)
+	{
+		if (pool != nullptr && slices > 1)
+		{
+			pool->ParallelFor(slices, job);
+			return;
+		}
+		for (int i = 0; i < slices; i++)
+		{
+			job(i);
+		}
+	}
+}
+
+bool LosslessCodec::Encode(const void* pixels, uint16_t width, uint16_t height, int channels, int samplesize, 
+	std::vector<uint8_t> &out, WorkerPool* pool)
+{
+	if ((samplesize != 1 && samplesize != 2) || channels <= 0 || channels > UINT8_MAX)
+	{
+		cerr << "Lossless codec can't encode " << channels << " channels of " << samplesize << " bytes" << endl;
+		return false;
+	}
+	LosslessHeader header;
+	header.samplesize = samplesize;
+	header.channels = channels;
+	header.slices = (height + SliceRows - 1) / SliceRows;
+	int rowlength = width * channels;
+	vector<vector<uint8_t>> slices(header.slices);
+	RunSlices(header.slices, pool, [&](int slice)
+	{
+		int firstrow = slice * SliceRows;
+		int numrows = min<int>(SliceRows, height - firstrow);
+		if (samplesize == 1)
+		{
+			EncodeSlice<uint8_t>((const uint8_t*)pixels, rowlength, firstrow, numrows, slices[slice], channels);
+		}
+		else
+		{
+			EncodeSlice<uint16_t>((const uint16_t*)pixels, rowlength, firstrow, numrows, slices[slice], channels);
+		}
+	});
+	size_t size = sizeof(header) + header.slices * sizeof(uint32_t);
+	for (auto &slice : slices)
+	{
+		size += slice.size();
+	}
+	out.resize(size);
+	uint8_t* position = out.data();
+	memcpy(position, &header, sizeof(header));
+	position += sizeof(header);
+	for (auto &slice : slices)
+	{
+		uint32_t slicesize = slice.size();
+		memcpy(position, &slicesize, sizeof(slicesize));
+		position += sizeof(slicesize);
+	}
+	for (auto &slice : slices)
+	{
+		memcpy(position, slice.data(), slice.size());
+		position += slice.size();
+	}
+	return true;
+}
+
+bool LosslessCodec::Decode(const uint8_t* encoded, size_t length, uint16_t width, uint16_t height, 
+	std::vector<uint8_t> &out, WorkerPool* pool)
+{
+	LosslessHeader header;
+	if (length < sizeof(header))
+	{
+		cerr << "Lossless frame too small, length " << length << endl;
+		return false;
+	}
+	memcpy(&header, encoded, sizeof(header));
+	if ((header.samplesize != 1 && header.samplesize != 2) || header.channels == 0 
+		|| header.slices != (height + SliceRows - 1) / SliceRows
+		|| length < sizeof(header) + header.slices * sizeof(uint32_t))
+	{
+		cerr << "Invalid lossless frame header" << endl;
+		return false;
+	}
+	vector<size_t> offsets(header.slices + 1);
+	offsets[0] = sizeof(header) + header.slices * sizeof(uint32_t);
+	for (int i = 0; i < header.slices; i++)
+	{
+		uint32_t slicesize;
+		memcpy(&slicesize, encoded + sizeof(header) + i * sizeof(uint32_t), sizeof(slicesize));
+		offsets[i+1] = offsets[i] + slicesize;
+	}
+	if (offsets.back() != length)
+	{
+		cerr << "Lossless frame slices don't add up, length " << length << endl;
+		return false;
+	}
+	int rowlength = width * header.channels;
+	out.resize((size_t)rowlength * height * header.samplesize);
+	atomic<bool> ok = true;
+	RunSlices(header.slices, pool, [&](int slice)
+	{
+		int firstrow = slice * SliceRows;
+		int numrows = min<int>(SliceRows, height - firstrow);
+		const uint8_t* in = encoded + offsets[slice];
+		size_t slicelength = offsets[slice+1] - offsets[slice];
+		bool decoded = header.samplesize == 1 ?
+			DecodeSlice<uint8_t>(in, slicelength, rowlength, firstrow, numrows, out.data(), header.channels) :
+			DecodeSlice<uint16_t>(in, slicelength, rowlength, firstrow, numrows, (uint16_t*)out.data(), header.channels);
+		if (!decoded)
+		{
+			ok = false;
+		}
+	});
+	if (!ok)
+	{
+		cerr << "Corrupted lossless frame" << endl;
+	}
+	return ok;
+}
@@ -0,0 +1,86 @@
+#include <Protocol/ReceivePipeline.hpp>
+#include <Protocol/DeltaCodec.hpp>
+#include <Protocol/FramePool.hpp>
+
+using namespace std;
+
+ReceivePipeline::ReceivePipeline(ImageProtocol* InProtocol, ImageProtocol::ImageCallback InCallback, std::shared_ptr<FramePool> InPool, int InNumThreads)
+	:Protocol(InProtocol), Callback(InCallback), Pool(InPool),
+	decoders(InNumThreads, "ImageDecode"),
+	receiver("ImageReceive", [this]{return ReceiveStep();}, chrono::microseconds(250))
+{
+	receiver.Start();
+}
+
+ReceivePipeline::~ReceivePipeline()
+{
+}
+
+bool ReceivePipeline::ReceiveStep()
+{
+	auto image = Protocol->ReceiveFrame();
+	if (!image.has_value())
+	{
+		return false;
+	}
+	Dispatch(std::move(image.value()));
+	return true;
+}
+
+void ReceivePipeline::Dispatch(ImageProtocol::Image &&image)
+{
+	auto &strand = strands[image.metadata.identifier];
+	if (!strand)
+	{
+		strand = make_unique<Strand>();
+		strand->delta = make_unique<DeltaDecoder>();
+	}
+	Strand* target = strand.get();
+	{
+		unique_lock lock(target->strandmutex);
+		if (target->pending.size() >= MaxPendingPerIdentifier)
+		{
+			//live video : the decoders can't keep up, the oldest frame is the least useful
+			Pool->Release(std::move(target->pending.front().data));
+			target->pending.pop_front();
+			dropped++;
+		}
+		target->pending.push_back(std::move(image));
+		if (target->running)
+		{
+			return;
+		}
+		target->running = true;
+	}
+	decoders.Submit([this, target]{RunStrand(target);});
+}
+
+void ReceivePipeline::RunStrand(Strand* strand)
+{
+	while (true)
+	{
+		ImageProtocol::Image image;
+		{
+			unique_lock lock(strand->strandmutex);
+			if (strand->pending.empty())
+			{
+				strand->running = false;
+				return;
+			}
+			image = std::move(strand->pending.front());
+			strand->pending.pop_front();
+		}
+		if (!Protocol->DecodeImage(image, *strand->delta, Pool.get()))
+		{
+			Pool->Release(std::move(image.data));
+			continue;
+		}
+		shared_ptr<FramePool> pool = Pool;
+		shared_ptr<ImageProtocol::Image> delivered(new ImageProtocol::Image(std::move(image)), [pool](ImageProtocol::Image* done)
+		{
+			pool->Release(std::move(done->data));
+			delete done;
+		});
+		Callback(delivered);
+	}
+}
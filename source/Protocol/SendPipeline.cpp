@@ -0,0 +1,126 @@
+#include <Protocol/SendPipeline.hpp>
+
+using namespace std;
+
+SendPipeline::SendPipeline(ImageProtocol* InProtocol, int InQueueDepth)
+	:Protocol(InProtocol),
+	rawqueue(InQueueDepth), encodedqueue(InQueueDepth), framequeue(InQueueDepth),
+	//every input of these two comes with a Wake, the idle wait is only a safety net
+	encoder("ImageEncode", [this]{return EncodeStep();}, 100ms),
+	fragmenter("ImageFragment", [this]{return FragmentStep();}, 100ms),
+	sender("ImageSend", [this]{return SendStep();})
+{
+	//the poll returning is all the send thread needs, it receives and flushes itself
+	attached = Protocol->transport->AttachEventLoop(&loop, [](shared_ptr<ConnectionToken> token, GenericTransport::TransportEvent event)
+	{
+		(void)token;
+		(void)event;
+	});
+	encoder.Start();
+	fragmenter.Start();
+	sender.Start();
+}
+
+SendPipeline::~SendPipeline()
+{
+	//get the send thread out of the loop before the stages join
+	sender.Kill();
+	loop.Wake();
+	if (attached)
+	{
+		Protocol->transport->DetachEventLoop();
+	}
+}
+
+void SendPipeline::WakeSender()
+{
+	sender.Wake();
+	loop.Wake();
+}
+
+bool SendPipeline::Push(ImageProtocol::PendingImage &&image)
+{
+	if (!rawqueue.Push(std::move(image)))
+	{
+		dropped++;
+		return false;
+	}
+	encoder.Wake();
+	return true;
+}
+
+bool SendPipeline::EncodeStep()
+{
+	//only this stage pushes there, if it isn't full now it won't be after the pop
+	if (encodedqueue.IsFull())
+	{
+		return false;
+	}
+	auto image = rawqueue.Pop();
+	if (!image.has_value())
+	{
+		return false;
+	}
+	ImageProtocol::PendingImage encoded;
+	encoded.metadata = image->metadata;
+	if (image->metadata.encoding == (uint8_t)ImageProtocol::Encodings::Raw)
+	{
+		encoded.data = std::move(image->data);
+	}
+	else if (!Protocol->EncodeImage(image->data.data(), image->data.size(), image->metadata, encoded.data, encoded.keyframe))
+	{
+		return true;
+	}
+	encodedqueue.Push(std::move(encoded));
+	fragmenter.Wake();
+	return true;
+}
+
+bool SendPipeline::FragmentStep()
+{
+	if (framequeue.IsFull())
+	{
+		return false;
+	}
+	auto image = encodedqueue.Pop();
+	if (!image.has_value())
+	{
+		return false;
+	}
+	encoder.Wake();
+	auto frame = Protocol->BuildFrame(std::move(image->data), image->metadata);
+	if (!frame)
+	{
+		return true;
+	}
+	frame->keyframe = image->keyframe;
+	framequeue.Push(std::move(frame));
+	WakeSender();
+	return true;
+}
+
+bool SendPipeline::SendStep()
+{
+	auto frame = framequeue.Pop();
+	if (!frame.has_value())
+	{
+		//still answer handshakes and NACKs and drain the client queues when idle
+		bool queued;
+		{
+			lock_guard lock(Protocol->sendmutex);
+			Protocol->ReceiveRequests();
+			queued = Protocol->HasQueuedFragments();
+		}
+		if (!attached)
+		{
+			return false;
+		}
+		//sleep until a frame or a request comes, only retry soon if the transport was full
+		//transports that report Writable end that wait early
+		loop.Poll(queued ? 1 : -1);
+		return true;
+	}
+	fragmenter.Wake();
+	Protocol->QueueFrame(frame.value());
+	return true;
+}
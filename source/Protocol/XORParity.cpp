@@ -0,0 +1,101 @@
+#include <Protocol/XORParity.hpp>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define XORPARITY_X86 1
+#else
+#define XORPARITY_X86 0
+#endif
+
+using namespace std;
+
+namespace
+{
+	void AccumulateScalar(uint8_t* parity, const uint8_t* data, size_t length)
+	{
+		size_t i = 0;
+		for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t))
+		{
+			uint64_t a, b;
+			__builtin_memcpy(&a, parity + i, sizeof(a));
+			__builtin_memcpy(&b, data + i, sizeof(b));
+			a ^= b;
+			__builtin_memcpy(parity + i, &a, sizeof(a));
+		}
+		for (; i < length; i++)
+		{
+			parity[i] ^= data[i];
+		}
+	}
+
+#if XORPARITY_X86
+	__attribute__((target("sse2")))
+	void AccumulateSSE2(uint8_t* parity, const uint8_t* data, size_t length)
+	{
+		size_t i = 0;
+		for (; i + 16 <= length; i += 16)
+		{
+			__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(parity + i));
+			__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(parity + i), _mm_xor_si128(a, b));
+		}
+		AccumulateScalar(parity + i, data + i, length - i);
+	}
+
+	__attribute__((target("avx2")))
+	void AccumulateAVX2(uint8_t* parity, const uint8_t* data, size_t length)
+	{
+		size_t i = 0;
+		for (; i + 64 <= length; i += 64)
+		{
+			__m256i a0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(parity + i));
+			__m256i a1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(parity + i + 32));
+			__m256i b0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+			__m256i b1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + 32));
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(parity + i), _mm256_xor_si256(a0, b0));
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(parity + i + 32), _mm256_xor_si256(a1, b1));
+		}
+		AccumulateSSE2(parity + i, data + i, length - i);
+	}
+#endif
+
+	typedef void (*AccumulateFunction)(uint8_t*, const uint8_t*, size_t);
+
+	struct Implementation
+	{
+		AccumulateFunction function;
+		const char* name;
+	};
+
+	Implementation Select()
+	{
+#if XORPARITY_X86
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+		{
+			return {AccumulateAVX2, "AVX2"};
+		}
+		if (__builtin_cpu_supports("sse2"))
+		{
+			return {AccumulateSSE2, "SSE2"};
+		}
+#endif
+		return {AccumulateScalar, "Scalar"};
+	}
+
+	const Implementation& GetSelected()
+	{
+		static const Implementation selected = Select();
+		return selected;
+	}
+}
+
+void XORParity::Accumulate(uint8_t* parity, const uint8_t* data, size_t length)
+{
+	GetSelected().function(parity, data, length);
+}
+
+const char* XORParity::GetImplementation()
+{
+	return GetSelected().name;
+}
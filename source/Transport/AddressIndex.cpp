@@ -0,0 +1,118 @@
+#include "Transport/AddressIndex.hpp"
+#include <Transport/ConnectionToken.hpp>
+
+using namespace std;
+
+AddressIndex::AddressIndex(size_t initialCapacity)
+	:count(0)
+{
+	size_t capacity = 8;
+	while (capacity < initialCapacity)
+	{
+		capacity *= 2;
+	}
+	Rehash(capacity);
+}
+
+uint64_t AddressIndex::MakeKey(const sockaddr_in &address)
+{
+	//only the address and the port identify a peer, sin_zero may hold anything
+	return (uint64_t(address.sin_addr.s_addr) << 16) | address.sin_port;
+}
+
+size_t AddressIndex::Home(uint64_t key) const
+{
+	//fibonacci hashing, keep the top bits
+	return (key * 0x9E3779B97F4A7C15ull) >> shift;
+}
+
+size_t AddressIndex::Probe(uint64_t key) const
+{
+	size_t mask = slots.size() - 1;
+	size_t index = Home(key);
+	while (slots[index].token && slots[index].key != key)
+	{
+		index = (index + 1) & mask;
+	}
+	return index;
+}
+
+void AddressIndex::Rehash(size_t capacity)
+{
+	vector<Slot> old = std::move(slots);
+	slots = vector<Slot>(capacity);
+	shift = 64;
+	for (size_t i = capacity; i > 1; i /= 2)
+	{
+		shift--;
+	}
+	for (auto &slot : old)
+	{
+		if (slot.token)
+		{
+			slots[Probe(slot.key)] = std::move(slot);
+		}
+	}
+}
+
+std::shared_ptr<ConnectionToken> AddressIndex::Find(const sockaddr_in &address) const
+{
+	return slots[Probe(MakeKey(address))].token;
+}
+
+void AddressIndex::Insert(const sockaddr_in &address, std::shared_ptr<ConnectionToken> token)
+{
+	if (!token)
+	{
+		Erase(address);
+		return;
+	}
+	//keep the load factor under 1/2 so probe chains stay short
+	if ((count + 1) * 2 > slots.size())
+	{
+		Rehash(slots.size() * 2);
+	}
+	uint64_t key = MakeKey(address);
+	Slot &slot = slots[Probe(key)];
+	if (!slot.token)
+	{
+		count++;
+	}
+	slot.key = key;
+	slot.token = token;
+}
+
+void AddressIndex::Erase(const sockaddr_in &address)
+{
+	size_t mask = slots.size() - 1;
+	size_t hole = Probe(MakeKey(address));
+	if (!slots[hole].token)
+	{
+		return;
+	}
+	slots[hole].token.reset();
+	count--;
+	//backward shift deletion : pull back entries whose probe chain crosses the hole
+	size_t index = (hole + 1) & mask;
+	while (slots[index].token)
+	{
+		size_t home = Home(slots[index].key);
+		bool movable = hole <= index ? (home <= hole || home > index) : (home <= hole && home > index);
+		if (movable)
+		{
+			slots[hole] = std::move(slots[index]);
+			slots[index].token.reset();
+			hole = index;
+		}
+		index = (index + 1) & mask;
+	}
+}
+
+void AddressIndex::Clear()
+{
+	for (auto &slot : slots)
+	{
+		slot.token.reset();
+	}
+	count = 0;
+}
@@ -0,0 +1,55 @@
+#include "Transport/BufferLease.hpp"
+
+#include <utility>
+
+using namespace std;
+
+BufferLease::BufferLease()
+	:LeaseOwner(nullptr), Handle(0), Data(nullptr), Size(0)
+{
+}
+
+BufferLease::BufferLease(std::shared_ptr<Owner> InOwner, uint64_t InHandle, const uint8_t* InData, size_t InSize)
+	:LeaseOwner(InOwner), Handle(InHandle), Data(InData), Size(InSize)
+{
+}
+
+BufferLease::~BufferLease()
+{
+	Release();
+}
+
+BufferLease::BufferLease(BufferLease &&other)
+	:LeaseOwner(std::move(other.LeaseOwner)), Handle(other.Handle), Data(other.Data), Size(other.Size)
+{
+	other.LeaseOwner.reset();
+	other.Data = nullptr;
+	other.Size = 0;
+}
+
+BufferLease& BufferLease::operator=(BufferLease &&other)
+{
+	if (this != &other)
+	{
+		Release();
+		LeaseOwner = std::move(other.LeaseOwner);
+		Handle = other.Handle;
+		Data = other.Data;
+		Size = other.Size;
+		other.LeaseOwner.reset();
+		other.Data = nullptr;
+		other.Size = 0;
+	}
+	return *this;
+}
+
+void BufferLease::Release()
+{
+	if (LeaseOwner)
+	{
+		LeaseOwner->ReleaseLease(Handle);
+		LeaseOwner.reset();
+	}
+	Data = nullptr;
+	Size = 0;
+}
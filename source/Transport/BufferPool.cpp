@@ -0,0 +1,57 @@
+#include "Transport/BufferPool.hpp"
+
+#include <cassert>
+
+using namespace std;
+
+BufferPool::BufferPool(size_t InBufferSize, int InMaxBuffers)
+	:BufferSize(InBufferSize), buffers(InMaxBuffers), allocated(0), inuse(0)
+{
+	freelist.reserve(InMaxBuffers);
+}
+
+int BufferPool::Acquire()
+{
+	unique_lock lock(poolmutex);
+	int index;
+	if (freelist.size() > 0)
+	{
+		index = freelist.back();
+		freelist.pop_back();
+	}
+	else if (allocated < (int)buffers.size())
+	{
+		index = allocated++;
+		buffers[index] = make_unique<uint8_t[]>(BufferSize);
+	}
+	else
+	{
+		return -1;
+	}
+	inuse++;
+	return index;
+}
+
+void BufferPool::Release(int index)
+{
+	assert(index >= 0 && index < allocated);
+	unique_lock lock(poolmutex);
+	freelist.push_back(index);
+	inuse--;
+}
+
+BufferLease BufferPool::Lease(int index, size_t length)
+{
+	return BufferLease(shared_from_this(), index, GetBuffer(index), length);
+}
+
+void BufferPool::ReleaseLease(uint64_t handle)
+{
+	Release(handle);
+}
+
+int BufferPool::GetInUse()
+{
+	unique_lock lock(poolmutex);
+	return inuse;
+}
@@ -25,6 +25,16 @@ std::optional<int> ConnectionToken::Receive(void* buffer, int maxlength)
 	return Parent->Receive(buffer, maxlength, shared_from_this());
 }
 
+std::optional<BufferLease> ConnectionToken::ReceiveView()
+{
+	if (!Parent || !connected)
+	{
+		return nullopt;
+	}
+	
+	return Parent->ReceiveView(shared_from_this());
+}
+
 bool ConnectionToken::Send(const void* buffer, int length)
 {
 	if (!Parent || !connected)
@@ -34,6 +44,24 @@ bool ConnectionToken::Send(const void* buffer, int length)
 	return Parent->Send(buffer, length, shared_from_this());
 }
 
+bool ConnectionToken::Send(const iovec* iov, int iovcnt)
+{
+	if (!Parent || !connected)
+	{
+		return false;
+	} 
+	return Parent->Send(iov, iovcnt, shared_from_this());
+}
+
+bool ConnectionToken::Send(const iovec* iov, int iovcnt, const GenericTransport::MessageOptions &options)
+{
+	if (!Parent || !connected)
+	{
+		return false;
+	} 
+	return Parent->Send(iov, iovcnt, options, shared_from_this());
+}
+
 void ConnectionToken::Disconnect()
 {
 	if (connected)
@@ -0,0 +1,150 @@
+#include "Transport/EventLoop.hpp"
+#include <Transport/thread-rename.hpp>
+
+#include <iostream>
+#include <vector>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <string.h>
+
+using namespace std;
+
+EventLoop::EventLoop()
+	:Task()
+{
+	epollfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epollfd == -1)
+	{
+		cerr << "EventLoop failed to create epoll : " << strerror(errno) << endl;
+	}
+	wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wakefd == -1)
+	{
+		cerr << "EventLoop failed to create eventfd : " << strerror(errno) << endl;
+	}
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.fd = wakefd;
+	epoll_ctl(epollfd, EPOLL_CTL_ADD, wakefd, &event);
+}
+
+EventLoop::~EventLoop()
+{
+	//the thread has to be out of epoll_wait before the fds go away
+	Kill();
+	Wake();
+	if (ThreadHandle)
+	{
+		ThreadHandle->join();
+		ThreadHandle.reset();
+	}
+	if (wakefd != -1)
+	{
+		close(wakefd);
+	}
+	if (epollfd != -1)
+	{
+		close(epollfd);
+	}
+}
+
+bool EventLoop::Add(int fd, uint32_t events, Callback callback)
+{
+	{
+		unique_lock lock(callbackmutex);
+		callbacks[fd] = make_shared<Callback>(std::move(callback));
+	}
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = events | EPOLLET;
+	event.data.fd = fd;
+	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event) == -1)
+	{
+		cerr << "EventLoop failed to watch fd " << fd << " : " << strerror(errno) << endl;
+		unique_lock lock(callbackmutex);
+		callbacks.erase(fd);
+		return false;
+	}
+	return true;
+}
+
+bool EventLoop::Modify(int fd, uint32_t events)
+{
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = events | EPOLLET;
+	event.data.fd = fd;
+	if (epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event) == -1)
+	{
+		cerr << "EventLoop failed to modify fd " << fd << " : " << strerror(errno) << endl;
+		return false;
+	}
+	return true;
+}
+
+void EventLoop::Remove(int fd)
+{
+	epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, nullptr);
+	unique_lock lock(callbackmutex);
+	callbacks.erase(fd);
+}
+
+int EventLoop::Poll(int timeoutms)
+{
+	struct epoll_event events[MaxEventsPerPoll];
+	int n = epoll_wait(epollfd, events, MaxEventsPerPoll, timeoutms);
+	if (n == -1)
+	{
+		if (errno != EINTR)
+		{
+			cerr << "EventLoop epoll_wait failed : " << strerror(errno) << endl;
+		}
+		return 0;
+	}
+	int dispatched = 0;
+	for (int i = 0; i < n; i++)
+	{
+		int fd = events[i].data.fd;
+		if (fd == wakefd)
+		{
+			uint64_t count;
+			while (read(wakefd, &count, sizeof(count)) > 0)
+			{}
+			continue;
+		}
+		//keep the callback alive even if it removes itself
+		shared_ptr<Callback> callback;
+		{
+			unique_lock lock(callbackmutex);
+			auto found = callbacks.find(fd);
+			if (found == callbacks.end())
+			{
+				continue;
+			}
+			callback = found->second;
+		}
+		(*callback)(events[i].events);
+		dispatched++;
+	}
+	return dispatched;
+}
+
+void EventLoop::Wake()
+{
+	uint64_t one = 1;
+	if (write(wakefd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+	{
+		cerr << "EventLoop failed to wake : " << strerror(errno) << endl;
+	}
+}
+
+void EventLoop::ThreadEntryPoint()
+{
+	SetThreadName("EventLoop");
+	while (!killed)
+	{
+		Poll(-1);
+	}
+}
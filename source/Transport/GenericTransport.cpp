@@ -1,9 +1,13 @@
 #include "Transport/GenericTransport.hpp"
 #include <Transport/ConnectionToken.hpp>
+#include <Transport/BufferPool.hpp>
 
 #include <iostream>
 #include <sstream>
 #include <iomanip>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
 
 using namespace std;
 
@@ -61,6 +65,45 @@ vector<shared_ptr<ConnectionToken>> GenericTransport::GetClients() const
 	return {};
 }
 
+pair<int, shared_ptr<ConnectionToken>> GenericTransport::ReceiveAny(void *buffer, int maxlength)
+{
+	for (auto &token : GetClients())
+	{
+		auto received = token->Receive(buffer, maxlength);
+		if (received.has_value() && received.value() > 0)
+		{
+			return {received.value(), token};
+		}
+	}
+	return {0, nullptr};
+}
+
+int GenericTransport::SendBatch(const Datagram* datagrams, int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		const Datagram &datagram = datagrams[i];
+		if (!datagram.token)
+		{
+			return i;
+		}
+		iovec single = {datagram.buffer, (size_t)datagram.length};
+		bool sent = datagram.iov != nullptr ? 
+			datagram.token->Send(datagram.iov, datagram.iovcnt, datagram.options) : 
+			datagram.token->Send(&single, 1, datagram.options);
+		if (!sent)
+		{
+			return i;
+		}
+	}
+	return count;
+}
+
+int GenericTransport::TrySendBatch(const Datagram* datagrams, int count)
+{
+	return SendBatch(datagrams, count);
+}
+
 bool GenericTransport::CheckToken(const std::shared_ptr<ConnectionToken> &token)
 {
 	if (!token)
@@ -78,6 +121,62 @@ bool GenericTransport::CheckToken(const std::shared_ptr<ConnectionToken> &token)
 	return true;
 }
 
+bool GenericTransport::AttachEventLoop(EventLoop* loop, EventCallback callback)
+{
+	(void)loop;
+	(void)callback;
+	cerr << "Called AttachEventLoop on a transport that doesn't support it" << endl;
+	return false;
+}
+
+void GenericTransport::DetachEventLoop()
+{
+}
+
+bool GenericTransport::SetBufferSizes(int sendsize, int receivesize)
+{
+	(void)sendsize;
+	(void)receivesize;
+	cerr << "Called SetBufferSizes on a transport that doesn't support it" << endl;
+	return false;
+}
+
+bool GenericTransport::SetSocketBufferSizes(int fd, int sendsize, int receivesize)
+{
+	struct BufferOption
+	{
+		int size;
+		int option;
+		int forceoption;
+		const char* name;
+	};
+	BufferOption options[] = {{sendsize, SO_SNDBUF, SO_SNDBUFFORCE, "send"}, {receivesize, SO_RCVBUF, SO_RCVBUFFORCE, "receive"}};
+	bool ok = true;
+	for (auto &option : options)
+	{
+		if (option.size <= 0)
+		{
+			continue;
+		}
+		if (setsockopt(fd, SOL_SOCKET, option.forceoption, &option.size, sizeof(option.size)) != 0 
+			&& setsockopt(fd, SOL_SOCKET, option.option, &option.size, sizeof(option.size)) != 0)
+		{
+			cerr << "Failed to set socket " << option.name << " buffer size : " << strerror(errno) << endl;
+			ok = false;
+			continue;
+		}
+		int actual = 0;
+		socklen_t length = sizeof(actual);
+		getsockopt(fd, SOL_SOCKET, option.option, &actual, &length);
+		//the kernel doubles the value to account for its bookkeeping
+		if (actual / 2 < option.size)
+		{
+			cerr << "Socket " << option.name << " buffer capped at " << actual / 2 << " bytes instead of " << option.size << endl;
+		}
+	}
+	return ok;
+}
+
 optional<int> GenericTransport::Receive(void *buffer, int maxlength, std::shared_ptr<ConnectionToken> token)
 {
 	(void)buffer;
@@ -87,6 +186,30 @@ optional<int> GenericTransport::Receive(void *buffer, int maxlength, std::shared
 	return nullopt;
 }
 
+optional<BufferLease> GenericTransport::ReceiveView(std::shared_ptr<ConnectionToken> token)
+{
+	call_once(ViewPoolFlag, [this]()
+	{
+		ViewPool = make_shared<BufferPool>(GetMaxMessageSize(), 64);
+	});
+	int index = ViewPool->Acquire();
+	if (index == -1)
+	{
+		cerr << "Out of receive buffers, release some leases !" << endl;
+		return BufferLease();
+	}
+	auto received = Receive(ViewPool->GetBuffer(index), ViewPool->GetBufferSize(), token);
+	if (!received.has_value() || received.value() <= 0)
+	{
+		ViewPool->Release(index);
+		if (!received.has_value())
+		{
+			return nullopt;
+		}
+		return BufferLease();
+	}
+	return ViewPool->Lease(index, received.value());
+}
 
 bool GenericTransport::Send(const void* buffer, int length, std::shared_ptr<ConnectionToken> token)
 {
@@ -97,11 +220,33 @@ bool GenericTransport::Send(const void* buffer, int length, std::shared_ptr<Conn
 	return false;
 }
 
+bool GenericTransport::Send(const iovec* iov, int iovcnt, std::shared_ptr<ConnectionToken> token)
+{
+	std::vector<uint8_t> gathered;
+	for (int i = 0; i < iovcnt; i++)
+	{
+		const uint8_t* base = reinterpret_cast<const uint8_t*>(iov[i].iov_base);
+		gathered.insert(gathered.end(), base, base + iov[i].iov_len);
+	}
+	return Send(gathered.data(), gathered.size(), token);
+}
+
+bool GenericTransport::Send(const iovec* iov, int iovcnt, const MessageOptions &options, std::shared_ptr<ConnectionToken> token)
+{
+	(void) options;
+	return Send(iov, iovcnt, token);
+}
+
 void GenericTransport::DisconnectClient(std::shared_ptr<ConnectionToken> token)
 {
 	(void) token;
 }
 
+size_t GenericTransport::GetMaxMessageSize() const
+{
+	return UINT16_MAX;
+}
+
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netdb.h>
@@ -0,0 +1,403 @@
+#include "Transport/IOUring.hpp"
+
+#include <iostream>
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <string.h>
+
+using namespace std;
+
+#define CANCEL_USERDATA UINT64_MAX
+
+static int io_uring_setup(unsigned entries, io_uring_params *params)
+{
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned tosubmit, unsigned mincomplete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, tosubmit, mincomplete, flags, nullptr, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nrargs)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nrargs);
+}
+
+IOUring::IOUring()
+	:ringfd(-1), sqring(MAP_FAILED), sqringsize(0), cqring(MAP_FAILED), cqringsize(0),
+	sqes((io_uring_sqe*)MAP_FAILED), sqessize(0), sqentries(0), pending(0),
+	bufring((io_uring_buf*)MAP_FAILED), bufringsize(0), BufferCount(0), BufferSize(0)
+{
+}
+
+IOUring::~IOUring()
+{
+	if (bufring != MAP_FAILED)
+	{
+		munmap(bufring, bufringsize);
+	}
+	if (sqes != MAP_FAILED)
+	{
+		munmap(sqes, sqessize);
+	}
+	if (cqring != MAP_FAILED && cqring != sqring)
+	{
+		munmap(cqring, cqringsize);
+	}
+	if (sqring != MAP_FAILED)
+	{
+		munmap(sqring, sqringsize);
+	}
+	if (ringfd != -1)
+	{
+		close(ringfd);
+	}
+}
+
+std::unique_ptr<IOUring> IOUring::Create(unsigned entries, int bufferCount, int bufferSize)
+{
+	unique_ptr<IOUring> ring(new IOUring());
+	if (!ring->Setup(entries, bufferCount, bufferSize))
+	{
+		return nullptr;
+	}
+	if (!ring->Probe())
+	{
+		cerr << "io_uring multishot receive unsupported, falling back to sockets" << endl;
+		return nullptr;
+	}
+	return ring;
+}
+
+bool IOUring::Setup(unsigned entries, int bufferCount, int bufferSize)
+{
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	ringfd = io_uring_setup(entries, &params);
+	if (ringfd == -1)
+	{
+		cerr << "io_uring unavailable : " << strerror(errno) << endl;
+		return false;
+	}
+	sqentries = params.sq_entries;
+
+	sqringsize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cqringsize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	bool singlemmap = params.features & IORING_FEAT_SINGLE_MMAP;
+	if (singlemmap)
+	{
+		sqringsize = cqringsize = max(sqringsize, cqringsize);
+	}
+	sqring = mmap(nullptr, sqringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQ_RING);
+	if (sqring == MAP_FAILED)
+	{
+		cerr << "io_uring failed to map submission ring : " << strerror(errno) << endl;
+		return false;
+	}
+	if (singlemmap)
+	{
+		cqring = sqring;
+	}
+	else
+	{
+		cqring = mmap(nullptr, cqringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_CQ_RING);
+		if (cqring == MAP_FAILED)
+		{
+			cerr << "io_uring failed to map completion ring : " << strerror(errno) << endl;
+			return false;
+		}
+	}
+	sqessize = params.sq_entries * sizeof(io_uring_sqe);
+	sqes = (io_uring_sqe*)mmap(nullptr, sqessize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+	{
+		cerr << "io_uring failed to map sqes : " << strerror(errno) << endl;
+		return false;
+	}
+
+	uint8_t* sq = (uint8_t*)sqring;
+	sqhead = (unsigned*)(sq + params.sq_off.head);
+	sqtail = (unsigned*)(sq + params.sq_off.tail);
+	sqmask = (unsigned*)(sq + params.sq_off.ring_mask);
+	sqarray = (unsigned*)(sq + params.sq_off.array);
+	uint8_t* cq = (uint8_t*)cqring;
+	cqhead = (unsigned*)(cq + params.cq_off.head);
+	cqtail = (unsigned*)(cq + params.cq_off.tail);
+	cqmask = (unsigned*)(cq + params.cq_off.ring_mask);
+	cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+
+	//provided buffer ring, shared with the kernel
+	BufferCount = bufferCount;
+	BufferSize = bufferSize;
+	bufringsize = BufferCount * sizeof(io_uring_buf);
+	bufring = (io_uring_buf*)mmap(nullptr, bufringsize, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (bufring == MAP_FAILED)
+	{
+		cerr << "io_uring failed to allocate buffer ring : " << strerror(errno) << endl;
+		return false;
+	}
+	//fault the pages in before the kernel pins them
+	memset(bufring, 0, bufringsize);
+	io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)bufring;
+	reg.ring_entries = BufferCount;
+	reg.bgid = BufferGroup;
+	if (io_uring_register(ringfd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+	{
+		cerr << "io_uring provided buffer rings unsupported : " << strerror(errno) << endl;
+		return false;
+	}
+	bufstorage.resize((size_t)BufferCount * BufferSize);
+	bufring[0].resv = 0;
+	for (int i = 0; i < BufferCount; i++)
+	{
+		RecycleBuffer(i);
+	}
+	return true;
+}
+
+bool IOUring::Probe()
+{
+	int pair[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == -1)
+	{
+		return false;
+	}
+	const uint64_t probedata = CANCEL_USERDATA - 1;
+	bool supported = false;
+	if (RecvMultishot(pair[0], probedata) && Submit() >= 0)
+	{
+		uint8_t byte = 0;
+		if (write(pair[1], &byte, 1) == 1 && io_uring_enter(ringfd, 0, 1, IORING_ENTER_GETEVENTS) >= 0)
+		{
+			Reap([&supported, probedata](const Completion &completion)
+			{
+				if (completion.userdata == probedata && completion.result == 1 && completion.buffer != nullptr)
+				{
+					supported = true;
+				}
+			});
+		}
+		Cancel(probedata);
+		Submit();
+	}
+	close(pair[0]);
+	close(pair[1]);
+	return supported;
+}
+
+io_uring_sqe* IOUring::GetSQE()
+{
+	unsigned tail = *sqtail;
+	unsigned head = __atomic_load_n(sqhead, __ATOMIC_ACQUIRE);
+	if (tail - head >= sqentries)
+	{
+		//full, flush what's queued
+		io_uring_enter(ringfd, pending, 0, 0);
+		pending = 0;
+		head = __atomic_load_n(sqhead, __ATOMIC_ACQUIRE);
+		if (tail - head >= sqentries)
+		{
+			cerr << "io_uring submission queue full" << endl;
+			return nullptr;
+		}
+	}
+	unsigned index = tail & *sqmask;
+	io_uring_sqe* sqe = &sqes[index];
+	memset(sqe, 0, sizeof(io_uring_sqe));
+	sqarray[index] = index;
+	__atomic_store_n(sqtail, tail + 1, __ATOMIC_RELEASE);
+	pending++;
+	return sqe;
+}
+
+void IOUring::RecycleBuffer(int bufferid)
+{
+	//the ring tail is the resv field of the first entry
+	unsigned short tail = bufring[0].resv;
+	io_uring_buf &buf = bufring[tail & (BufferCount - 1)];
+	buf.addr = (uint64_t)(bufstorage.data() + (size_t)bufferid * BufferSize);
+	buf.len = BufferSize;
+	buf.bid = bufferid;
+	__atomic_store_n(&bufring[0].resv, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+bool IOUring::RecvMultishot(int fd, uint64_t userdata)
+{
+	unique_lock lock(ringmutex);
+	io_uring_sqe* sqe = GetSQE();
+	if (!sqe)
+	{
+		return false;
+	}
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = BufferGroup;
+	sqe->user_data = userdata;
+	return true;
+}
+
+bool IOUring::RecvMsgMultishot(int fd, msghdr* message, uint64_t userdata)
+{
+	unique_lock lock(ringmutex);
+	io_uring_sqe* sqe = GetSQE();
+	if (!sqe)
+	{
+		return false;
+	}
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)message;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = BufferGroup;
+	sqe->user_data = userdata;
+	return true;
+}
+
+bool IOUring::AcceptMultishot(int fd, uint64_t userdata)
+{
+	unique_lock lock(ringmutex);
+	io_uring_sqe* sqe = GetSQE();
+	if (!sqe)
+	{
+		return false;
+	}
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->user_data = userdata;
+	return true;
+}
+
+bool IOUring::PollAdd(int fd, uint32_t events, uint64_t userdata)
+{
+	unique_lock lock(ringmutex);
+	io_uring_sqe* sqe = GetSQE();
+	if (!sqe)
+	{
+		return false;
+	}
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = events;
+	sqe->user_data = userdata;
+	return true;
+}
+
+bool IOUring::Cancel(uint64_t userdata)
+{
+	unique_lock lock(ringmutex);
+	io_uring_sqe* sqe = GetSQE();
+	if (!sqe)
+	{
+		return false;
+	}
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = userdata;
+	sqe->user_data = CANCEL_USERDATA;
+	return true;
+}
+
+void IOUring::ReleaseBuffer(int bufferid)
+{
+	unique_lock lock(ringmutex);
+	RecycleBuffer(bufferid);
+	held--;
+}
+
+BufferLease IOUring::Lend(const std::shared_ptr<IOUring> &self, int bufferid, size_t offset, size_t length)
+{
+	return BufferLease(self, bufferid, GetBuffer(bufferid) + offset, length);
+}
+
+void IOUring::ReleaseLease(uint64_t handle)
+{
+	ReleaseBuffer(handle);
+}
+
+int IOUring::Submit(unsigned waitfor)
+{
+	unique_lock lock(ringmutex);
+	int submitted = io_uring_enter(ringfd, pending, waitfor, waitfor > 0 ? IORING_ENTER_GETEVENTS : 0);
+	if (submitted == -1)
+	{
+		if (errno != EINTR)
+		{
+			cerr << "io_uring submit failed : " << strerror(errno) << endl;
+		}
+		return -1;
+	}
+	pending -= min<unsigned>(submitted, pending);
+	return submitted;
+}
+
+int IOUring::Reap(const CompletionCallback &callback)
+{
+	//the ring is released while the callbacks run, another reaper must not handle later completions meanwhile
+	unique_lock reaplock(reapmutex);
+	int reaped = 0;
+	while (1)
+	{
+		//copy completions out so the callback runs without holding the ring
+		io_uring_cqe batch[64];
+		int count = 0;
+		{
+			unique_lock lock(ringmutex);
+			unsigned head = *cqhead;
+			unsigned tail = __atomic_load_n(cqtail, __ATOMIC_ACQUIRE);
+			while (head != tail && count < 64)
+			{
+				batch[count++] = cqes[head & *cqmask];
+				head++;
+			}
+			__atomic_store_n(cqhead, head, __ATOMIC_RELEASE);
+		}
+		if (count == 0)
+		{
+			break;
+		}
+		for (int i = 0; i < count; i++)
+		{
+			const io_uring_cqe &cqe = batch[i];
+			int bufferid = -1;
+			Completion completion;
+			completion.userdata = cqe.user_data;
+			completion.result = cqe.res;
+			completion.more = cqe.flags & IORING_CQE_F_MORE;
+			completion.buffer = nullptr;
+			completion.keep = false;
+			if (cqe.flags & IORING_CQE_F_BUFFER)
+			{
+				bufferid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+				completion.buffer = bufstorage.data() + (size_t)bufferid * BufferSize;
+			}
+			completion.bufferid = bufferid;
+			if (cqe.user_data != CANCEL_USERDATA)
+			{
+				callback(completion);
+			}
+			if (bufferid != -1 && completion.keep)
+			{
+				held++;
+			}
+			else if (bufferid != -1)
+			{
+				unique_lock lock(ringmutex);
+				RecycleBuffer(bufferid);
+			}
+		}
+		reaped += count;
+	}
+	return reaped;
+}
@@ -0,0 +1,44 @@
+#include "Transport/PipelineStage.hpp"
+#include <Transport/thread-rename.hpp>
+
+using namespace std;
+
+PipelineStage::PipelineStage(std::string InName, Step InBody, std::chrono::microseconds InIdleWait)
+	:Task(), Name(InName), Body(InBody), IdleWait(InIdleWait)
+{
+}
+
+PipelineStage::~PipelineStage()
+{
+	Kill();
+	Wake();
+	if (ThreadHandle)
+	{
+		ThreadHandle->join();
+		ThreadHandle.reset();
+	}
+}
+
+void PipelineStage::Wake()
+{
+	{
+		unique_lock lock(wakemutex);
+		woken = true;
+	}
+	wakecondition.notify_one();
+}
+
+void PipelineStage::ThreadEntryPoint()
+{
+	SetThreadName(Name.c_str());
+	while (!killed)
+	{
+		if (Body())
+		{
+			continue;
+		}
+		unique_lock lock(wakemutex);
+		wakecondition.wait_for(lock, IdleWait, [this]{return woken || killed;});
+		woken = false;
+	}
+}
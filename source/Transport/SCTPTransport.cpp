@@ -1,5 +1,6 @@
 #include "Transport/SCTPTransport.hpp"
 #include <Transport/ConnectionToken.hpp>
+#include <Transport/EventLoop.hpp>
 
 #include <iostream>
 #include <filesystem>
@@ -10,19 +11,33 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <linux/sctp.h>
+#include <climits>
 
 #include <mutex>
 #include <Transport/thread-rename.hpp>
 
 using namespace std;
 
-SCTPTransport::SCTPTransport(bool inServer, string inIP, int inPort, string inInterface)
+SCTPTransport::SCTPTransport(bool inServer, string inIP, int inPort, string inInterface, int inStreams)
 	: GenericTransport()
 {	
 	Server = inServer;
 	IP = inIP;
 	Port = inPort;
+	Streams = max(1, min(inStreams, (int)UINT16_MAX));
+	scratch.resize(ReceiveChunkSize);
+	SendBufferSize = DefaultSocketBufferSize;
+	SendBufferLimit = INT_MAX;
 	Interface = inInterface;
+	LocalAddresses = ParseAddresses(Interface, Server ? Port : 0);
+	if (!Server)
+	{
+		ServerAddresses = ParseAddresses(IP, Port);
+	}
+	HeartbeatInterval = DefaultHeartbeatInterval;
+	PathMaxRetransmits = DefaultPathMaxRetransmits;
 	sockfd = -1;
 	Connected = false;
 	CreateSocket();
@@ -34,6 +49,7 @@ SCTPTransport::SCTPTransport(bool inServer, string inIP, int inPort, string inIn
 SCTPTransport::~SCTPTransport()
 {
 	cout << "Destroying SCTP transport " << IP << ":" << Port << " @ " << Interface <<endl;
+	DetachEventLoop();
 	if (sockfd != -1)
 	{
 		shutdown(sockfd, SHUT_RDWR);
@@ -53,11 +69,6 @@ void SCTPTransport::CreateSocket()
 	{
 		cerr << "SCTP Failed to create socket, port " << Port << endl;
 	}
-	
-	/*if(setsockopt(sockfd, SOL_SOCKET, SO_BINDTODEVICE, Interface.c_str(), Interface.size()))
-	{
-		cerr << "SCTP Failed to bind to interface : " << strerror(errno) << endl;
-	}*/
 
 	const int enable = 1;
 	if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0)
@@ -68,27 +79,75 @@ void SCTPTransport::CreateSocket()
 	{
 		cerr << "setsockopt(SO_REUSEPORT) failed" << endl;
 	}
+	//the stream count is settled when the association is set up, the smallest of both sides wins
+	sctp_initmsg initmsg;
+	memset(&initmsg, 0, sizeof(initmsg));
+	initmsg.sinit_num_ostreams = Streams;
+	initmsg.sinit_max_instreams = Streams;
+	if (setsockopt(sockfd, IPPROTO_SCTP, SCTP_INITMSG, &initmsg, sizeof(initmsg)) < 0)
+	{
+		cerr << "SCTP Failed to set the stream count : " << strerror(errno) << endl;
+	}
+	//partial reliability, for messages sent with a lifetime
+	sctp_assoc_value partial;
+	memset(&partial, 0, sizeof(partial));
+	partial.assoc_value = 1;
+	if (setsockopt(sockfd, IPPROTO_SCTP, SCTP_PR_SUPPORTED, &partial, sizeof(partial)) < 0)
+	{
+		cerr << "SCTP Failed to enable partial reliability : " << strerror(errno) << endl;
+	}
+	//have the stream of each message given with it
+	sctp_event_subscribe events;
+	memset(&events, 0, sizeof(events));
+	events.sctp_data_io_event = 1;
+	events.sctp_association_event = 1; //to forget associations that ended
+	if (setsockopt(sockfd, IPPROTO_SCTP, SCTP_EVENTS, &events, sizeof(events)) < 0)
+	{
+		cerr << "SCTP Failed to subscribe to data events : " << strerror(errno) << endl;
+	}
+	//chunks of different messages may be interleaved, so that a large message doesn't hold back the other streams
+	//I-DATA chunks let the sender interleave too, when both kernels support them
+	const int interleave = 2;
+	if (setsockopt(sockfd, IPPROTO_SCTP, SCTP_FRAGMENT_INTERLEAVE, &interleave, sizeof(interleave)) < 0)
+	{
+		cerr << "SCTP Failed to enable fragment interleaving : " << strerror(errno) << endl;
+	}
+	sctp_assoc_value idata;
+	memset(&idata, 0, sizeof(idata));
+	idata.assoc_id = SCTP_FUTURE_ASSOC;
+	idata.assoc_value = 1;
+	setsockopt(sockfd, IPPROTO_SCTP, SCTP_INTERLEAVING_SUPPORTED, &idata, sizeof(idata)); //optional, older kernels send DATA chunks
+	SetSocketBufferSizes(sockfd, SendBufferSize, DefaultSocketBufferSize);
+	UpdateSendBufferSize();
+	if (Loop && sockfd != -1)
+	{
+		WatchSocket();
+	}
 }
 
 bool SCTPTransport::Connect()
 {
-	struct sockaddr_in serverAddress;
-	memset(&serverAddress, 0, sizeof(serverAddress));
-	serverAddress.sin_family = AF_INET;
-	serverAddress.sin_port = htons(Port);
-
-	string ip = Server ? "0.0.0.0" : IP;
-
-	if (inet_pton(AF_INET, ip.c_str(), &serverAddress.sin_addr) <= 0) {
-		cerr << "SCTP ERROR : Invalid address/ Address not supported \n" << endl;
+	//multi-homing : bind all the local addresses asked for, the peer can reach us on any of them
+	if (LocalAddresses.size() > 0 && setsockopt(sockfd, IPPROTO_SCTP, SCTP_SOCKOPT_BINDX_ADD, 
+		LocalAddresses.data(), LocalAddresses.size() * sizeof(sockaddr_in)) == -1)
+	{
+		cerr << "SCTP Can't bind to " << Interface << ", " << strerror(errno) << endl;
 	}
 
 	if (Server)
 	{
-		//cout << "SCTP Binding socket..." << endl;
-		if (bind(sockfd, (struct sockaddr *)&serverAddress, sizeof(serverAddress)) == -1) 
+		if (LocalAddresses.size() == 0)
 		{
-			cerr << "SCTP Can't bind to IP/port, " << strerror(errno) << endl;
+			struct sockaddr_in serverAddress;
+			memset(&serverAddress, 0, sizeof(serverAddress));
+			serverAddress.sin_family = AF_INET;
+			serverAddress.sin_port = htons(Port);
+			serverAddress.sin_addr.s_addr = INADDR_ANY;
+			//cout << "SCTP Binding socket..." << endl;
+			if (bind(sockfd, (struct sockaddr *)&serverAddress, sizeof(serverAddress)) == -1) 
+			{
+				cerr << "SCTP Can't bind to IP/port, " << strerror(errno) << endl;
+			}
 		}
 		//cout << "SCTP Marking socket for listening" << endl;
 		if (listen(sockfd, SOMAXCONN) == -1)
@@ -100,23 +159,155 @@ bool SCTPTransport::Connect()
 	}
 	else
 	{
-		// communicates with listen
-		if(connect(sockfd, (struct sockaddr *)&serverAddress, sizeof(serverAddress)) == -1)
+		if (ServerAddresses.size() == 0)
+		{
+			cerr << "SCTP ERROR : Invalid address/ Address not supported \n" << endl;
+			return false;
+		}
+		// communicates with listen, over every address of the server
+		sctp_assoc_t association = setsockopt(sockfd, IPPROTO_SCTP, SCTP_SOCKOPT_CONNECTX, 
+			ServerAddresses.data(), ServerAddresses.size() * sizeof(sockaddr_in));
+		if(association == -1)
 		{
 			cerr << "Failed to connect to server" << endl;
 			return false;
 		}
 		cout << "SCTP connected to server" << endl;
 		Connected = true;
+		char ipbuf[INET_ADDRSTRLEN];
+		inet_ntop(AF_INET, &ServerAddresses[0].sin_addr, ipbuf, sizeof(ipbuf));
 		SCTPConnection connection;
-		connection.name = ip;
-		connection.address = serverAddress;
-		auto token = make_shared<ConnectionToken>(ip, this);
+		connection.name = ipbuf;
+		connection.address = ServerAddresses[0];
+		connection.association = association;
+		auto token = make_shared<ConnectionToken>(string(ipbuf), this);
+		unique_lock lock(listenmutex);
+		SetupAssociation(connection);
 		connections[token] = connection;
+		associations[association] = token;
 		return true;
 	}
 }
 
+std::vector<sockaddr_in> SCTPTransport::ParseAddresses(const std::string &list, int port)
+{
+	vector<sockaddr_in> addresses;
+	vector<NetworkInterface> interfaces;
+	stringstream stream(list);
+	string entry;
+	while (getline(stream, entry, ','))
+	{
+		entry.erase(0, entry.find_first_not_of(' '));
+		entry.erase(entry.find_last_not_of(' ') + 1);
+		if (entry.empty())
+		{
+			continue;
+		}
+		sockaddr_in address;
+		memset(&address, 0, sizeof(address));
+		address.sin_family = AF_INET;
+		address.sin_port = htons(port);
+		if (inet_pton(AF_INET, entry.c_str(), &address.sin_addr) == 1)
+		{
+			addresses.push_back(address);
+			continue;
+		}
+		if (interfaces.size() == 0)
+		{
+			interfaces = GetInterfaces();
+		}
+		bool found = false;
+		for (auto &ni : interfaces)
+		{
+			if (ni.name == entry && inet_pton(AF_INET, ni.address.c_str(), &address.sin_addr) == 1)
+			{
+				addresses.push_back(address);
+				found = true;
+			}
+		}
+		if (!found)
+		{
+			cerr << "SCTP Unknown address or interface " << entry << ", ignored" << endl;
+		}
+	}
+	return addresses;
+}
+
+void SCTPTransport::ApplyHeartbeat(sctp_assoc_t association)
+{
+	if (sockfd == -1)
+	{
+		return;
+	}
+	sctp_paddrparams params;
+	memset(&params, 0, sizeof(params));
+	params.spp_assoc_id = association; //no address : every path of the association
+	params.spp_hbinterval = HeartbeatInterval.count();
+	params.spp_pathmaxrxt = PathMaxRetransmits;
+	params.spp_flags = SPP_HB_ENABLE;
+	if (setsockopt(sockfd, IPPROTO_SCTP, SCTP_PEER_ADDR_PARAMS, &params, sizeof(params)) < 0)
+	{
+		cerr << "SCTP Failed to set the heartbeat : " << strerror(errno) << endl;
+	}
+	//the retransmission timeouts are left alone, they have to stay above the round trip and the delayed acknowledgements
+	//instead a path that missed one answer is potentially failed, and new data goes to another path right away
+	sctp_paddrthlds thresholds;
+	memset(&thresholds, 0, sizeof(thresholds));
+	thresholds.spt_assoc_id = association;
+	thresholds.spt_pathmaxrxt = PathMaxRetransmits;
+	thresholds.spt_pathpfthld = 0;
+	if (setsockopt(sockfd, IPPROTO_SCTP, SCTP_PEER_ADDR_THLDS, &thresholds, sizeof(thresholds)) < 0 && errno != ENOPROTOOPT)
+	{
+		cerr << "SCTP Failed to set the potentially failed threshold : " << strerror(errno) << endl;
+	}
+}
+
+bool SCTPTransport::SetHeartbeat(std::chrono::milliseconds interval, int pathmaxretransmits)
+{
+	if (interval.count() <= 0 || pathmaxretransmits <= 0)
+	{
+		return false;
+	}
+	unique_lock lock(listenmutex);
+	HeartbeatInterval = interval;
+	PathMaxRetransmits = pathmaxretransmits;
+	for (auto &connection : connections)
+	{
+		if (connection.second.multihomed)
+		{
+			ApplyHeartbeat(connection.second.association);
+		}
+	}
+	return true;
+}
+
+bool SCTPTransport::SetPrimaryPath(std::shared_ptr<ConnectionToken> token, std::string address)
+{
+	sctp_prim primary;
+	memset(&primary, 0, sizeof(primary));
+	{
+		shared_lock lock(listenmutex);
+		auto value = connections.find(token);
+		if (value == connections.end() || value->second.association == 0)
+		{
+			return false;
+		}
+		primary.ssp_assoc_id = value->second.association;
+		sockaddr_in path = value->second.address;
+		if (inet_pton(AF_INET, address.c_str(), &path.sin_addr) != 1)
+		{
+			return false;
+		}
+		memcpy(&primary.ssp_addr, &path, sizeof(path));
+	}
+	if (setsockopt(sockfd, IPPROTO_SCTP, SCTP_PRIMARY_ADDR, &primary, sizeof(primary)) < 0)
+	{
+		cerr << "SCTP Failed to set the primary path to " << address << " : " << strerror(errno) << endl;
+		return false;
+	}
+	return true;
+}
+
 void SCTPTransport::CheckConnection()
 {
 	if (sockfd == -1)
@@ -194,6 +385,12 @@ vector<shared_ptr<ConnectionToken>> SCTPTransport::GetClients() const
 }
 
 std::optional<int> SCTPTransport::Receive(void* buffer, int maxlength, std::shared_ptr<ConnectionToken> token)
+{
+	MessageOptions options;
+	return ReceiveMessage(buffer, maxlength, token, options);
+}
+
+std::optional<int> SCTPTransport::ReceiveMessage(void* buffer, int maxlength, std::shared_ptr<ConnectionToken> token, MessageOptions &options)
 {
 	if (!Server)
 	{
@@ -203,81 +400,353 @@ std::optional<int> SCTPTransport::Receive(void* buffer, int maxlength, std::shar
 	{
 		return nullopt;
 	}
-	struct sockaddr_in dest_addr;
+	bool broadcast;
 	{
-		shared_lock lock(listenmutex);
+		unique_lock lock(listenmutex);
 		auto value = connections.find(token);
 		if (value == connections.end())
 		{
 			cerr << "Token not found in connections while receiving !" << endl;
 			return nullopt;
 		}
-		dest_addr = value->second.address;
+		broadcast = value->second.address.sin_addr.s_addr == 0;
+		if (!broadcast && !value->second.backlog.empty())
+		{
+			return PopBacklog(value->second, buffer, maxlength, options);
+		}
 	}
-	bool broadcast = dest_addr.sin_addr.s_addr == 0;
-	
-
-	struct iovec io_buf;
-	io_buf.iov_base = buffer;
-	io_buf.iov_len = maxlength;
+	unique_lock drainlock(drainmutex);
+	if (broadcast)
+	{
+		//the broadcast token doesn't receive anything itself, it takes whatever comes
+		drainlock.unlock();
+		return ReceiveAny(buffer, maxlength).first;
+	}
+	{
+		//another thread may have drained our message while we waited
+		unique_lock lock(listenmutex);
+		auto value = connections.find(token);
+		if (value != connections.end() && !value->second.backlog.empty())
+		{
+			return PopBacklog(value->second, buffer, maxlength, options);
+		}
+	}
+	shared_ptr<ConnectionToken> sender;
+	auto received = DrainSocket(token, buffer, maxlength, options, sender);
+	if (!token->IsConnected()) //disconnected after receiving
+	{
+		return nullopt;
+	}
+	return received.value_or(0);
+}
 
-	struct msghdr msg;
-	memset(&msg, 0, sizeof(struct msghdr));
-	msg.msg_iov = &io_buf;
-	msg.msg_iovlen = 1;
-	msg.msg_name = &dest_addr;
-	msg.msg_namelen = sizeof(struct sockaddr_in);
+std::pair<int, std::shared_ptr<ConnectionToken>> SCTPTransport::ReceiveAny(void *buffer, int maxlength)
+{
+	if (!Server)
+	{
+		CheckConnection();
+	}
+	MessageOptions options;
+	//queued messages are older than anything still in the socket, they go first
+	auto popqueued = [&]() -> pair<int, shared_ptr<ConnectionToken>>
+	{
+		unique_lock lock(listenmutex);
+		for (auto &connection : connections)
+		{
+			if (!connection.second.backlog.empty())
+			{
+				return {PopBacklog(connection.second, buffer, maxlength, options), connection.first};
+			}
+		}
+		return {0, nullptr};
+	};
+	auto queued = popqueued();
+	if (queued.second)
+	{
+		return queued;
+	}
+	unique_lock drainlock(drainmutex);
+	//another thread may have drained while we waited
+	queued = popqueued();
+	if (queued.second)
+	{
+		return queued;
+	}
+	shared_ptr<ConnectionToken> sender;
+	auto received = DrainSocket(nullptr, buffer, maxlength, options, sender);
+	if (!received.has_value())
+	{
+		return {0, nullptr};
+	}
+	return {received.value(), sender};
+}
 
-	int numreceived = recvmsg(sockfd, &msg, MSG_DONTWAIT);
+int SCTPTransport::PopBacklog(SCTPConnection &connection, void* buffer, int maxlength, MessageOptions &options)
+{
+	QueuedMessage &message = connection.backlog.front();
+	int length = min<int>(message.data.size(), maxlength);
+	memcpy(buffer, message.data.data(), length);
+	options = message.options;
+	connection.backlog.pop_front();
+	return length;
+}
 
-	if (broadcast)
+std::optional<int> SCTPTransport::DrainSocket(const std::shared_ptr<ConnectionToken> &target, void* buffer, int maxlength, 
+	MessageOptions &options, std::shared_ptr<ConnectionToken> &sender)
+{
+	optional<int> delivered;
+	vector<shared_ptr<ConnectionToken>> closed;
+	for (int i = 0; i < DrainBatch && sockfd != -1; i++)
 	{
-		if (numreceived > 0)
+		sockaddr_in address;
+		memset(&address, 0, sizeof(address));
+		iovec io_buf;
+		io_buf.iov_base = scratch.data();
+		io_buf.iov_len = scratch.size();
+		char control[CMSG_SPACE(sizeof(sctp_sndrcvinfo))];
+		msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &io_buf;
+		msg.msg_iovlen = 1;
+		msg.msg_name = &address;
+		msg.msg_namelen = sizeof(address);
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		int numreceived = recvmsg(sockfd, &msg, MSG_DONTWAIT);
+		if (numreceived <= 0)
 		{
-			char ipbuf[16];
-			inet_ntop(AF_INET, &dest_addr.sin_addr, ipbuf, sizeof(dest_addr));
-			bool found = false;
-			for (auto &&i : connections)
+			//nothing left, one-to-many sockets report the end of associations as notifications
+			break;
+		}
+		if ((msg.msg_flags & MSG_NOTIFICATION) && (msg.msg_flags & MSG_EOR))
+		{
+			auto gone = HandleNotification(scratch.data(), numreceived);
+			closed.insert(closed.end(), gone.begin(), gone.end());
+			continue;
+		}
+		sctp_sndrcvinfo info;
+		memset(&info, 0, sizeof(info));
+		for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		{
+			if (cmsg->cmsg_level == IPPROTO_SCTP && cmsg->cmsg_type == SCTP_SNDRCV)
 			{
-				if (memcmp(&i.second.address.sin_addr, &dest_addr.sin_addr, sizeof(dest_addr.sin_addr)) == 0)
-				{
-					found = true;
-					//i.second.payloads.emplace_back(recvbuff.begin(), recvbuff.begin() + n);
-				}
-				
+				memcpy(&info, CMSG_DATA(cmsg), sizeof(info));
 			}
-			if (!found)
+		}
+		if (msg.msg_flags & MSG_NOTIFICATION)
+		{
+			continue; //notifications are short, a piece of one isn't worth putting back together
+		}
+		//large messages come in pieces, put them back together until the end of record
+		const uint8_t* data = scratch.data();
+		size_t datalength = numreceived;
+		//with I-DATA an ordered and an unordered message of the same stream may come in at the same time
+		auto key = make_tuple(info.sinfo_assoc_id, info.sinfo_stream, (bool)(info.sinfo_flags & SCTP_UNORDERED));
+		auto partial = partials.find(key);
+		if (!(msg.msg_flags & MSG_EOR) || partial != partials.end())
+		{
+			vector<uint8_t> &pieces = partials[key];
+			size_t kept = min<size_t>(numreceived, MaxMessageSize - min(pieces.size(), MaxMessageSize)); //longer messages are truncated
+			pieces.insert(pieces.end(), scratch.begin(), scratch.begin() + kept);
+			if (!(msg.msg_flags & MSG_EOR))
 			{
-				auto token = Connect(dest_addr);
-				//connections[token].payloads.emplace_back(recvbuff.begin(), recvbuff.begin() + n);
-				cout << "SCTP Client connecting from " << ipbuf << endl;
+				i--; //only whole messages count in the batch
+				continue;
 			}
+			partial = partials.find(key);
+			data = partial->second.data();
+			datalength = partial->second.size();
+		}
+		MessageOptions received;
+		received.stream = info.sinfo_stream;
+		received.unordered = info.sinfo_flags & SCTP_UNORDERED;
+		unique_lock lock(listenmutex);
+		auto token = ResolveAssociation(info.sinfo_assoc_id, address);
+		SCTPConnection &connection = connections.at(token);
+		//behind queued messages of the same association, it has to wait its turn
+		if (!delivered.has_value() && (!target || token == target) && connection.backlog.empty())
+		{
+			int length = min<size_t>(datalength, maxlength);
+			memcpy(buffer, data, length);
+			options = received;
+			sender = token;
+			delivered = length;
+			if (partial != partials.end())
+			{
+				partials.erase(partial);
+			}
+			continue;
+		}
+		if (connection.backlog.size() >= BacklogCapacity)
+		{
+			connection.backlog.pop_front();
+			connection.dropped++;
+		}
+		if (partial != partials.end())
+		{
+			connection.backlog.push_back({std::move(partial->second), received});
+			partials.erase(partial);
+		}
+		else
+		{
+			connection.backlog.push_back({vector<uint8_t>(data, data + datalength), received});
 		}
-		
 	}
-	
-	if (numreceived <= 0)
+	for (auto &token : closed)
 	{
-		if (numreceived == 0)
+		//pieces of messages the association won't finish
+		sctp_assoc_t association = 0;
 		{
-			//got disconnected
-			token->Disconnect();
+			shared_lock lock(listenmutex);
+			auto value = connections.find(token);
+			if (value != connections.end())
+			{
+				association = value->second.association;
+			}
 		}
-		else if (numreceived == -1)
+		for (auto partial = partials.begin(); partial != partials.end();)
 		{
-			//do nothing || errno == EWOULDBLOCK || errno == EAGAIN
-			numreceived = 0;
+			partial = get<0>(partial->first) == association ? partials.erase(partial) : next(partial);
 		}
+		token->Disconnect();
 	}
-	if (!token->IsConnected()) //disconnected after receiving
+	return delivered;
+}
+
+std::shared_ptr<ConnectionToken> SCTPTransport::ResolveAssociation(sctp_assoc_t association, const sockaddr_in &address)
+{
+	auto known = associations.find(association);
+	if (known != associations.end())
 	{
-		return nullopt;
+		return known->second;
+	}
+	for (auto &connection : connections)
+	{
+		//the client's only association is the server, a server may have Connected to that peer already
+		bool match = !Server || (connection.second.association == 0 
+			&& connection.second.address.sin_addr.s_addr == address.sin_addr.s_addr && connection.second.address.sin_addr.s_addr != 0);
+		if (match)
+		{
+			connection.second.association = association;
+			SetupAssociation(connection.second);
+			associations[association] = connection.first;
+			return connection.first;
+		}
+	}
+	char ipbuf[INET_ADDRSTRLEN];
+	inet_ntop(AF_INET, &address.sin_addr, ipbuf, sizeof(ipbuf));
+	cout << "SCTP Client connecting from " << ipbuf << endl;
+	auto token = make_shared<ConnectionToken>(string(ipbuf), this);
+	SCTPConnection value;
+	value.address = address;
+	value.name = ipbuf;
+	value.association = association;
+	SetupAssociation(value);
+	connections[token] = value;
+	associations[association] = token;
+	return token;
+}
+
+int SCTPTransport::GetOutboundStreams(sctp_assoc_t association) const
+{
+	sctp_status status;
+	memset(&status, 0, sizeof(status));
+	status.sstat_assoc_id = association;
+	socklen_t length = sizeof(status);
+	if (getsockopt(sockfd, IPPROTO_SCTP, SCTP_STATUS, &status, &length) < 0)
+	{
+		return 0;
 	}
-	return numreceived;
+	return status.sstat_outstrms;
+}
+
+int SCTPTransport::GetPeerAddressCount(sctp_assoc_t association) const
+{
+	vector<uint8_t> buffer(sizeof(sctp_getaddrs) + 32 * sizeof(sockaddr_storage));
+	sctp_getaddrs* addresses = reinterpret_cast<sctp_getaddrs*>(buffer.data());
+	addresses->assoc_id = association;
+	socklen_t length = buffer.size();
+	if (getsockopt(sockfd, IPPROTO_SCTP, SCTP_GET_PEER_ADDRS, addresses, &length) < 0)
+	{
+		return 0;
+	}
+	return addresses->addr_num;
+}
+
+void SCTPTransport::SetupAssociation(SCTPConnection &connection)
+{
+	connection.outstreams = GetOutboundStreams(connection.association);
+	//a single path has nothing to fail over to, quick failure detection would only abort it sooner
+	connection.multihomed = GetPeerAddressCount(connection.association) > 1;
+	if (connection.multihomed)
+	{
+		ApplyHeartbeat(connection.association);
+	}
+}
+
+std::vector<std::shared_ptr<ConnectionToken>> SCTPTransport::HandleNotification(const uint8_t* notification, int length)
+{
+	const sctp_notification* header = reinterpret_cast<const sctp_notification*>(notification);
+	if (length < (int)sizeof(sctp_assoc_change) || header->sn_header.sn_type != SCTP_ASSOC_CHANGE)
+	{
+		return {};
+	}
+	const sctp_assoc_change &change = header->sn_assoc_change;
+	if (change.sac_state == SCTP_COMM_UP || change.sac_state == SCTP_RESTART)
+	{
+		//a restarted association may have settled on another stream count
+		unique_lock lock(listenmutex);
+		auto known = associations.find(change.sac_assoc_id);
+		if (known != associations.end())
+		{
+			connections.at(known->second).outstreams = change.sac_outbound_streams;
+		}
+		return {};
+	}
+	if (change.sac_state != SCTP_COMM_LOST && change.sac_state != SCTP_SHUTDOWN_COMP && change.sac_state != SCTP_CANT_STR_ASSOC)
+	{
+		return {};
+	}
+	shared_lock lock(listenmutex);
+	auto known = associations.find(change.sac_assoc_id);
+	if (known != associations.end())
+	{
+		return {known->second};
+	}
+	if (!Server && !connections.empty())
+	{
+		//the client's association to the server failed before any message came through
+		return {connections.begin()->first};
+	}
+	return {};
+}
+
+uint64_t SCTPTransport::GetDroppedMessages(std::shared_ptr<ConnectionToken> token) const
+{
+	shared_lock lock(listenmutex);
+	auto value = connections.find(token);
+	if (value == connections.end())
+	{
+		return 0;
+	}
+	return value->second.dropped;
 }
 
 
 bool SCTPTransport::Send(const void* buffer, int length,  std::shared_ptr<ConnectionToken> token)
+{
+	iovec io_buf;
+	io_buf.iov_base = const_cast<void*>(buffer);
+	io_buf.iov_len = length;
+	return Send(&io_buf, 1, token);
+}
+
+bool SCTPTransport::Send(const iovec* iov, int iovcnt, std::shared_ptr<ConnectionToken> token)
+{
+	return Send(iov, iovcnt, MessageOptions(), token);
+}
+
+bool SCTPTransport::Send(const iovec* iov, int iovcnt, const MessageOptions &options, std::shared_ptr<ConnectionToken> token)
 {
 	if (!Server)
 	{
@@ -288,6 +757,8 @@ bool SCTPTransport::Send(const void* buffer, int length,  std::shared_ptr<Connec
 		return false;
 	}
 	struct sockaddr_in dest_addr;
+	sctp_assoc_t association;
+	int streams = Streams; //until the peer told how many it takes
 	{
 		shared_lock lock(listenmutex);
 		auto value = connections.find(token);
@@ -297,23 +768,97 @@ bool SCTPTransport::Send(const void* buffer, int length,  std::shared_ptr<Connec
 			return false;
 		}
 		dest_addr = value->second.address;
+		association = value->second.association;
+		if (dest_addr.sin_addr.s_addr == INADDR_ANY)
+		{
+			//the stream has to exist on every association
+			for (auto &connection : connections)
+			{
+				if (connection.second.outstreams > 0)
+				{
+					streams = min(streams, connection.second.outstreams);
+				}
+			}
+		}
+		else if (value->second.outstreams > 0)
+		{
+			streams = min(streams, value->second.outstreams);
+		}
+	}
+	//BroadcastClient : one sendmsg reaches every association of the socket
+	bool broadcast = dest_addr.sin_addr.s_addr == INADDR_ANY;
+	size_t length = 0; //max 213000
+	for (int i = 0; i < iovcnt; i++)
+	{
+		length += iov[i].iov_len;
 	}
-	struct iovec io_buf;
-    io_buf.iov_base = const_cast<void*>(buffer);
-    io_buf.iov_len = length; //max 213000
 
-	if (io_buf.iov_len >= 212900)
+	if (length > MaxMessageSize)
+	{
+		cerr << "SCTP Can't send " << length << " bytes, messages are limited to " << MaxMessageSize << endl;
+		return false;
+	}
+	if ((int)length > SendBufferSize && (int)length <= SendBufferLimit)
 	{
-		cout << "SCTP Warning : Trying to send " << length << " bytes" << endl;
+		//a message has to fit in the send buffer whole, grow it instead of failing
+		int size = max<int>(SendBufferSize, 1);
+		while (size < (int)length)
+		{
+			size *= 2;
+		}
+		SetSocketBufferSizes(sockfd, size, 0);
+		UpdateSendBufferSize();
+		if (SendBufferSize < (int)length)
+		{
+			SendBufferLimit = SendBufferSize.load();
+		}
+	}
+	if ((int)length > SendBufferSize)
+	{
+		//it would wait forever for room in sendmsg
+		cerr << "SCTP Can't send " << length << " bytes, the send buffer is capped at " << SendBufferSize << endl;
+		return false;
 	}
 	
 
     struct msghdr msg;
     memset(&msg, 0, sizeof(struct msghdr));
-    msg.msg_iov = &io_buf;
-    msg.msg_iovlen = 1;
-    msg.msg_name = &dest_addr;
-    msg.msg_namelen = sizeof(struct sockaddr_in);
+    msg.msg_iov = const_cast<iovec*>(iov);
+    msg.msg_iovlen = iovcnt;
+	if (association == 0 && !broadcast)
+	{
+		//not associated yet, the address sets the association up
+		msg.msg_name = &dest_addr;
+		msg.msg_namelen = sizeof(struct sockaddr_in);
+	}
+
+	char control[CMSG_SPACE(sizeof(sctp_sndrcvinfo))];
+	memset(control, 0, sizeof(control));
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = IPPROTO_SCTP;
+	cmsg->cmsg_type = SCTP_SNDRCV;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(sctp_sndrcvinfo));
+	sctp_sndrcvinfo info;
+	memset(&info, 0, sizeof(info));
+	info.sinfo_stream = min<int>(options.stream, streams - 1);
+	info.sinfo_assoc_id = association;
+	if (broadcast)
+	{
+		info.sinfo_flags |= SCTP_SENDALL;
+	}
+	if (options.unordered)
+	{
+		info.sinfo_flags |= SCTP_UNORDERED;
+	}
+	if (options.lifetime.count() > 0)
+	{
+		//abandoned by the stack once expired instead of being retransmitted
+		info.sinfo_flags |= SCTP_PR_SCTP_TTL;
+		info.sinfo_timetolive = options.lifetime.count();
+	}
+	memcpy(CMSG_DATA(cmsg), &info, sizeof(info));
 
 	int numsent = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
 	int errnocp = errno;
@@ -328,6 +873,11 @@ bool SCTPTransport::Send(const void* buffer, int length,  std::shared_ptr<Connec
 			break;
 		
 		default:
+			if (broadcast)
+			{
+				//no association to send to, the broadcast token stays valid for the next ones
+				return false;
+			}
 			//got disconnected
 			token->Disconnect();
 			break;
@@ -354,7 +904,85 @@ void SCTPTransport::DisconnectClient(std::shared_ptr<ConnectionToken> token)
 	else
 	{
 		cout << "SCTP Server " << token->GetConnectionName() << " disconnected." <<endl;
+		if (Loop && sockfd != -1)
+		{
+			Loop->Remove(sockfd);
+		}
 		sockfd = -1; //in the case of the client, the sockfd is that of the root socket
 	}
+	if (value->second.association != 0)
+	{
+		associations.erase(value->second.association);
+	}
 	connections.erase(value);
+}
+
+bool SCTPTransport::AttachEventLoop(EventLoop* loop, EventCallback callback)
+{
+	DetachEventLoop();
+	Loop = loop;
+	OnEvent = callback;
+	if (sockfd != -1)
+	{
+		WatchSocket();
+	}
+	return true;
+}
+
+void SCTPTransport::DetachEventLoop()
+{
+	if (!Loop)
+	{
+		return;
+	}
+	if (sockfd != -1)
+	{
+		Loop->Remove(sockfd);
+	}
+	Loop = nullptr;
+}
+
+void SCTPTransport::WatchSocket()
+{
+	Loop->Add(sockfd, EPOLLIN, [this](uint32_t events)
+	{
+		(void)events;
+		if (Server)
+		{
+			//one-to-many socket : whoever sent it is only known once it's read
+			OnEvent(nullptr, TransportEvent::Readable);
+			return;
+		}
+		for (auto &token : GetClients())
+		{
+			OnEvent(token, TransportEvent::Readable);
+		}
+	});
+}
+
+size_t SCTPTransport::GetMaxMessageSize() const
+{
+	return MaxMessageSize;
+}
+
+bool SCTPTransport::SetBufferSizes(int sendsize, int receivesize)
+{
+	bool ok = SetSocketBufferSizes(sockfd, sendsize, receivesize);
+	if (sendsize > 0)
+	{
+		//still grown for larger messages
+		SendBufferLimit = INT_MAX;
+		UpdateSendBufferSize();
+	}
+	return ok;
+}
+
+void SCTPTransport::UpdateSendBufferSize()
+{
+	int actual = 0;
+	socklen_t length = sizeof(actual);
+	if (sockfd != -1 && getsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &actual, &length) == 0)
+	{
+		SendBufferSize = actual;
+	}
 }
\ No newline at end of file
@@ -0,0 +1,953 @@
+#include "Transport/SharedMemoryTransport.hpp"
+#include <Transport/ConnectionToken.hpp>
+
+#include <iostream>
+#include <string.h>
+#include <errno.h>
+#include <climits>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+using namespace std;
+
+namespace
+{
+	constexpr uint32_t SegmentMagic = 0x4d485343; //"CSHM"
+	constexpr uint32_t SegmentVersion = 2;
+	constexpr uint32_t AllClients = UINT32_MAX; //destination of broadcasts and of messages to the server
+	constexpr uint32_t PaddingRecord = UINT32_MAX; //length of the filler up to the end of the ring
+
+	enum SlotState : uint32_t
+	{
+		Free,
+		Claiming, //a client is filling the slot in
+		Claimed, //waiting for the server to accept it
+		Connected,
+		Closed //one side left, the server frees the slot once the client is gone or cleared its pid
+	};
+
+	struct RecordHeader
+	{
+		uint32_t length;
+		uint32_t destination;
+	};
+
+	uint64_t GetRecordSize(uint64_t length)
+	{
+		return (sizeof(RecordHeader) + length + 7) & ~(uint64_t)7;
+	}
+
+	//Largest message a ring of capacity bytes always has room for once its readers caught up
+	uint64_t GetMaxMessageLength(uint64_t capacity)
+	{
+		return capacity / 2 - sizeof(RecordHeader);
+	}
+
+	//Process shared futexes, the words live in the segment
+	void FutexWait(atomic<uint32_t>* word, uint32_t expected, chrono::microseconds timeout)
+	{
+		timespec ts;
+		ts.tv_sec = timeout.count() / 1000000;
+		ts.tv_nsec = (timeout.count() % 1000000) * 1000;
+		syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT, expected, &ts, nullptr, 0);
+	}
+
+	void FutexWake(atomic<uint32_t>* word)
+	{
+		syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+	}
+
+	bool IsProcessAlive(uint32_t pid)
+	{
+		return pid != 0 && (kill(pid, 0) == 0 || errno != ESRCH);
+	}
+}
+
+//Control block of a ring with one writer, positions count bytes since the ring was created
+struct SharedMemoryTransport::SharedRing
+{
+	alignas(64) atomic<uint64_t> head; //bytes written, only the writer moves it
+	atomic<uint32_t> written; //bumped after every write, readers wait on it
+	atomic<uint32_t> readerssleeping;
+	alignas(64) atomic<uint32_t> consumed; //bumped when a reader gives space back, the writer waits on it
+	atomic<uint32_t> writersleeping;
+
+	//Append a record if the readers, the slowest being at tail, left room for it
+	bool Write(uint8_t* data, uint64_t capacity, uint64_t tail, uint32_t destination, const iovec* iov, int iovcnt, size_t length)
+	{
+		uint64_t position = head.load(memory_order_relaxed);
+		uint64_t offset = position % capacity;
+		uint64_t size = GetRecordSize(length);
+		//records are contiguous, skip the end of the ring if it's too short
+		uint64_t padding = capacity - offset < size ? capacity - offset : 0;
+		if (position + padding + size - tail > capacity)
+		{
+			return false;
+		}
+		if (padding != 0)
+		{
+			RecordHeader filler = {PaddingRecord, AllClients};
+			memcpy(data + offset, &filler, sizeof(filler));
+			position += padding;
+			offset = 0;
+		}
+		RecordHeader record = {(uint32_t)length, destination};
+		memcpy(data + offset, &record, sizeof(record));
+		uint8_t* payload = data + offset + sizeof(record);
+		for (int i = 0; i < iovcnt; i++)
+		{
+			memcpy(payload, iov[i].iov_base, iov[i].iov_len);
+			payload += iov[i].iov_len;
+		}
+		head.store(position + size, memory_order_release);
+		written++;
+		if (readerssleeping > 0)
+		{
+			FutexWake(&written);
+		}
+		return true;
+	}
+};
+
+struct SharedMemoryTransport::ClientSlot
+{
+	atomic<uint32_t> state; //SlotState
+	atomic<uint32_t> pid; //cleared by the client when it leaves
+	atomic<uint32_t> generation; //bumped by every claim, a client only owns the slot while it matches
+	alignas(64) atomic<uint64_t> tail; //downstream bytes this client is done with
+	alignas(64) atomic<uint64_t> uptail; //upstream bytes the server is done with
+	SharedRing upstream;
+
+	bool IsOwnedBy(uint32_t InGeneration) const
+	{
+		return generation.load(memory_order_acquire) == InGeneration;
+	}
+
+	//Client side, let the server free the slot
+	void Leave(uint32_t InGeneration)
+	{
+		if (!IsOwnedBy(InGeneration))
+		{
+			return;
+		}
+		state = Closed;
+		pid = 0;
+	}
+};
+
+//Segment layout : this header, the client slots, the upstream rings, then the downstream ring
+struct SharedMemoryTransport::Segment
+{
+	atomic<uint32_t> magic; //written last by the server
+	uint32_t version;
+	uint64_t capacity; //of the downstream ring
+	uint32_t maxclients;
+	atomic<uint32_t> serverpid; //0 once the server is gone
+	SharedRing downstream;
+
+	static size_t GetSlotsOffset()
+	{
+		return (sizeof(Segment) + 63) & ~(size_t)63;
+	}
+
+	static size_t GetUpstreamOffset(uint32_t maxclients)
+	{
+		return GetSlotsOffset() + sizeof(ClientSlot) * maxclients;
+	}
+
+	static size_t GetDownstreamOffset(uint32_t maxclients)
+	{
+		return GetUpstreamOffset(maxclients) + UpstreamRingSize * maxclients;
+	}
+
+	static size_t GetSize(uint64_t capacity, uint32_t maxclients)
+	{
+		return GetDownstreamOffset(maxclients) + capacity;
+	}
+
+	ClientSlot &GetSlot(int slot)
+	{
+		return reinterpret_cast<ClientSlot*>(reinterpret_cast<uint8_t*>(this) + GetSlotsOffset())[slot];
+	}
+
+	uint8_t* GetUpstreamData(int slot)
+	{
+		return reinterpret_cast<uint8_t*>(this) + GetUpstreamOffset(maxclients) + UpstreamRingSize * slot;
+	}
+
+	uint8_t* GetDownstreamData()
+	{
+		return reinterpret_cast<uint8_t*>(this) + GetDownstreamOffset(maxclients);
+	}
+};
+
+SharedMemoryTransport::Mapping::Mapping(Segment* InSegment, size_t InSize)
+	:segment(InSegment), size(InSize)
+{
+}
+
+SharedMemoryTransport::Mapping::~Mapping()
+{
+	munmap(segment, size);
+}
+
+SharedMemoryTransport::Channel::Channel(std::shared_ptr<Mapping> InMemory, SharedRing* InRing, std::atomic<uint64_t>* InTail,
+	const uint8_t* InData, uint64_t InCapacity, uint32_t InDestination, ClientSlot* InGate, uint32_t InGeneration)
+	:Memory(InMemory), Ring(InRing), Tail(InTail), Data(InData), Capacity(InCapacity), Destination(InDestination),
+	Gate(InGate), Generation(InGeneration)
+{
+}
+
+void SharedMemoryTransport::Channel::Publish()
+{
+	uint64_t tail = leases.empty() ? readposition : leases.front();
+	if (tail == Tail->load(memory_order_relaxed))
+	{
+		return;
+	}
+	Tail->store(tail, memory_order_release);
+	Ring->consumed++;
+	if (Ring->writersleeping > 0)
+	{
+		FutexWake(&Ring->consumed);
+	}
+}
+
+std::optional<std::pair<uint64_t, uint32_t>> SharedMemoryTransport::Channel::Next()
+{
+	if (broken)
+	{
+		return nullopt;
+	}
+	if (Gate && !Gate->IsOwnedBy(Generation))
+	{
+		//the server dropped us and the slot went to another client
+		return nullopt;
+	}
+	if (!started)
+	{
+		if (Gate && Gate->state.load(memory_order_acquire) != Connected)
+		{
+			return nullopt;
+		}
+		readposition = Tail->load(memory_order_acquire);
+		started = true;
+	}
+	uint64_t head = Ring->head.load(memory_order_acquire);
+	bool skipped = false;
+	while (readposition < head)
+	{
+		uint64_t offset = readposition % Capacity;
+		RecordHeader record;
+		if (Capacity - offset < sizeof(record))
+		{
+			cerr << "SHM Misaligned record in ring, disconnecting its writer" << endl;
+			broken = true;
+			return nullopt;
+		}
+		memcpy(&record, Data + offset, sizeof(record));
+		//the writer may be another user, don't trust the length to stay in the ring
+		uint64_t size = record.length == PaddingRecord ? Capacity - offset : GetRecordSize(record.length);
+		if ((record.length != PaddingRecord && record.length > Capacity - offset - sizeof(record)) || size > head - readposition)
+		{
+			cerr << "SHM Corrupt record of " << record.length << " bytes in ring, disconnecting its writer" << endl;
+			broken = true;
+			return nullopt;
+		}
+		if (record.length == PaddingRecord)
+		{
+			readposition += size;
+		}
+		else if (record.destination == AllClients || record.destination == Destination)
+		{
+			if (skipped)
+			{
+				Publish();
+			}
+			return make_pair(readposition, record.length);
+		}
+		else
+		{
+			readposition += size;
+		}
+		skipped = true;
+	}
+	if (skipped)
+	{
+		Publish();
+	}
+	return nullopt;
+}
+
+int SharedMemoryTransport::Channel::Read(void* buffer, int maxlength)
+{
+	unique_lock lock(channelmutex);
+	auto record = Next();
+	if (!record.has_value())
+	{
+		return 0;
+	}
+	int length = min<int>(record->second, maxlength);
+	memcpy(buffer, Data + record->first % Capacity + sizeof(RecordHeader), length);
+	readposition = record->first + GetRecordSize(record->second);
+	Publish();
+	return length;
+}
+
+BufferLease SharedMemoryTransport::Channel::Lend(const std::shared_ptr<Channel> &self)
+{
+	unique_lock lock(channelmutex);
+	auto record = Next();
+	if (!record.has_value())
+	{
+		return BufferLease();
+	}
+	leases.push_back(record->first);
+	readposition = record->first + GetRecordSize(record->second);
+	return BufferLease(self, record->first, Data + record->first % Capacity + sizeof(RecordHeader), record->second);
+}
+
+bool SharedMemoryTransport::Channel::IsBroken() const
+{
+	return broken;
+}
+
+bool SharedMemoryTransport::Channel::HasData()
+{
+	unique_lock lock(channelmutex);
+	return Next().has_value();
+}
+
+bool SharedMemoryTransport::Channel::Wait(std::chrono::microseconds timeout)
+{
+	uint32_t seen = Ring->written;
+	if (HasData())
+	{
+		return true;
+	}
+	Ring->readerssleeping++;
+	if (seen == Ring->written)
+	{
+		FutexWait(&Ring->written, seen, timeout);
+	}
+	Ring->readerssleeping--;
+	return HasData();
+}
+
+void SharedMemoryTransport::Channel::ReleaseLease(uint64_t handle)
+{
+	unique_lock lock(channelmutex);
+	for (auto lease = leases.begin(); lease != leases.end(); lease++)
+	{
+		if (*lease == handle)
+		{
+			leases.erase(lease);
+			break;
+		}
+	}
+	Publish();
+}
+
+SharedMemoryTransport::SharedMemoryTransport(std::string InName, size_t InRingSize, int InMaxClients, mode_t InMode)
+	:GenericTransport(),
+	Name(InName)
+{
+	if (Name.empty())
+	{
+		return;
+	}
+	uint64_t capacity = (InRingSize + 7) & ~(uint64_t)7;
+	size_t size = Segment::GetSize(capacity, InMaxClients);
+	string path = GetSegmentPath(Name);
+	int fd = shm_open(path.c_str(), O_CREAT | O_EXCL | O_RDWR, InMode);
+	if (fd == -1 && errno == EEXIST && IsAbandoned(path))
+	{
+		//left behind by a server that crashed
+		shm_unlink(path.c_str());
+		fd = shm_open(path.c_str(), O_CREAT | O_EXCL | O_RDWR, InMode);
+	}
+	if (fd == -1)
+	{
+		cerr << "SHM Can't create segment " << Name << ", " << strerror(errno) << endl;
+		return;
+	}
+	if (ftruncate(fd, size) == -1)
+	{
+		cerr << "SHM Can't size segment " << Name << ", " << strerror(errno) << endl;
+		close(fd);
+		shm_unlink(path.c_str());
+		return;
+	}
+	void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (memory == MAP_FAILED)
+	{
+		cerr << "SHM Can't map segment " << Name << ", " << strerror(errno) << endl;
+		shm_unlink(path.c_str());
+		return;
+	}
+	//a fresh segment is zeroed : every slot is Free and every position 0
+	Segment* segment = static_cast<Segment*>(memory);
+	segment->version = SegmentVersion;
+	segment->capacity = capacity;
+	segment->maxclients = InMaxClients;
+	segment->serverpid = getpid();
+	segment->magic.store(SegmentMagic, memory_order_release);
+	Own = make_shared<Mapping>(segment, size);
+	slottokens.resize(InMaxClients);
+}
+
+bool SharedMemoryTransport::IsAbandoned(const std::string &path)
+{
+	int fd = shm_open(path.c_str(), O_RDONLY, 0);
+	if (fd == -1)
+	{
+		return false;
+	}
+	struct stat status;
+	void* memory = MAP_FAILED;
+	if (fstat(fd, &status) == 0 && (size_t)status.st_size >= sizeof(Segment))
+	{
+		memory = mmap(nullptr, sizeof(Segment), PROT_READ, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if (memory == MAP_FAILED)
+	{
+		return false;
+	}
+	const Segment* segment = static_cast<const Segment*>(memory);
+	uint32_t magic = segment->magic.load(memory_order_acquire);
+	//a server that died while creating its segment hasn't written the magic yet
+	bool abandoned = (magic == SegmentMagic || magic == 0) && !IsProcessAlive(segment->serverpid);
+	munmap(memory, sizeof(Segment));
+	return abandoned;
+}
+
+SharedMemoryTransport::~SharedMemoryTransport()
+{
+	unique_lock lock(listenmutex);
+	for (auto &connection : connections)
+	{
+		if (connection.second.server)
+		{
+			connection.second.memory->segment->GetSlot(connection.second.slot).Leave(connection.second.generation);
+		}
+	}
+	connections.clear();
+	slottokens.clear();
+	if (Own)
+	{
+		Segment* segment = Own->segment;
+		segment->serverpid = 0;
+		//wake the clients waiting for data so that they notice
+		segment->downstream.written++;
+		FutexWake(&segment->downstream.written);
+		shm_unlink(GetSegmentPath(Name).c_str());
+	}
+}
+
+std::string SharedMemoryTransport::GetSegmentPath(const std::string &name)
+{
+	return "/" + name;
+}
+
+std::shared_ptr<ConnectionToken> SharedMemoryTransport::Connect(std::string name)
+{
+	if (name == BroadcastClient)
+	{
+		if (!Own)
+		{
+			cerr << "SHM Can't broadcast without a segment of our own" << endl;
+			return nullptr;
+		}
+		unique_lock lock(listenmutex);
+		for (auto &connection : connections)
+		{
+			if (connection.second.slot == -1)
+			{
+				return connection.first;
+			}
+		}
+		auto token = make_shared<ConnectionToken>(name, this);
+		connections[token] = {Own, nullptr, -1, false, 0};
+		return token;
+	}
+	string path = GetSegmentPath(name);
+	int fd = shm_open(path.c_str(), O_RDWR, 0);
+	if (fd == -1)
+	{
+		cerr << "SHM Can't open segment " << name << ", " << strerror(errno) << endl;
+		return nullptr;
+	}
+	struct stat status;
+	void* memory = MAP_FAILED;
+	if (fstat(fd, &status) == 0 && (size_t)status.st_size >= sizeof(Segment))
+	{
+		memory = mmap(nullptr, status.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if (memory == MAP_FAILED)
+	{
+		cerr << "SHM Can't map segment " << name << endl;
+		return nullptr;
+	}
+	auto mapping = make_shared<Mapping>(static_cast<Segment*>(memory), status.st_size);
+	Segment* segment = mapping->segment;
+	if (segment->magic.load(memory_order_acquire) != SegmentMagic || segment->version != SegmentVersion
+		|| Segment::GetSize(segment->capacity, segment->maxclients) > (size_t)status.st_size)
+	{
+		cerr << "SHM Segment " << name << " isn't a transport segment or has another version" << endl;
+		return nullptr;
+	}
+	if (!IsProcessAlive(segment->serverpid))
+	{
+		cerr << "SHM Server of " << name << " is gone" << endl;
+		return nullptr;
+	}
+	for (uint32_t i = 0; i < segment->maxclients; i++)
+	{
+		ClientSlot &slot = segment->GetSlot(i);
+		uint32_t expected = Free;
+		if (!slot.state.compare_exchange_strong(expected, Claiming))
+		{
+			continue;
+		}
+		slot.pid = getpid();
+		uint32_t generation = ++slot.generation;
+		//the server starts reading our ring from there once it accepts us
+		slot.uptail = slot.upstream.head.load();
+		slot.state.store(Claimed, memory_order_release);
+		auto token = make_shared<ConnectionToken>(name, this);
+		auto channel = make_shared<Channel>(mapping, &segment->downstream, &slot.tail,
+			segment->GetDownstreamData(), segment->capacity, i, &slot, generation);
+		unique_lock lock(listenmutex);
+		connections[token] = {mapping, channel, (int)i, true, generation};
+		return token;
+	}
+	cerr << "SHM Segment " << name << " has no free client slot" << endl;
+	return nullptr;
+}
+
+void SharedMemoryTransport::AdoptClients()
+{
+	if (!Own)
+	{
+		return;
+	}
+	Segment* segment = Own->segment;
+	bool claimed = false;
+	for (uint32_t i = 0; i < segment->maxclients && !claimed; i++)
+	{
+		claimed = segment->GetSlot(i).state == Claimed;
+	}
+	if (!claimed)
+	{
+		return;
+	}
+	unique_lock lock(listenmutex);
+	for (uint32_t i = 0; i < segment->maxclients; i++)
+	{
+		ClientSlot &slot = segment->GetSlot(i);
+		if (slot.state.load(memory_order_acquire) != Claimed || slottokens[i])
+		{
+			continue;
+		}
+		//the client only gets what is written from now on
+		{
+			unique_lock writelock(writemutex);
+			slot.tail = segment->downstream.head.load();
+			slot.state.store(Connected, memory_order_release);
+		}
+		auto token = make_shared<ConnectionToken>(Name + ":" + to_string(slot.pid), this);
+		auto channel = make_shared<Channel>(Own, &slot.upstream, &slot.uptail,
+			segment->GetUpstreamData(i), UpstreamRingSize, AllClients, nullptr, 0);
+		connections[token] = {Own, channel, (int)i, false, slot.generation.load()};
+		slottokens[i] = token;
+		cout << "SHM Client " << token->GetConnectionName() << " connected to " << Name << endl;
+	}
+}
+
+bool SharedMemoryTransport::IsAlive(const SharedMemoryConnection &connection) const
+{
+	if (connection.slot < 0)
+	{
+		return true;
+	}
+	if (connection.inbound && connection.inbound->IsBroken())
+	{
+		return false;
+	}
+	Segment* segment = connection.memory->segment;
+	ClientSlot &slot = segment->GetSlot(connection.slot);
+	if (!slot.IsOwnedBy(connection.generation))
+	{
+		return false;
+	}
+	if (connection.server)
+	{
+		uint32_t state = slot.state;
+		return (state == Claimed || state == Connected) && IsProcessAlive(segment->serverpid);
+	}
+	return slot.state == Connected && IsProcessAlive(slot.pid);
+}
+
+void SharedMemoryTransport::ReapPeers()
+{
+	int64_t now = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+	int64_t last = lastreap;
+	if (now - last < chrono::duration_cast<chrono::nanoseconds>(AliveCheckInterval).count()
+		|| !lastreap.compare_exchange_strong(last, now))
+	{
+		return;
+	}
+	vector<shared_ptr<ConnectionToken>> gone;
+	{
+		unique_lock lock(listenmutex);
+		for (auto &connection : connections)
+		{
+			if (!IsAlive(connection.second))
+			{
+				gone.push_back(connection.first);
+			}
+		}
+		//clients that left before we accepted them, or that know we dropped them
+		if (Own)
+		{
+			for (uint32_t i = 0; i < Own->segment->maxclients; i++)
+			{
+				ClientSlot &slot = Own->segment->GetSlot(i);
+				uint32_t state = slot.state;
+				if (!slottokens[i] && (state == Closed || state == Claimed) && !IsProcessAlive(slot.pid))
+				{
+					slot.state = Free;
+				}
+			}
+		}
+	}
+	for (auto &token : gone)
+	{
+		token->Disconnect();
+	}
+}
+
+uint64_t SharedMemoryTransport::GetDownstreamTail(const Segment* segment) const
+{
+	Segment* writable = const_cast<Segment*>(segment);
+	uint64_t tail = segment->downstream.head.load(memory_order_relaxed);
+	for (uint32_t i = 0; i < segment->maxclients; i++)
+	{
+		ClientSlot &slot = writable->GetSlot(i);
+		if (slot.state.load(memory_order_acquire) == Connected)
+		{
+			tail = min<uint64_t>(tail, slot.tail.load(memory_order_acquire));
+		}
+	}
+	return tail;
+}
+
+bool SharedMemoryTransport::WriteMessage(const SharedMemoryConnection &connection, const iovec* iov, int iovcnt, size_t length)
+{
+	Segment* segment = connection.memory->segment;
+	if (connection.server)
+	{
+		ClientSlot &slot = segment->GetSlot(connection.slot);
+		if (!slot.IsOwnedBy(connection.generation))
+		{
+			return false;
+		}
+		return slot.upstream.Write(segment->GetUpstreamData(connection.slot), UpstreamRingSize,
+			slot.uptail.load(memory_order_acquire), AllClients, iov, iovcnt, length);
+	}
+	uint32_t destination = AllClients;
+	if (connection.slot >= 0)
+	{
+		if (segment->GetSlot(connection.slot).state != Connected)
+		{
+			return false;
+		}
+		destination = connection.slot;
+	}
+	return segment->downstream.Write(segment->GetDownstreamData(), segment->capacity,
+		GetDownstreamTail(segment), destination, iov, iovcnt, length);
+}
+
+bool SharedMemoryTransport::SendMessage(std::shared_ptr<ConnectionToken> token, const iovec* iov, int iovcnt)
+{
+	size_t length = 0;
+	for (int i = 0; i < iovcnt; i++)
+	{
+		length += iov[i].iov_len;
+	}
+	SharedMemoryConnection connection;
+	{
+		shared_lock lock(listenmutex);
+		auto value = connections.find(token);
+		if (value == connections.end())
+		{
+			cerr << "SHM Send : token unknown" << endl;
+			return false;
+		}
+		connection = value->second;
+	}
+	Segment* segment = connection.memory->segment;
+	uint64_t capacity = connection.server ? UpstreamRingSize : segment->capacity;
+	if (length > GetMaxMessageLength(capacity))
+	{
+		cerr << "SHM Message of " << length << " bytes doesn't fit in the ring" << endl;
+		return false;
+	}
+	SharedRing &ring = connection.server ? segment->GetSlot(connection.slot).upstream : segment->downstream;
+	while (true)
+	{
+		uint32_t seen = ring.consumed;
+		ring.writersleeping++;
+		bool sent;
+		{
+			unique_lock lock(writemutex);
+			sent = WriteMessage(connection, iov, iovcnt, length);
+		}
+		if (!sent)
+		{
+			//slow readers are waited for, dead ones are disconnected and stop holding the ring
+			FutexWait(&ring.consumed, seen, AliveCheckInterval);
+		}
+		ring.writersleeping--;
+		if (sent)
+		{
+			return true;
+		}
+		ReapPeers();
+		if (!token->IsConnected())
+		{
+			return false;
+		}
+	}
+}
+
+std::vector<std::shared_ptr<ConnectionToken>> SharedMemoryTransport::GetClients() const
+{
+	vector<shared_ptr<ConnectionToken>> clients;
+	shared_lock lock(listenmutex);
+	clients.reserve(connections.size());
+	for (auto &connection : connections)
+	{
+		if (connection.second.inbound)
+		{
+			clients.push_back(connection.first);
+		}
+	}
+	return clients;
+}
+
+std::pair<int, std::shared_ptr<ConnectionToken>> SharedMemoryTransport::ReceiveAny(void *buffer, int maxlength)
+{
+	AdoptClients();
+	ReapPeers();
+	vector<pair<shared_ptr<ConnectionToken>, shared_ptr<Channel>>> channels;
+	{
+		shared_lock lock(listenmutex);
+		channels.reserve(connections.size());
+		for (auto &connection : connections)
+		{
+			if (connection.second.inbound)
+			{
+				channels.emplace_back(connection.first, connection.second.inbound);
+			}
+		}
+	}
+	size_t start = nextreceive++;
+	for (size_t i = 0; i < channels.size(); i++)
+	{
+		auto &channel = channels[(start + i) % channels.size()];
+		int received = channel.second->Read(buffer, maxlength);
+		if (received > 0)
+		{
+			return {received, channel.first};
+		}
+		if (channel.second->IsBroken())
+		{
+			channel.first->Disconnect();
+		}
+	}
+	return {0, nullptr};
+}
+
+int SharedMemoryTransport::TrySendBatch(const Datagram* datagrams, int count)
+{
+	AdoptClients();
+	ReapPeers();
+	for (int i = 0; i < count; i++)
+	{
+		const Datagram &datagram = datagrams[i];
+		iovec single = {datagram.buffer, (size_t)datagram.length};
+		const iovec* iov = datagram.iov != nullptr ? datagram.iov : &single;
+		int iovcnt = datagram.iov != nullptr ? datagram.iovcnt : 1;
+		size_t length = 0;
+		for (int j = 0; j < iovcnt; j++)
+		{
+			length += iov[j].iov_len;
+		}
+		SharedMemoryConnection connection;
+		{
+			shared_lock lock(listenmutex);
+			auto value = connections.find(datagram.token);
+			if (value == connections.end())
+			{
+				return i;
+			}
+			connection = value->second;
+		}
+		uint64_t capacity = connection.server ? UpstreamRingSize : connection.memory->segment->capacity;
+		if (length > GetMaxMessageLength(capacity))
+		{
+			return i;
+		}
+		unique_lock lock(writemutex);
+		if (!WriteMessage(connection, iov, iovcnt, length))
+		{
+			return i;
+		}
+	}
+	return count;
+}
+
+bool SharedMemoryTransport::WaitForData(std::shared_ptr<ConnectionToken> token, std::chrono::microseconds timeout)
+{
+	shared_ptr<Channel> channel;
+	{
+		shared_lock lock(listenmutex);
+		auto value = connections.find(token);
+		if (value == connections.end() || !value->second.inbound)
+		{
+			return false;
+		}
+		channel = value->second.inbound;
+	}
+	return channel->Wait(timeout);
+}
+
+std::optional<int> SharedMemoryTransport::Receive(void* buffer, int maxlength, std::shared_ptr<ConnectionToken> token)
+{
+	if (!CheckToken(token))
+	{
+		return nullopt;
+	}
+	shared_ptr<Channel> channel;
+	{
+		shared_lock lock(listenmutex);
+		auto value = connections.find(token);
+		if (value == connections.end())
+		{
+			cerr << "SHM Receive : token unknown" << endl;
+			return nullopt;
+		}
+		channel = value->second.inbound;
+	}
+	if (!channel)
+	{
+		return 0;
+	}
+	int received = channel->Read(buffer, maxlength);
+	if (received == 0 && channel->IsBroken())
+	{
+		token->Disconnect();
+		return nullopt;
+	}
+	if (received == 0)
+	{
+		ReapPeers();
+		if (!token->IsConnected())
+		{
+			return nullopt;
+		}
+	}
+	return received;
+}
+
+std::optional<BufferLease> SharedMemoryTransport::ReceiveView(std::shared_ptr<ConnectionToken> token)
+{
+	if (!CheckToken(token))
+	{
+		return nullopt;
+	}
+	shared_ptr<Channel> channel;
+	{
+		shared_lock lock(listenmutex);
+		auto value = connections.find(token);
+		if (value == connections.end())
+		{
+			cerr << "SHM Receive : token unknown" << endl;
+			return nullopt;
+		}
+		channel = value->second.inbound;
+	}
+	if (!channel)
+	{
+		return BufferLease();
+	}
+	BufferLease lease = channel->Lend(channel);
+	if (lease.IsEmpty() && channel->IsBroken())
+	{
+		token->Disconnect();
+		return nullopt;
+	}
+	if (lease.IsEmpty())
+	{
+		ReapPeers();
+		if (!token->IsConnected())
+		{
+			return nullopt;
+		}
+	}
+	return lease;
+}
+
+bool SharedMemoryTransport::Send(const void* buffer, int length, std::shared_ptr<ConnectionToken> token)
+{
+	iovec iov = {const_cast<void*>(buffer), (size_t)length};
+	return Send(&iov, 1, token);
+}
+
+bool SharedMemoryTransport::Send(const iovec* iov, int iovcnt, std::shared_ptr<ConnectionToken> token)
+{
+	if (!CheckToken(token))
+	{
+		return false;
+	}
+	AdoptClients();
+	return SendMessage(token, iov, iovcnt);
+}
+
+void SharedMemoryTransport::DisconnectClient(std::shared_ptr<ConnectionToken> token)
+{
+	unique_lock lock(listenmutex);
+	auto value = connections.find(token);
+	if (value == connections.end())
+	{
+		cerr << "Token not found in connections while disconnecting !" << endl;
+		return;
+	}
+	SharedMemoryConnection &connection = value->second;
+	if (connection.slot >= 0)
+	{
+		ClientSlot &slot = connection.memory->segment->GetSlot(connection.slot);
+		if (connection.server)
+		{
+			slot.Leave(connection.generation);
+			cout << "SHM Server " << token->GetConnectionName() << " disconnected." << endl;
+		}
+		else
+		{
+			//the client may still be reading, the slot is freed once it noticed
+			slottokens[connection.slot] = nullptr;
+			slot.state = Closed;
+			cout << "SHM Client " << token->GetConnectionName() << " disconnected." << endl;
+		}
+	}
+	connections.erase(value);
+}
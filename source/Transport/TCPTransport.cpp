@@ -1,5 +1,6 @@
 #include "Transport/TCPTransport.hpp"
 #include <Transport/ConnectionToken.hpp>
+#include <Transport/EventLoop.hpp>
 
 #include <iostream>
 #include <filesystem>
@@ -11,21 +12,33 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <poll.h>
 
 #include <mutex>
 #include <Transport/thread-rename.hpp>
 
 using namespace std;
 
-TCPTransport::TCPTransport(bool inServer, string inIP, int inPort, string inInterface)
+TCPTransport::TCPTransport(bool inServer, string inIP, int inPort, string inInterface, IOBackend inBackend, Framing inFraming)
 	: GenericTransport()
 {	
 	Server = inServer;
+	MessageFraming = inFraming;
+	MaxQueuedBytes = DefaultMaxQueuedBytes;
 	IP = inIP;
 	Port = inPort;
 	Interface = inInterface;
 	sockfd = -1;
 	Connected = false;
+	if (inBackend == IOBackend::IOUring)
+	{
+		Ring = IOUring::Create();
+		if (!Ring)
+		{
+			cerr << "TCP io_uring unavailable, using sockets" << endl;
+		}
+	}
 	CreateSocket();
 	Connect();
 
@@ -35,11 +48,15 @@ TCPTransport::TCPTransport(bool inServer, string inIP, int inPort, string inInte
 TCPTransport::~TCPTransport()
 {
 	cout << "Destroying TCP transport " << IP << ":" << Port << " @ " << Interface <<endl;
-	for (auto &connection : connections)
+	DetachEventLoop();
+	//Disconnect erases from connections, don't iterate over it directly
+	for (auto &token : GetClients())
 	{
-		shutdown(connection.second.filedescriptor, SHUT_RDWR);
-		close(connection.second.filedescriptor);
-		connection.first->Disconnect();
+		{
+			shared_lock lock(listenmutex);
+			shutdown(connections.at(token).filedescriptor, SHUT_RDWR);
+		}
+		token->Disconnect(); //closes the socket
 	}
 	if (sockfd != -1)
 	{
@@ -107,6 +124,11 @@ bool TCPTransport::Connect()
 			cerr << "TCP Can't listen !" << endl;
 		}
 		Connected = true;
+		if (Ring)
+		{
+			Ring->AcceptMultishot(sockfd, AcceptRingId);
+			Ring->Submit();
+		}
 		return true;
 	}
 	else
@@ -124,7 +146,17 @@ bool TCPTransport::Connect()
 		connection.address = serverAddress;
 		connection.filedescriptor = sockfd;
 		auto token = make_shared<ConnectionToken>(ip, this);
-		connections[token] = connection;
+		unique_lock lock(listenmutex);
+		auto &added = connections[token] = connection;
+		if (Ring)
+		{
+			ArmReceive(token, added);
+			Ring->Submit();
+		}
+		else if (Loop)
+		{
+			WatchConnection(token, sockfd);
+		}
 		return true;
 	}
 }
@@ -178,6 +210,10 @@ std::optional<int> TCPTransport::Receive(void* buffer, int maxlength, std::share
 	{
 		return false;
 	}
+	if (MessageFraming == Framing::LengthPrefixed)
+	{
+		return ReceiveFramed(buffer, maxlength, token);
+	}
 	int fd;
 	{
 		shared_lock lock(listenmutex);
@@ -189,6 +225,38 @@ std::optional<int> TCPTransport::Receive(void* buffer, int maxlength, std::share
 		}
 		fd = value->second.filedescriptor;
 	}
+	if (Ring)
+	{
+		PumpRing();
+		unique_lock lock(listenmutex);
+		auto value = connections.find(token);
+		if (value == connections.end())
+		{
+			return nullopt;
+		}
+		TCPConnection &connection = value->second;
+		int available = connection.inbound.size() - connection.inboundread;
+		if (available > 0)
+		{
+			int size = std::min(available, maxlength);
+			memcpy(buffer, connection.inbound.data() + connection.inboundread, size);
+			connection.inboundread += size;
+			if (connection.inboundread == connection.inbound.size())
+			{
+				connection.inbound.clear();
+				connection.inboundread = 0;
+			}
+			ResumeReceive(token, connection);
+			return size;
+		}
+		if (!connection.closed)
+		{
+			return 0;
+		}
+		lock.unlock();
+		token->Disconnect();
+		return nullopt;
+	}
 	int numreceived = recv(fd, buffer, maxlength, MSG_DONTWAIT);
 	if (numreceived <= 0)
 	{
@@ -210,34 +278,409 @@ std::optional<int> TCPTransport::Receive(void* buffer, int maxlength, std::share
 	return numreceived;
 }
 
+void TCPTransport::ReceiveRing::Peek(size_t offset, void* destination, size_t length) const
+{
+	size_t position = (start + offset) & (data.size() - 1);
+	size_t first = min(length, data.size() - position);
+	memcpy(destination, data.data() + position, first);
+	memcpy(reinterpret_cast<uint8_t*>(destination) + first, data.data(), length - first);
+}
+
+void TCPTransport::ReceiveRing::Reserve(size_t size)
+{
+	if (size <= data.size())
+	{
+		return;
+	}
+	size_t capacity = max<size_t>(data.size(), MinimumRead);
+	while (capacity < size)
+	{
+		capacity *= 2;
+	}
+	vector<uint8_t> grown(capacity);
+	if (used > 0)
+	{
+		Peek(0, grown.data(), used);
+	}
+	data.swap(grown);
+	start = 0;
+}
+
+void TCPTransport::ReceiveRing::Write(const uint8_t* source, size_t length)
+{
+	Reserve(used + length);
+	size_t position = (start + used) & (data.size() - 1);
+	size_t first = min(length, data.size() - position);
+	memcpy(data.data() + position, source, first);
+	memcpy(data.data(), source + first, length - first);
+	used += length;
+}
+
+int TCPTransport::ReceiveRing::GetFreeRegions(iovec regions[2])
+{
+	size_t position = (start + used) & (data.size() - 1);
+	size_t available = data.size() - used;
+	size_t first = min(available, data.size() - position);
+	regions[0].iov_base = data.data() + position;
+	regions[0].iov_len = first;
+	regions[1].iov_base = data.data();
+	regions[1].iov_len = available - first;
+	return regions[1].iov_len > 0 ? 2 : 1;
+}
+
+int TCPTransport::PopMessage(ReceiveRing &ring, void* buffer, int maxlength)
+{
+	uint32_t header;
+	if (ring.used < sizeof(header))
+	{
+		return -1;
+	}
+	ring.Peek(0, &header, sizeof(header));
+	size_t length = ntohl(header);
+	if (length > MaxMessageSize)
+	{
+		return -2;
+	}
+	if (ring.used < sizeof(header) + length)
+	{
+		//have the whole message fit, so that the next reads can complete it
+		ring.Reserve(sizeof(header) + length);
+		return -1;
+	}
+	size_t copied = min<size_t>(length, maxlength);
+	ring.Peek(sizeof(header), buffer, copied);
+	ring.start = (ring.start + sizeof(header) + length) & (ring.data.size() - 1);
+	ring.used -= sizeof(header) + length;
+	return copied;
+}
+
+std::optional<int> TCPTransport::ReceiveFramed(void* buffer, int maxlength, std::shared_ptr<ConnectionToken> token)
+{
+	if (Ring)
+	{
+		PumpRing();
+	}
+	int fd;
+	shared_ptr<ReceiveRing> framed;
+	{
+		unique_lock lock(listenmutex);
+		auto value = connections.find(token);
+		if (value == connections.end())
+		{
+			cerr << "Token not found in connections while receiving !" << endl;
+			return nullopt;
+		}
+		TCPConnection &connection = value->second;
+		if (!connection.framed)
+		{
+			connection.framed = make_shared<ReceiveRing>();
+		}
+		fd = connection.filedescriptor;
+		framed = connection.framed;
+	}
+	lock_guard ringlock(framed->ringmutex);
+	int length = PopMessage(*framed, buffer, maxlength);
+	if (Ring)
+	{
+		if (length == -1)
+		{
+			//the ring already read the socket, only the messages have to be cut out
+			//inbound is taken once the buffered messages ran out, so that it fills up when the reader is behind
+			bool closed;
+			{
+				unique_lock lock(listenmutex);
+				auto value = connections.find(token);
+				if (value == connections.end())
+				{
+					return nullopt;
+				}
+				TCPConnection &connection = value->second;
+				framed->Write(connection.inbound.data() + connection.inboundread, connection.inbound.size() - connection.inboundread);
+				connection.inbound.clear();
+				connection.inboundread = 0;
+				closed = connection.closed;
+				ResumeReceive(token, connection);
+			}
+			length = PopMessage(*framed, buffer, maxlength);
+			if (length == -1 && closed)
+			{
+				token->Disconnect();
+				return nullopt;
+			}
+		}
+	}
+	else
+	{
+		//read until a whole message is in or the socket is empty, an edge triggered caller won't be told about what is left
+		while (length == -1)
+		{
+			//read as much as there is room for, it may hold many messages
+			framed->Reserve(framed->used + MinimumRead);
+			iovec regions[2];
+			msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = regions;
+			msg.msg_iovlen = framed->GetFreeRegions(regions);
+			int numreceived = recvmsg(fd, &msg, MSG_DONTWAIT);
+			if (numreceived == 0 || (numreceived == -1 && errno != EAGAIN && errno != EWOULDBLOCK))
+			{
+				//got disconnected
+				token->Disconnect();
+				return nullopt;
+			}
+			if (numreceived == -1)
+			{
+				break;
+			}
+			framed->used += numreceived;
+			length = PopMessage(*framed, buffer, maxlength);
+		}
+	}
+	if (length == -2)
+	{
+		cerr << "TCP " << token->GetConnectionName() << " sent a message larger than " << MaxMessageSize << " bytes, disconnecting" << endl;
+		token->Disconnect();
+		return nullopt;
+	}
+	if (!token->IsConnected())
+	{
+		return nullopt;
+	}
+	return max(length, 0);
+}
 
 bool TCPTransport::Send(const void* buffer, int length,  std::shared_ptr<ConnectionToken> token)
+{
+	iovec io_buf;
+	io_buf.iov_base = const_cast<void*>(buffer);
+	io_buf.iov_len = length;
+	return Send(&io_buf, 1, token);
+}
+
+bool TCPTransport::Send(const iovec* iov, int iovcnt, std::shared_ptr<ConnectionToken> token)
 {
 	if (!CheckToken(token))
 	{
 		return false;
 	}
-	int fd = 0;
+	int fd;
+	auto queue = GetSendQueue(token, fd);
+	if (!queue)
 	{
-		shared_lock lock(listenmutex);
-		auto value = connections.find(token);
-		if (value == connections.end())
+		cerr << "Token not found in connections while sending !" << endl;
+		return false;
+	}
+	uint32_t header;
+	vector<iovec> framed;
+	if (MessageFraming == Framing::LengthPrefixed)
+	{
+		size_t length = 0;
+		for (int i = 0; i < iovcnt; i++)
+		{
+			length += iov[i].iov_len;
+		}
+		if (length > MaxMessageSize)
 		{
-			cerr << "Token not found in connections while sending !" << endl;
+			cerr << "TCP Can't send " << length << " bytes, messages are limited to " << MaxMessageSize << endl;
 			return false;
 		}
-		fd = value->second.filedescriptor;
+		header = htonl(length);
+		framed.reserve(iovcnt + 1);
+		framed.push_back({&header, sizeof(header)});
+		framed.insert(framed.end(), iov, iov + iovcnt);
+		iov = framed.data();
+		iovcnt = framed.size();
+	}
+	size_t length = 0;
+	for (int i = 0; i < iovcnt; i++)
+	{
+		length += iov[i].iov_len;
 	}
-	int numsent = send(fd, buffer, length, MSG_NOSIGNAL);
-	int errnocp = errno;
-	if (numsent == -1 && (errnocp != EAGAIN && errnocp != EWOULDBLOCK))
+	lock_guard lock(queue->queuemutex);
+	bool ok = true;
+	size_t numsent = 0;
+	if (queue->queued == 0)
+	{
+		//nothing ahead of us, try writing directly
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(struct msghdr));
+		msg.msg_iov = const_cast<iovec*>(iov);
+		msg.msg_iovlen = iovcnt;
+		int result = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (result >= 0)
+		{
+			numsent = result;
+		}
+		else if (errno != EAGAIN && errno != EWOULDBLOCK)
+		{
+			ok = false;
+		}
+	}
+	if (ok && numsent < length)
+	{
+		if (numsent == 0 && queue->queued + length > MaxQueuedBytes)
+		{
+			//dropping a whole message keeps the stream intact
+			queue->dropped++;
+			return true;
+		}
+		//keep what the socket didn't take, a message started has to be finished
+		vector<uint8_t> rest;
+		rest.reserve(length - numsent);
+		size_t skip = numsent;
+		for (int i = 0; i < iovcnt; i++)
+		{
+			const uint8_t* base = reinterpret_cast<const uint8_t*>(iov[i].iov_base);
+			size_t skipped = min(skip, iov[i].iov_len);
+			rest.insert(rest.end(), base + skipped, base + iov[i].iov_len);
+			skip -= skipped;
+		}
+		queue->queued += rest.size();
+		queue->chunks.push_back(std::move(rest));
+		ok = FlushQueue(*queue, fd);
+	}
+	if (!ok)
 	{
 		//got disconnected
 		token->Disconnect();
 	}
+	else if (Ring && queue->queued > 0)
+	{
+		PollWritable(token);
+	}
 	return token->IsConnected();
 }
 
+std::shared_ptr<TCPTransport::SendQueue> TCPTransport::GetSendQueue(const std::shared_ptr<ConnectionToken> &token, int &fd) const
+{
+	shared_lock lock(listenmutex);
+	auto value = connections.find(token);
+	if (value == connections.end())
+	{
+		return nullptr;
+	}
+	fd = value->second.filedescriptor;
+	return value->second.outbound;
+}
+
+bool TCPTransport::FlushQueue(SendQueue &queue, int fd)
+{
+	while (queue.queued > 0)
+	{
+		//small messages go out together
+		iovec iov[MaxFlushChunks];
+		int iovcnt = 0;
+		for (auto chunk = queue.chunks.begin(); chunk != queue.chunks.end() && iovcnt < MaxFlushChunks; chunk++, iovcnt++)
+		{
+			size_t offset = iovcnt == 0 ? queue.sentfront : 0;
+			iov[iovcnt].iov_base = chunk->data() + offset;
+			iov[iovcnt].iov_len = chunk->size() - offset;
+		}
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(struct msghdr));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+		int numsent = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (numsent == -1)
+		{
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		}
+		queue.queued -= numsent;
+		size_t written = numsent + queue.sentfront;
+		while (queue.chunks.size() > 0 && written >= queue.chunks.front().size())
+		{
+			written -= queue.chunks.front().size();
+			queue.chunks.pop_front();
+		}
+		queue.sentfront = written;
+	}
+	return true;
+}
+
+bool TCPTransport::Flush(std::shared_ptr<ConnectionToken> token)
+{
+	if (!CheckToken(token))
+	{
+		return false;
+	}
+	int fd;
+	auto queue = GetSendQueue(token, fd);
+	if (!queue)
+	{
+		return false;
+	}
+	bool ok, queued;
+	{
+		lock_guard lock(queue->queuemutex);
+		ok = FlushQueue(*queue, fd);
+		queued = queue->queued > 0;
+	}
+	if (!ok)
+	{
+		token->Disconnect();
+	}
+	else if (Ring && queued)
+	{
+		PollWritable(token);
+	}
+	return token->IsConnected();
+}
+
+size_t TCPTransport::GetQueuedBytes(std::shared_ptr<ConnectionToken> token) const
+{
+	int fd;
+	auto queue = GetSendQueue(token, fd);
+	if (!queue)
+	{
+		return 0;
+	}
+	lock_guard lock(queue->queuemutex);
+	return queue->queued;
+}
+
+uint64_t TCPTransport::GetDroppedMessages(std::shared_ptr<ConnectionToken> token) const
+{
+	int fd;
+	auto queue = GetSendQueue(token, fd);
+	if (!queue)
+	{
+		return 0;
+	}
+	lock_guard lock(queue->queuemutex);
+	return queue->dropped;
+}
+
+void TCPTransport::SetMaxQueuedBytes(size_t inMaxQueuedBytes)
+{
+	MaxQueuedBytes = inMaxQueuedBytes;
+}
+
+int TCPTransport::TrySendBatch(const Datagram* datagrams, int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		const Datagram &datagram = datagrams[i];
+		//a connection that couldn't write everything yet would only queue more
+		if (!Flush(datagram.token) || GetQueuedBytes(datagram.token) > 0)
+		{
+			return i;
+		}
+		iovec single = {datagram.buffer, (size_t)datagram.length};
+		const iovec* iov = datagram.iov != nullptr ? datagram.iov : &single;
+		int iovcnt = datagram.iov != nullptr ? datagram.iovcnt : 1;
+		if (!Send(iov, iovcnt, datagram.token))
+		{
+			return i;
+		}
+	}
+	return count;
+}
+
+
+void TCPTransport::SetFraming(Framing inFraming)
+{
+	MessageFraming = inFraming;
+}
 
 vector<shared_ptr<ConnectionToken>> TCPTransport::AcceptNewConnections()
 {
@@ -247,6 +690,13 @@ vector<shared_ptr<ConnectionToken>> TCPTransport::AcceptNewConnections()
 	}
 	vector<shared_ptr<ConnectionToken>> newconnections;
 	CheckConnection();
+	if (Ring)
+	{
+		PumpRing();
+		unique_lock lock(listenmutex);
+		newconnections.swap(ringaccepted);
+		return newconnections;
+	}
 	while (1)
 	{
 		TCPConnection connection;
@@ -255,32 +705,8 @@ vector<shared_ptr<ConnectionToken>> TCPTransport::AcceptNewConnections()
 		connection.filedescriptor = accept4(sockfd, (struct sockaddr *)&connection.address, &clientSize, 0);
 		if (connection.filedescriptor > 0)
 		{
-			//LowerLatency(ret);
-			char buffer[16];
-			inet_ntop(AF_INET, &connection.address.sin_addr, buffer, sizeof(buffer));
-			buffer[sizeof(buffer)-1] = 0;
-			connection.name = string(buffer, strlen(buffer));
-			cout << "TCP Client connecting from " << connection.name << " fd=" << connection.filedescriptor << endl;
-			int num_connections_from_same_ip = 0;
-			{
-				shared_lock lock(listenmutex);
-				for (auto &already : connections)
-				{
-					if (already.second.name == connection.name)
-					{
-						num_connections_from_same_ip++;
-					}
-				}
-				if (num_connections_from_same_ip > 0)
-				{
-					cerr << "Warning: " << connection.name << " is already connected " << num_connections_from_same_ip << " times" << endl;
-				}
-			}
-			
 			unique_lock lock(listenmutex);
-			auto token = make_shared<ConnectionToken>(connection.name, this);
-			connections[token] = connection;
-			newconnections.push_back(token);
+			newconnections.push_back(AddClient(connection));
 		}
 		else 
 		{
@@ -299,6 +725,216 @@ vector<shared_ptr<ConnectionToken>> TCPTransport::AcceptNewConnections()
 	return newconnections;
 }
 
+shared_ptr<ConnectionToken> TCPTransport::AddClient(const TCPConnection &inconnection)
+{
+	TCPConnection connection = inconnection;
+	//LowerLatency(ret);
+	char buffer[16];
+	inet_ntop(AF_INET, &connection.address.sin_addr, buffer, sizeof(buffer));
+	buffer[sizeof(buffer)-1] = 0;
+	connection.name = string(buffer, strlen(buffer));
+	cout << "TCP Client connecting from " << connection.name << " fd=" << connection.filedescriptor << endl;
+	int num_connections_from_same_ip = 0;
+	for (auto &already : connections)
+	{
+		if (already.second.name == connection.name)
+		{
+			num_connections_from_same_ip++;
+		}
+	}
+	if (num_connections_from_same_ip > 0)
+	{
+		cerr << "Warning: " << connection.name << " is already connected " << num_connections_from_same_ip << " times" << endl;
+	}
+	
+	auto token = make_shared<ConnectionToken>(connection.name, this);
+	auto &added = connections[token] = connection;
+	if (Ring)
+	{
+		ArmReceive(token, added);
+	}
+	else if (Loop)
+	{
+		WatchConnection(token, connection.filedescriptor);
+	}
+	return token;
+}
+
+void TCPTransport::ArmReceive(const std::shared_ptr<ConnectionToken> &token, TCPConnection &connection)
+{
+	if (connection.ringid == 0)
+	{
+		connection.ringid = nextringid++;
+		ringtokens[connection.ringid] = token;
+	}
+	Ring->RecvMultishot(connection.filedescriptor, connection.ringid);
+	connection.armed = true;
+}
+
+void TCPTransport::PollWritable(const std::shared_ptr<ConnectionToken> &token)
+{
+	unique_lock lock(listenmutex);
+	auto value = connections.find(token);
+	if (value == connections.end() || value->second.writepolled || value->second.ringid == 0)
+	{
+		return;
+	}
+	TCPConnection &connection = value->second;
+	if (Ring->PollAdd(connection.filedescriptor, POLLOUT, connection.ringid | WritableRingFlag))
+	{
+		connection.writepolled = true;
+		Ring->Submit();
+	}
+}
+
+void TCPTransport::ResumeReceive(const std::shared_ptr<ConnectionToken> &token, TCPConnection &connection)
+{
+	if (!connection.paused || connection.inbound.size() - connection.inboundread > MaxInboundBytes / 2)
+	{
+		return;
+	}
+	connection.paused = false;
+	if (!connection.armed && !connection.closed)
+	{
+		//otherwise it's rearmed when its cancellation completes
+		ArmReceive(token, connection);
+		Ring->Submit();
+	}
+}
+
+void TCPTransport::PumpRing()
+{
+	bool rearmed = false;
+	vector<shared_ptr<ConnectionToken>> writable;
+	Ring->Reap([this, &rearmed, &writable](const IOUring::Completion &completion)
+	{
+		unique_lock lock(listenmutex);
+		if (completion.userdata & WritableRingFlag)
+		{
+			auto ringtoken = ringtokens.find(completion.userdata & ~WritableRingFlag);
+			if (ringtoken == ringtokens.end())
+			{
+				return;
+			}
+			auto value = connections.find(ringtoken->second);
+			if (value != connections.end())
+			{
+				//flushed once the ring is released, errors show up there
+				value->second.writepolled = false;
+				writable.push_back(ringtoken->second);
+			}
+			return;
+		}
+		if (completion.userdata == AcceptRingId)
+		{
+			if (completion.result >= 0)
+			{
+				TCPConnection connection;
+				connection.filedescriptor = completion.result;
+				socklen_t clientSize = sizeof(connection.address);
+				bzero(&connection.address, clientSize);
+				getpeername(connection.filedescriptor, (struct sockaddr *)&connection.address, &clientSize);
+				ringaccepted.push_back(AddClient(connection));
+				rearmed = true; //the new client's receive needs submitting
+			}
+			else
+			{
+				cerr << "TCP Unhandled error on accept: " << strerror(-completion.result) << endl;
+			}
+			if (!completion.more && completion.result != -ECANCELED)
+			{
+				Ring->AcceptMultishot(sockfd, AcceptRingId);
+				rearmed = true;
+			}
+			return;
+		}
+		auto ringtoken = ringtokens.find(completion.userdata);
+		if (ringtoken == ringtokens.end())
+		{
+			//late completion of a disconnected client
+			return;
+		}
+		auto value = connections.find(ringtoken->second);
+		if (value == connections.end())
+		{
+			return;
+		}
+		TCPConnection &connection = value->second;
+		if (completion.result > 0)
+		{
+			connection.inbound.insert(connection.inbound.end(), completion.buffer, completion.buffer + completion.result);
+			if (!connection.paused && connection.inbound.size() - connection.inboundread > MaxInboundBytes)
+			{
+				//the reader is behind, leave the data in the socket so that the sender slows down
+				connection.paused = true;
+				Ring->Cancel(connection.ringid);
+				rearmed = true;
+			}
+		}
+		else if (completion.result != -ENOBUFS && completion.result != -ECANCELED)
+		{
+			//end of stream, or the socket failed
+			connection.closed = true;
+		}
+		if (!completion.more)
+		{
+			connection.armed = false;
+		}
+		if (!completion.more && !connection.closed && !connection.paused)
+		{
+			//ran out of provided buffers or was resumed, start over
+			ArmReceive(ringtoken->second, connection);
+			rearmed = true;
+		}
+	});
+	if (rearmed)
+	{
+		Ring->Submit();
+	}
+	for (auto &token : writable)
+	{
+		//polls again if the socket still can't take everything
+		if (Flush(token) && GetQueuedBytes(token) == 0 && Loop)
+		{
+			unique_lock lock(listenmutex);
+			ringwritable.push_back(token);
+		}
+	}
+}
+
+void TCPTransport::NotifyRingEvents()
+{
+	PumpRing();
+	vector<shared_ptr<ConnectionToken>> accepted, readable, writable;
+	{
+		unique_lock lock(listenmutex);
+		accepted.swap(ringaccepted);
+		writable.swap(ringwritable);
+		for (auto &connection : connections)
+		{
+			if (connection.second.inbound.size() > connection.second.inboundread || connection.second.closed)
+			{
+				readable.push_back(connection.first);
+			}
+		}
+	}
+	for (auto &token : accepted)
+	{
+		OnEvent(token, TransportEvent::Accepted);
+	}
+	for (auto &token : readable)
+	{
+		OnEvent(token, TransportEvent::Readable);
+	}
+	for (auto &token : writable)
+	{
+		if (token->IsConnected())
+		{
+			OnEvent(token, TransportEvent::Writable);
+		}
+	}
+}
+
 void TCPTransport::DisconnectClient(std::shared_ptr<ConnectionToken> token)
 {
 	unique_lock lock(listenmutex);
@@ -309,6 +945,20 @@ void TCPTransport::DisconnectClient(std::shared_ptr<ConnectionToken> token)
 		return;
 	}
 	
+	if (Ring && value->second.ringid != 0)
+	{
+		ringtokens.erase(value->second.ringid);
+		Ring->Cancel(value->second.ringid);
+		if (value->second.writepolled)
+		{
+			Ring->Cancel(value->second.ringid | WritableRingFlag);
+		}
+		Ring->Submit();
+	}
+	if (Loop && !Ring)
+	{
+		Loop->Remove(value->second.filedescriptor);
+	}
 	DeleteSocket(value->second.filedescriptor);
 	if (Server)
 	{
@@ -321,4 +971,84 @@ void TCPTransport::DisconnectClient(std::shared_ptr<ConnectionToken> token)
 	}
 	
 	connections.erase(value);
+}
+
+bool TCPTransport::AttachEventLoop(EventLoop* loop, EventCallback callback)
+{
+	DetachEventLoop();
+	unique_lock lock(listenmutex);
+	Loop = loop;
+	OnEvent = callback;
+	if (Ring)
+	{
+		//the ring does the socket work, it only has to be reaped
+		return Loop->Add(Ring->GetFileDescriptor(), EPOLLIN, [this](uint32_t events)
+		{
+			(void)events;
+			NotifyRingEvents();
+		});
+	}
+	if (Server && sockfd != -1)
+	{
+		//new clients are watched as soon as they're accepted
+		Loop->Add(sockfd, EPOLLIN, [this](uint32_t events)
+		{
+			(void)events;
+			for (auto &token : AcceptNewConnections())
+			{
+				OnEvent(token, TransportEvent::Accepted);
+			}
+		});
+	}
+	for (auto &connection : connections)
+	{
+		WatchConnection(connection.first, connection.second.filedescriptor);
+	}
+	return true;
+}
+
+void TCPTransport::DetachEventLoop()
+{
+	unique_lock lock(listenmutex);
+	if (!Loop)
+	{
+		return;
+	}
+	if (Ring)
+	{
+		Loop->Remove(Ring->GetFileDescriptor());
+		Loop = nullptr;
+		return;
+	}
+	if (Server && sockfd != -1)
+	{
+		Loop->Remove(sockfd);
+	}
+	for (auto &connection : connections)
+	{
+		Loop->Remove(connection.second.filedescriptor);
+	}
+	Loop = nullptr;
+}
+
+void TCPTransport::WatchConnection(const std::shared_ptr<ConnectionToken> &token, int fd)
+{
+	weak_ptr<ConnectionToken> weaktoken = token;
+	Loop->Add(fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP, [this, weaktoken](uint32_t events)
+	{
+		auto token = weaktoken.lock();
+		if (!token)
+		{
+			return;
+		}
+		//hangups and errors show up as a failed receive
+		if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+		{
+			OnEvent(token, TransportEvent::Readable);
+		}
+		if (events & EPOLLOUT && token->IsConnected() && Flush(token))
+		{
+			OnEvent(token, TransportEvent::Writable);
+		}
+	});
 }
\ No newline at end of file
@@ -12,12 +12,18 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <Transport/ConnectionToken.hpp>
+#include <Transport/EventLoop.hpp>
+#include <sys/epoll.h>
+#include <linux/io_uring.h>
 
 using namespace std;
 
-UDPTransport::UDPTransport(int inPort, optional<NetworkInterface> inInterface)
+UDPTransport::UDPTransport(int inPort, optional<NetworkInterface> inInterface,
+	int inBacklogCapacity, OverflowPolicy inOverflow, int inPoolBuffers, IOBackend inBackend)
 	:GenericTransport(),
-	Interface(inInterface), Port(inPort)
+	Interface(inInterface), Port(inPort),
+	pool(make_shared<BufferPool>(UINT16_MAX, inPoolBuffers)),
+	BacklogCapacity(inBacklogCapacity), Overflow(inOverflow)
 {
 	sockfd = socket(AF_INET, SOCK_DGRAM, 0);
 	if (sockfd == -1)
@@ -49,11 +55,27 @@ UDPTransport::UDPTransport(int inPort, optional<NetworkInterface> inInterface)
 		cerr << "UDP Can't bind to IP/port, " << strerror(errno) << endl;
 	}
 	Connected = true;
+	if (inBackend == IOBackend::IOUring)
+	{
+		Ring = IOUring::Create();
+		if (!Ring)
+		{
+			cerr << "UDP io_uring unavailable, using sockets" << endl;
+		}
+	}
+	if (Ring)
+	{
+		memset(&ringmessage, 0, sizeof(ringmessage));
+		ringmessage.msg_namelen = sizeof(sockaddr_in);
+		Ring->RecvMsgMultishot(sockfd, &ringmessage, ReceiveRingId);
+		Ring->Submit();
+	}
 	//ReceiveThreadHandle = new thread(&UDPTransport::receiveThread, this);
 }
 
 UDPTransport::~UDPTransport()
 {
+	DetachEventLoop();
 	if (sockfd != -1)
 	{
 		close(sockfd);
@@ -79,18 +101,16 @@ std::shared_ptr<ConnectionToken> UDPTransport::Connect(std::string address)
 	}
 	inet_pton(AF_INET, address.c_str(), &connectionaddress.sin_addr);
 
-	std::shared_ptr<ConnectionToken> token;
-	for (auto &&i : connections)
+	std::shared_ptr<ConnectionToken> token = peers.Find(connectionaddress);
+	if (token)
 	{
-		if (memcmp(&i.second.address.sin_addr, &connectionaddress.sin_addr, sizeof(connectionaddress.sin_addr)) == 0)
-		{
-			return i.first;
-		}
+		return token;
 	}
 	token = make_shared<ConnectionToken>(address, this);
 	UDPConnection value;
 	value.address = connectionaddress;
 	connections[token] = value;
+	peers.Insert(connectionaddress, token);
 	return token;
 }
 
@@ -100,18 +120,16 @@ std::shared_ptr<ConnectionToken> UDPTransport::Connect(sockaddr_in address)
 	char ipbuf[16];
 	inet_ntop(AF_INET, &address.sin_addr, ipbuf, sizeof(ipbuf));
 
-	std::shared_ptr<ConnectionToken> token;
-	for (auto &&i : connections)
+	std::shared_ptr<ConnectionToken> token = peers.Find(address);
+	if (token)
 	{
-		if (memcmp(&i.second.address.sin_addr, &address.sin_addr, sizeof(address.sin_addr)) == 0)
-		{
-			return i.first;
-		}
+		return token;
 	}
 	token = make_shared<ConnectionToken>(string(ipbuf), this);
 	UDPConnection value;
 	value.address = address;
 	connections[token] = value;
+	peers.Insert(address, token);
 	return token;
 }
 
@@ -129,20 +147,13 @@ std::vector<std::shared_ptr<ConnectionToken>> UDPTransport::GetClients() const
 
 std::pair<int, std::shared_ptr<ConnectionToken>> UDPTransport::ReceiveBacklog(void *buffer, int maxlength)
 {
-	shared_lock lock(listenmutex);
+	unique_lock lock(listenmutex);
 	for (auto &&i : connections)
 	{
-		if (i.second.payloads.size() > 0)
+		auto entry = PopBacklog(i.second);
+		if (entry.has_value())
 		{
-			auto payload = i.second.payloads.front();
-			if (payload.size() > maxlength)
-			{
-				cerr << "UDP receive : Not enough space to evacuate past payload ! Truncating !" << endl;
-			}
-			size_t size = std::min<size_t>(payload.size(), maxlength);
-			memcpy(buffer, payload.data(), size);
-			i.second.payloads.pop_front();
-			return {size, i.first};
+			return {EvacuateBacklog(entry.value(), buffer, maxlength), i.first};
 		}
 	}
 	return {0, nullptr};
@@ -150,113 +161,609 @@ std::pair<int, std::shared_ptr<ConnectionToken>> UDPTransport::ReceiveBacklog(vo
 
 std::pair<int, std::shared_ptr<ConnectionToken>> UDPTransport::ReceiveFresh(void *buffer, int maxlength)
 {
-	shared_lock lock(listenmutex);
 	sockaddr_in connectionaddress;
 	socklen_t clientSize = sizeof(connectionaddress);
 	int n;
 	if ((n = recvfrom(sockfd, buffer, maxlength, MSG_DONTWAIT, (struct sockaddr*)&connectionaddress, &clientSize)) > 0)
 	{
-		for (auto &&i : connections)
-		{
-			if (memcmp(&i.second.address.sin_addr, &connectionaddress.sin_addr, sizeof(connectionaddress.sin_addr)) == 0)
-			{
-				return {n, i.first};
-			}
-		}
-		//release shared lock for an unique lock on connect
-		lock.unlock();
-		lock.release();
-		char ipbuf[16];
-		inet_ntop(AF_INET, &connectionaddress.sin_addr, ipbuf, clientSize);
-		auto token = Connect(connectionaddress);
-		cout << "UDP Client connecting from " << ipbuf << endl;
-		return {n, token};
+		return {n, ResolveSender(connectionaddress)};
 	}
 	return {0, nullptr};
 }
 
 std::pair<int, std::shared_ptr<ConnectionToken>> UDPTransport::ReceiveAny(void *buffer, int maxlength)
 {
+	if (Ring)
+	{
+		//the socket belongs to the ring
+		PumpRing();
+		return ReceiveBacklog(buffer, maxlength);
+	}
 	auto Backlog = ReceiveBacklog(buffer, maxlength);
 	if (Backlog.second != nullptr)
 	{
 		return Backlog;
 	}
+	//pull a whole batch in, then serve from the backlogs
+	DrainSocket(nullptr, nullptr, 0);
+	Backlog = ReceiveBacklog(buffer, maxlength);
+	if (Backlog.second != nullptr)
+	{
+		return Backlog;
+	}
 	return ReceiveFresh(buffer, maxlength);
 }
 
+int UDPTransport::ReceiveBatch(Datagram* datagrams, int count)
+{
+	int received = 0;
+	while (received < count)
+	{
+		int batch = std::min(count - received, BatchSize);
+		mmsghdr messages[BatchSize];
+		iovec iovecs[BatchSize];
+		sockaddr_in addresses[BatchSize];
+		memset(messages, 0, sizeof(mmsghdr) * batch);
+		for (int i = 0; i < batch; i++)
+		{
+			Datagram &datagram = datagrams[received + i];
+			iovecs[i].iov_base = datagram.buffer;
+			iovecs[i].iov_len = datagram.maxlength;
+			messages[i].msg_hdr.msg_iov = &iovecs[i];
+			messages[i].msg_hdr.msg_iovlen = 1;
+			messages[i].msg_hdr.msg_name = &addresses[i];
+			messages[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+		}
+		int n = recvmmsg(sockfd, messages, batch, MSG_DONTWAIT, nullptr);
+		if (n <= 0)
+		{
+			if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				cerr << "UDP Failed to receive batch : " << errno << "(" << strerror(errno) << ")" << endl;
+			}
+			break;
+		}
+		for (int i = 0; i < n; i++)
+		{
+			Datagram &datagram = datagrams[received + i];
+			if (messages[i].msg_hdr.msg_flags & MSG_TRUNC)
+			{
+				cerr << "UDP receive : Not enough space for datagram ! Truncating !" << endl;
+			}
+			datagram.length = messages[i].msg_len;
+			datagram.token = ResolveSender(addresses[i]);
+		}
+		received += n;
+		if (n < batch)
+		{
+			//socket drained
+			break;
+		}
+	}
+	return received;
+}
+
+int UDPTransport::SendBatch(const Datagram* datagrams, int count)
+{
+	return SendMessages(datagrams, count, 0);
+}
+
+int UDPTransport::TrySendBatch(const Datagram* datagrams, int count)
+{
+	return SendMessages(datagrams, count, MSG_DONTWAIT);
+}
+
+int UDPTransport::SendMessages(const Datagram* datagrams, int count, int flags)
+{
+	if (!Connected)
+	{
+		return 0;
+	}
+	int sent = 0;
+	while (sent < count)
+	{
+		int batch = std::min(count - sent, BatchSize);
+		mmsghdr messages[BatchSize];
+		iovec iovecs[BatchSize];
+		sockaddr_in addresses[BatchSize];
+		memset(messages, 0, sizeof(mmsghdr) * batch);
+		{
+			shared_lock lock(listenmutex);
+			for (int i = 0; i < batch; i++)
+			{
+				const Datagram &datagram = datagrams[sent + i];
+				auto key = connections.find(datagram.token);
+				if (key == connections.end())
+				{
+					//only send what's before the unknown token
+					batch = i;
+					break;
+				}
+				addresses[i] = key->second.address;
+				if (datagram.iov != nullptr)
+				{
+					messages[i].msg_hdr.msg_iov = const_cast<iovec*>(datagram.iov);
+					messages[i].msg_hdr.msg_iovlen = datagram.iovcnt;
+				}
+				else
+				{
+					iovecs[i].iov_base = datagram.buffer;
+					iovecs[i].iov_len = datagram.length;
+					messages[i].msg_hdr.msg_iov = &iovecs[i];
+					messages[i].msg_hdr.msg_iovlen = 1;
+				}
+				messages[i].msg_hdr.msg_name = &addresses[i];
+				messages[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+			}
+		}
+		if (batch == 0)
+		{
+			break;
+		}
+		int n = sendmmsg(sockfd, messages, batch, flags);
+		if (n <= 0)
+		{
+			if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				cerr << "UDP Server failed to send batch : " << errno << "(" << strerror(errno) << ")" << endl;
+			}
+			break;
+		}
+		sent += n;
+		if (n < batch)
+		{
+			break;
+		}
+	}
+	return sent;
+}
+
 std::optional<int> UDPTransport::Receive(void *buffer, int maxlength, std::shared_ptr<ConnectionToken> token)
 {
+	if (Ring)
+	{
+		PumpRing();
+	}
 	//try to dig stuff out of the backlog
 	{
-		shared_lock lock(listenmutex);
-		auto entry = connections.find(token);
-		if (entry == connections.end())
+		unique_lock lock(listenmutex);
+		auto connection = connections.find(token);
+		if (connection == connections.end())
 		{
 			cerr << "UDP Receive : token unknown" << endl;
 		}
-		else if (entry->second.payloads.size() > 0)
+		else
 		{
-			auto payload = entry->second.payloads.front();
-			if (payload.size() > maxlength)
+			auto entry = PopBacklog(connection->second);
+			if (entry.has_value())
 			{
-				cerr << "UDP receive : Not enough space to evacuate past payload ! Truncating !" << endl;
+				return EvacuateBacklog(entry.value(), buffer, maxlength);
 			}
-			size_t size = std::min<size_t>(payload.size(), maxlength);
-			memcpy(buffer, payload.data(), size);
-			entry->second.payloads.pop_front();
-			return size;
 		}
 	}
+	if (Ring)
+	{
+		return nullopt;
+	}
 	
-	
-	std::vector<uint8_t> recvbuff(UINT16_MAX);
-	std::pair<int, std::shared_ptr<ConnectionToken>> recv;
-	while ((recv=ReceiveFresh(recvbuff.data(), recvbuff.size())).first > 0)
+	auto entry = DrainSocket(token, buffer, maxlength);
+	if (!entry.has_value())
+	{
+		return nullopt;
+	}
+	if (entry->buffer == -1)
+	{
+		//already received in place
+		return entry->length;
+	}
+	return EvacuateBacklog(entry.value(), buffer, maxlength);
+}
+
+std::optional<BufferLease> UDPTransport::ReceiveView(std::shared_ptr<ConnectionToken> token)
+{
+	if (Ring)
+	{
+		PumpRing();
+	}
+	std::optional<BacklogEntry> entry;
 	{
-		if (recv.second == token)
+		unique_lock lock(listenmutex);
+		auto connection = connections.find(token);
+		if (connection == connections.end())
 		{
-			memcpy(buffer, recvbuff.data(), recv.first);
-			return recv.first;
+			cerr << "UDP Receive : token unknown" << endl;
 		}
 		else
 		{
-			shared_lock lock(listenmutex);
-			connections[recv.second].payloads.emplace_back(recvbuff.begin(), recvbuff.begin() + recv.first);
+			entry = PopBacklog(connection->second);
+		}
+	}
+	if (!entry.has_value() && !Ring)
+	{
+		entry = DrainSocket(token, nullptr, 0);
+	}
+	if (!entry.has_value())
+	{
+		return BufferLease();
+	}
+	if (entry->kernel)
+	{
+		return Ring->Lend(Ring, entry->buffer, GetEntryData(entry.value()) - Ring->GetBuffer(entry->buffer), entry->length);
+	}
+	return pool->Lease(entry->buffer, entry->length);
+}
+
+std::optional<UDPTransport::BacklogEntry> UDPTransport::DrainSocket(const std::shared_ptr<ConnectionToken> &token, void *scratch, int scratchlength)
+{
+	unique_lock drainlock(drainmutex);
+	Datagram datagrams[BatchSize];
+	int buffers[BatchSize];
+	std::optional<BacklogEntry> received;
+	while (!received.has_value())
+	{
+		int count = 0;
+		while (count < BatchSize && (buffers[count] = pool->Acquire()) != -1)
+		{
+			datagrams[count].buffer = pool->GetBuffer(buffers[count]);
+			datagrams[count].maxlength = pool->GetBufferSize();
+			count++;
+		}
+		if (count == 0)
+		{
+			//pool exhausted by slow consumers : receive in place, and drop it if it's not ours
+			//without scratch ours is dropped too, what is left in the socket wouldn't be reported again by an edge triggered loop
+			if (scratch == nullptr)
+			{
+				discard.resize(pool->GetBufferSize());
+			}
+			Datagram direct{scratch != nullptr ? scratch : discard.data(), scratch != nullptr ? scratchlength : (int)discard.size(),
+				0, nullptr, nullptr, 0, {}};
+			if (ReceiveBatch(&direct, 1) == 0)
+			{
+				break;
+			}
+			if (scratch != nullptr && direct.token == token)
+			{
+				received = BacklogEntry{-1, direct.length};
+				break;
+			}
+			unique_lock lock(listenmutex);
+			auto connection = connections.find(direct.token);
+			if (connection != connections.end())
+			{
+				connection->second.dropped++;
+			}
+			continue;
+		}
+
+		int n = ReceiveBatch(datagrams, count);
+		{
+			unique_lock lock(listenmutex);
+			for (int i = 0; i < n; i++)
+			{
+				const Datagram &datagram = datagrams[i];
+				if (!received.has_value() && datagram.token == token)
+				{
+					received = BacklogEntry{buffers[i], datagram.length};
+					continue;
+				}
+				auto connection = connections.find(datagram.token);
+				if (connection == connections.end())
+				{
+					pool->Release(buffers[i]);
+					continue;
+				}
+				PushBacklog(connection->second, {buffers[i], datagram.length});
+			}
+		}
+		for (int i = n; i < count; i++)
+		{
+			pool->Release(buffers[i]);
+		}
+		if (n < count)
+		{
+			//socket drained
+			break;
 		}
 	}
-	return nullopt;
+	return received;
 }
 
 bool UDPTransport::Send(const void *buffer, int length, std::shared_ptr<ConnectionToken> token)
+{
+	iovec io_buf;
+	io_buf.iov_base = const_cast<void*>(buffer);
+	io_buf.iov_len = length;
+	return Send(&io_buf, 1, token);
+}
+
+bool UDPTransport::Send(const iovec* iov, int iovcnt, std::shared_ptr<ConnectionToken> token)
 {
 	if (!Connected)
 	{
 		return false;
 	}
 
+	size_t length = 0;
+	for (int i = 0; i < iovcnt; i++)
+	{
+		length += iov[i].iov_len;
+	}
 	if (length > 1500)
 	{
 		cerr << "WARNING : Packet length over 1000, packet may be dropped" << endl;
 	}
-	//cout << "Sending " << length << " bytes..." << endl;
-	//printBuffer(buffer, length);
+	shared_lock lock(listenmutex);
 	auto key = connections.find(token);
 	if (key == connections.end())
 	{
 		return false;
 	}
-	const sockaddr_in &connectionaddress = key->second.address;
+	sockaddr_in connectionaddress = key->second.address;
 	
-	shared_lock lock(listenmutex);
-	
-	int err = sendto(sockfd, buffer, length, 0, (struct sockaddr*)&connectionaddress, sizeof(sockaddr_in));
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(struct msghdr));
+	msg.msg_iov = const_cast<iovec*>(iov);
+	msg.msg_iovlen = iovcnt;
+	msg.msg_name = &connectionaddress;
+	msg.msg_namelen = sizeof(sockaddr_in);
+	int err = sendmsg(sockfd, &msg, 0);
 	if (err==-1 && (errno != EAGAIN && errno != EWOULDBLOCK))
 	{
 		cerr << "UDP Server failed to send data to " << token->GetConnectionName() << " : " << errno << "(" << strerror(errno) << ")" << endl;
 	}
 	return true;
 }
+
+void UDPTransport::DisconnectClient(std::shared_ptr<ConnectionToken> token)
+{
+	unique_lock lock(listenmutex);
+	auto value = connections.find(token);
+	if (value == connections.end())
+	{
+		cerr << "UDP Token not found in connections while disconnecting !" << endl;
+		return;
+	}
+	peers.Erase(value->second.address);
+	ClearBacklog(value->second);
+	connections.erase(value);
+}
+
+bool UDPTransport::AttachEventLoop(EventLoop* loop, EventCallback callback)
+{
+	DetachEventLoop();
+	Loop = loop;
+	OnEvent = callback;
+	if (Ring)
+	{
+		return Loop->Add(Ring->GetFileDescriptor(), EPOLLIN, [this](uint32_t events)
+		{
+			(void)events;
+			PumpRing();
+			NotifyBacklogs();
+		});
+	}
+	return Loop->Add(sockfd, EPOLLIN, [this](uint32_t events)
+	{
+		(void)events;
+		//nothing is for the null token, everything lands in the backlogs
+		DrainSocket(nullptr, nullptr, 0);
+		NotifyBacklogs();
+	});
+}
+
+void UDPTransport::DetachEventLoop()
+{
+	if (!Loop)
+	{
+		return;
+	}
+	Loop->Remove(Ring ? Ring->GetFileDescriptor() : sockfd);
+	Loop = nullptr;
+}
+
+void UDPTransport::NotifyBacklogs()
+{
+	vector<shared_ptr<ConnectionToken>> readable;
+	{
+		shared_lock lock(listenmutex);
+		for (auto &connection : connections)
+		{
+			if (connection.second.size > 0)
+			{
+				readable.push_back(connection.first);
+			}
+		}
+	}
+	for (auto &token : readable)
+	{
+		OnEvent(token, TransportEvent::Readable);
+	}
+}
+
+void UDPTransport::PumpRing()
+{
+	bool rearm = false;
+	Ring->Reap([this, &rearm](IOUring::Completion &completion)
+	{
+		if (completion.userdata != ReceiveRingId)
+		{
+			return;
+		}
+		if (!completion.more && completion.result != -ECANCELED)
+		{
+			//ran out of provided buffers, start over
+			rearm = true;
+		}
+		if (completion.result < 0)
+		{
+			if (completion.result != -ENOBUFS && completion.result != -ECANCELED)
+			{
+				cerr << "UDP io_uring receive failed : " << strerror(-completion.result) << endl;
+			}
+			return;
+		}
+		//io_uring_recvmsg_out, then the address, then the payload
+		const io_uring_recvmsg_out* out = reinterpret_cast<const io_uring_recvmsg_out*>(completion.buffer);
+		const uint8_t* name = completion.buffer + sizeof(io_uring_recvmsg_out);
+		const uint8_t* payload = name + ringmessage.msg_namelen + ringmessage.msg_controllen;
+		if (out->flags & MSG_TRUNC)
+		{
+			cerr << "UDP receive : Not enough space for datagram ! Truncating !" << endl;
+		}
+		int length = std::min<int>(out->payloadlen, completion.result - (payload - completion.buffer));
+		sockaddr_in address;
+		memcpy(&address, name, sizeof(address));
+		auto token = ResolveSender(address);
+
+		unique_lock lock(listenmutex);
+		auto connection = connections.find(token);
+		if (connection == connections.end())
+		{
+			return;
+		}
+		//the datagram stays in the provided buffer while the kernel has enough others left,
+		//past that it's copied to the pool so that slow readers can't stop the receive
+		if (Ring->GetHeldBuffers() < Ring->GetBufferCount() / 2)
+		{
+			completion.keep = true;
+			PushBacklog(connection->second, {completion.bufferid, length, true});
+			return;
+		}
+		int buffer = pool->Acquire();
+		if (buffer == -1)
+		{
+			connection->second.dropped++;
+			return;
+		}
+		memcpy(pool->GetBuffer(buffer), payload, length);
+		PushBacklog(connection->second, {buffer, length});
+	});
+	if (rearm)
+	{
+		Ring->RecvMsgMultishot(sockfd, &ringmessage, ReceiveRingId);
+		Ring->Submit();
+	}
+}
+
+bool UDPTransport::SetBufferSizes(int sendsize, int receivesize)
+{
+	return SetSocketBufferSizes(sockfd, sendsize, receivesize);
+}
+
+void UDPTransport::SetOverflowPolicy(OverflowPolicy inOverflow)
+{
+	unique_lock lock(listenmutex);
+	Overflow = inOverflow;
+}
+
+uint64_t UDPTransport::GetDroppedPackets(std::shared_ptr<ConnectionToken> token) const
+{
+	shared_lock lock(listenmutex);
+	auto connection = connections.find(token);
+	if (connection == connections.end())
+	{
+		return 0;
+	}
+	return connection->second.dropped;
+}
+
+void UDPTransport::PushBacklog(UDPConnection &connection, const BacklogEntry &entry)
+{
+	if (connection.backlog.size() == 0)
+	{
+		connection.backlog.resize(BacklogCapacity);
+	}
+	if (connection.size == BacklogCapacity)
+	{
+		connection.dropped++;
+		switch (Overflow)
+		{
+		case OverflowPolicy::DropOldest:
+			ReleaseEntry(connection.backlog[connection.head]);
+			connection.head = (connection.head + 1) % BacklogCapacity;
+			connection.size--;
+			break;
+		
+		case OverflowPolicy::DropNewest:
+			ReleaseEntry(entry);
+			return;
+		}
+	}
+	int tail = (connection.head + connection.size) % BacklogCapacity;
+	connection.backlog[tail] = entry;
+	connection.size++;
+}
+
+std::optional<UDPTransport::BacklogEntry> UDPTransport::PopBacklog(UDPConnection &connection)
+{
+	if (connection.size == 0)
+	{
+		return nullopt;
+	}
+	BacklogEntry entry = connection.backlog[connection.head];
+	connection.head = (connection.head + 1) % BacklogCapacity;
+	connection.size--;
+	return entry;
+}
+
+void UDPTransport::ClearBacklog(UDPConnection &connection)
+{
+	while (auto entry = PopBacklog(connection))
+	{
+		ReleaseEntry(entry.value());
+	}
+}
+
+const uint8_t* UDPTransport::GetEntryData(const BacklogEntry &entry) const
+{
+	if (!entry.kernel)
+	{
+		return pool->GetBuffer(entry.buffer);
+	}
+	//io_uring_recvmsg_out, then the address, then the payload
+	return Ring->GetBuffer(entry.buffer) + sizeof(io_uring_recvmsg_out) + ringmessage.msg_namelen + ringmessage.msg_controllen;
+}
+
+void UDPTransport::ReleaseEntry(const BacklogEntry &entry)
+{
+	if (entry.kernel)
+	{
+		Ring->ReleaseBuffer(entry.buffer);
+	}
+	else
+	{
+		pool->Release(entry.buffer);
+	}
+}
+
+int UDPTransport::EvacuateBacklog(const BacklogEntry &entry, void *buffer, int maxlength)
+{
+	if (entry.length > maxlength)
+	{
+		cerr << "UDP receive : Not enough space to evacuate past payload ! Truncating !" << endl;
+	}
+	int size = std::min(entry.length, maxlength);
+	memcpy(buffer, GetEntryData(entry), size);
+	ReleaseEntry(entry);
+	return size;
+}
+
+std::shared_ptr<ConnectionToken> UDPTransport::ResolveSender(const sockaddr_in &address)
+{
+	{
+		shared_lock lock(listenmutex);
+		auto token = peers.Find(address);
+		if (token)
+		{
+			return token;
+		}
+	}
+	char ipbuf[16];
+	inet_ntop(AF_INET, &address.sin_addr, ipbuf, sizeof(ipbuf));
+	cout << "UDP Client connecting from " << ipbuf << endl;
+	return Connect(address);
+}
 	
 void UDPTransport::receiveThread()
 {
@@ -273,15 +780,7 @@ void UDPTransport::receiveThread()
 		shared_lock lock(listenmutex);
 		while ((n = recvfrom(sockfd, dataReceived, sizeof(dataReceived)-1, 0, (struct sockaddr*)&client, &clientSize)) > 0)
 		{
-			bool found = false;
-			for (auto &&i : connections)
-			{
-				if (memcmp(&i.second.address.sin_addr, &client.sin_addr, sizeof(client.sin_addr)) == 0)
-				{
-					found = true;
-					break;
-				}
-			}
+			bool found = peers.Find(client) != nullptr;
 			if (!found)
 			{
 				char buffer[16];
@@ -0,0 +1,520 @@
+#include "Transport/UnixSocketTransport.hpp"
+#include <Transport/ConnectionToken.hpp>
+
+#include <iostream>
+#include <string.h>
+#include <errno.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+namespace
+{
+	//Seals that make a received memfd safe to map : its content and size can't change under us
+	constexpr int RequiredSeals = F_SEAL_SHRINK | F_SEAL_WRITE;
+
+	//Errors after which the connection is still usable, the message is just not sent
+	bool IsTransient(int error)
+	{
+		return error == EAGAIN || error == EWOULDBLOCK || error == ENOBUFS || error == ENOMEM || error == EMSGSIZE;
+	}
+
+	//Remove the socket a crashed server left at address, false if something else is there
+	bool RemoveStaleSocket(const sockaddr_un &address, socklen_t addresslength)
+	{
+		struct stat status;
+		if (lstat(address.sun_path, &status) == -1)
+		{
+			return errno == ENOENT;
+		}
+		if (!S_ISSOCK(status.st_mode))
+		{
+			cerr << "Unix " << address.sun_path << " exists and isn't a socket" << endl;
+			return false;
+		}
+		//nobody accepts on a socket whose server is gone
+		int probe = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (probe == -1)
+		{
+			return false;
+		}
+		int result = connect(probe, (const sockaddr*)&address, addresslength);
+		int error = errno;
+		close(probe);
+		if (result == -1 && error == ECONNREFUSED)
+		{
+			unlink(address.sun_path);
+			return true;
+		}
+		cerr << "Unix " << address.sun_path << " is still served" << endl;
+		return false;
+	}
+}
+
+UnixSocketTransport::MappedMessages::~MappedMessages()
+{
+	for (auto &mapping : mapped)
+	{
+		munmap(reinterpret_cast<void*>(mapping.first), mapping.second);
+	}
+}
+
+BufferLease UnixSocketTransport::MappedMessages::Lease(std::shared_ptr<MappedMessages> self, void* address, size_t length)
+{
+	unique_lock lock(mappedmutex);
+	mapped[reinterpret_cast<uint64_t>(address)] = length;
+	return BufferLease(self, reinterpret_cast<uint64_t>(address), static_cast<const uint8_t*>(address), length);
+}
+
+void UnixSocketTransport::MappedMessages::ReleaseLease(uint64_t handle)
+{
+	unique_lock lock(mappedmutex);
+	auto mapping = mapped.find(handle);
+	if (mapping == mapped.end())
+	{
+		return;
+	}
+	munmap(reinterpret_cast<void*>(mapping->first), mapping->second);
+	mapped.erase(mapping);
+}
+
+UnixSocketTransport::UnixSocketTransport(bool inServer, std::string inPath, size_t inInlineThreshold)
+	:GenericTransport(),
+	Server(inServer), Path(inPath), InlineThreshold(max<size_t>(inInlineThreshold, 1)),
+	pool(make_shared<BufferPool>(InlineThreshold, 64)),
+	mappings(make_shared<MappedMessages>())
+{
+	int type = Server ? SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC : SOCK_SEQPACKET | SOCK_CLOEXEC;
+	sockfd = socket(AF_UNIX, type, 0);
+	if (sockfd == -1)
+	{
+		cerr << "Unix Failed to create socket, " << strerror(errno) << endl;
+		return;
+	}
+	sockaddr_un address;
+	socklen_t addresslength = GetAddress(address);
+	if (Server)
+	{
+		if (address.sun_path[0] != 0 && !RemoveStaleSocket(address, addresslength))
+		{
+			cerr << "Unix Can't serve " << Path << endl;
+			close(sockfd);
+			sockfd = -1;
+			return;
+		}
+		if (bind(sockfd, (sockaddr*)&address, addresslength) == -1)
+		{
+			cerr << "Unix Can't bind to " << Path << ", " << strerror(errno) << endl;
+			close(sockfd);
+			sockfd = -1;
+			return;
+		}
+		if (listen(sockfd, SOMAXCONN) == -1)
+		{
+			cerr << "Unix Can't listen !" << endl;
+		}
+	}
+	else
+	{
+		if (connect(sockfd, (sockaddr*)&address, addresslength) == -1)
+		{
+			cerr << "Unix Can't connect to " << Path << ", " << strerror(errno) << endl;
+			close(sockfd);
+			sockfd = -1;
+			return;
+		}
+		cout << "Unix connected to server " << Path << endl;
+		unique_lock lock(listenmutex);
+		connections[make_shared<ConnectionToken>(Path, this)] = {sockfd, Path};
+	}
+}
+
+UnixSocketTransport::~UnixSocketTransport()
+{
+	//Disconnect erases from connections, don't iterate over it directly
+	for (auto &token : GetClients())
+	{
+		token->Disconnect(); //closes the socket
+	}
+	if (Server && sockfd != -1)
+	{
+		close(sockfd);
+		sockaddr_un address;
+		GetAddress(address);
+		if (address.sun_path[0] != 0)
+		{
+			unlink(address.sun_path);
+		}
+	}
+}
+
+socklen_t UnixSocketTransport::GetAddress(sockaddr_un &address) const
+{
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (Path.size() >= sizeof(address.sun_path))
+	{
+		cerr << "Unix Path too long : " << Path << endl;
+		return sizeof(address);
+	}
+	memcpy(address.sun_path, Path.data(), Path.size());
+	if (Path.size() > 0 && Path[0] == '@')
+	{
+		//abstract names aren't null terminated, the length tells where they end
+		address.sun_path[0] = 0;
+		return offsetof(sockaddr_un, sun_path) + Path.size();
+	}
+	return sizeof(address);
+}
+
+int UnixSocketTransport::GetFileDescriptor(const std::shared_ptr<ConnectionToken> &token) const
+{
+	shared_lock lock(listenmutex);
+	auto value = connections.find(token);
+	if (value == connections.end())
+	{
+		cerr << "Token not found in connections !" << endl;
+		return -1;
+	}
+	return value->second.filedescriptor;
+}
+
+vector<shared_ptr<ConnectionToken>> UnixSocketTransport::GetClients() const
+{
+	vector<shared_ptr<ConnectionToken>> clients;
+	shared_lock lock(listenmutex);
+	clients.reserve(connections.size());
+	for (auto &connection : connections)
+	{
+		clients.push_back(connection.first);
+	}
+	return clients;
+}
+
+vector<shared_ptr<ConnectionToken>> UnixSocketTransport::AcceptNewConnections()
+{
+	if (!Server || sockfd == -1)
+	{
+		return {};
+	}
+	vector<shared_ptr<ConnectionToken>> newconnections;
+	while (1)
+	{
+		int fd = accept4(sockfd, nullptr, nullptr, SOCK_CLOEXEC);
+		if (fd == -1)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				cerr << "Unix Unhandled error on accept: " << strerror(errno) << endl;
+			}
+			return newconnections;
+		}
+		if (SendBufferSize != 0 || ReceiveBufferSize != 0)
+		{
+			SetSocketBufferSizes(fd, SendBufferSize, ReceiveBufferSize);
+		}
+		ucred credentials;
+		socklen_t credentialslength = sizeof(credentials);
+		string name = Path;
+		if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &credentialslength) == 0)
+		{
+			name += ":" + to_string(credentials.pid);
+		}
+		cout << "Unix Client connecting from " << name << " fd=" << fd << endl;
+		auto token = make_shared<ConnectionToken>(name, this);
+		unique_lock lock(listenmutex);
+		connections[token] = {fd, name};
+		newconnections.push_back(token);
+	}
+}
+
+std::pair<int, std::shared_ptr<ConnectionToken>> UnixSocketTransport::ReceiveAny(void *buffer, int maxlength)
+{
+	AcceptNewConnections();
+	return GenericTransport::ReceiveAny(buffer, maxlength);
+}
+
+bool UnixSocketTransport::SendMessage(int fd, const iovec* iov, int iovcnt, int flags)
+{
+	size_t length = 0;
+	for (int i = 0; i < iovcnt; i++)
+	{
+		length += iov[i].iov_len;
+	}
+	msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	if (length <= InlineThreshold)
+	{
+		msg.msg_iov = const_cast<iovec*>(iov);
+		msg.msg_iovlen = iovcnt;
+		return sendmsg(fd, &msg, flags | MSG_NOSIGNAL) != -1;
+	}
+	//one copy into the memfd, the receiver maps it
+	int memfd = memfd_create("CyclopsMessage", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (memfd == -1)
+	{
+		cerr << "Unix Can't create memfd, " << strerror(errno) << endl;
+		return false;
+	}
+	if (ftruncate(memfd, length) == -1 || pwritev(memfd, iov, iovcnt, 0) != (ssize_t)length
+		|| fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1)
+	{
+		int error = errno;
+		cerr << "Unix Can't fill memfd, " << strerror(error) << endl;
+		close(memfd);
+		errno = ENOBUFS;
+		return false;
+	}
+	//the payload is a placeholder, the size comes from the memfd
+	uint8_t placeholder = 0;
+	iovec placeholderiov = {&placeholder, sizeof(placeholder)};
+	union
+	{
+		cmsghdr align;
+		char buffer[CMSG_SPACE(sizeof(int))];
+	} control;
+	memset(&control, 0, sizeof(control));
+	msg.msg_iov = &placeholderiov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buffer;
+	msg.msg_controllen = sizeof(control.buffer);
+	cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+	bool sent = sendmsg(fd, &msg, flags | MSG_NOSIGNAL) != -1;
+	int error = errno;
+	close(memfd);
+	errno = error;
+	return sent;
+}
+
+int UnixSocketTransport::ReceiveMessage(int fd, void* buffer, int maxlength, int &memfd)
+{
+	memfd = -1;
+	iovec iov = {buffer, (size_t)maxlength};
+	union
+	{
+		cmsghdr align;
+		char buffer[CMSG_SPACE(sizeof(int))];
+	} control;
+	msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buffer;
+	msg.msg_controllen = sizeof(control.buffer);
+	int numreceived = recvmsg(fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+	if (numreceived <= 0)
+	{
+		return numreceived;
+	}
+	for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+		{
+			memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+		}
+	}
+	return numreceived;
+}
+
+void* UnixSocketTransport::MapMessage(int memfd, size_t &length)
+{
+	int seals = fcntl(memfd, F_GET_SEALS);
+	struct stat status;
+	void* data = MAP_FAILED;
+	if (seals == -1 || (seals & RequiredSeals) != RequiredSeals)
+	{
+		cerr << "Unix Received a memfd that isn't sealed, dropped" << endl;
+	}
+	else if (fstat(memfd, &status) == 0 && status.st_size > 0)
+	{
+		length = status.st_size;
+		data = mmap(nullptr, length, PROT_READ, MAP_SHARED, memfd, 0);
+	}
+	close(memfd);
+	return data == MAP_FAILED ? nullptr : data;
+}
+
+std::optional<int> UnixSocketTransport::HandleResult(int result, const std::shared_ptr<ConnectionToken> &token)
+{
+	if (result > 0)
+	{
+		return result;
+	}
+	if (result == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	{
+		return 0;
+	}
+	//0 = the peer closed the socket
+	token->Disconnect();
+	return nullopt;
+}
+
+std::optional<int> UnixSocketTransport::Receive(void* buffer, int maxlength, std::shared_ptr<ConnectionToken> token)
+{
+	if (!CheckToken(token))
+	{
+		return nullopt;
+	}
+	int fd = GetFileDescriptor(token);
+	if (fd == -1)
+	{
+		return nullopt;
+	}
+	int memfd;
+	int numreceived = ReceiveMessage(fd, buffer, maxlength, memfd);
+	if (memfd == -1)
+	{
+		return HandleResult(numreceived, token);
+	}
+	size_t length;
+	void* data = MapMessage(memfd, length);
+	if (data == nullptr)
+	{
+		return 0;
+	}
+	int size = min<size_t>(length, maxlength);
+	memcpy(buffer, data, size);
+	munmap(data, length);
+	return size;
+}
+
+std::optional<BufferLease> UnixSocketTransport::ReceiveView(std::shared_ptr<ConnectionToken> token)
+{
+	if (!CheckToken(token))
+	{
+		return nullopt;
+	}
+	int fd = GetFileDescriptor(token);
+	if (fd == -1)
+	{
+		return nullopt;
+	}
+	int index = pool->Acquire();
+	if (index == -1)
+	{
+		cerr << "Unix Receive : all buffers are leased" << endl;
+		return BufferLease();
+	}
+	int memfd;
+	int numreceived = ReceiveMessage(fd, pool->GetBuffer(index), pool->GetBufferSize(), memfd);
+	if (memfd == -1)
+	{
+		if (numreceived > 0)
+		{
+			return pool->Lease(index, numreceived);
+		}
+		pool->Release(index);
+		auto result = HandleResult(numreceived, token);
+		if (!result.has_value())
+		{
+			return nullopt;
+		}
+		return BufferLease();
+	}
+	pool->Release(index);
+	size_t length;
+	void* data = MapMessage(memfd, length);
+	if (data == nullptr)
+	{
+		return BufferLease();
+	}
+	return mappings->Lease(mappings, data, length);
+}
+
+bool UnixSocketTransport::Send(const void* buffer, int length, std::shared_ptr<ConnectionToken> token)
+{
+	iovec iov = {const_cast<void*>(buffer), (size_t)length};
+	return Send(&iov, 1, token);
+}
+
+bool UnixSocketTransport::Send(const iovec* iov, int iovcnt, std::shared_ptr<ConnectionToken> token)
+{
+	if (!CheckToken(token))
+	{
+		return false;
+	}
+	int fd = GetFileDescriptor(token);
+	if (fd == -1)
+	{
+		return false;
+	}
+	if (!SendMessage(fd, iov, iovcnt, 0) && !IsTransient(errno))
+	{
+		//got disconnected
+		token->Disconnect();
+	}
+	return token->IsConnected();
+}
+
+int UnixSocketTransport::TrySendBatch(const Datagram* datagrams, int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		const Datagram &datagram = datagrams[i];
+		if (!CheckToken(datagram.token))
+		{
+			return i;
+		}
+		int fd = GetFileDescriptor(datagram.token);
+		if (fd == -1)
+		{
+			return i;
+		}
+		iovec single = {datagram.buffer, (size_t)datagram.length};
+		const iovec* iov = datagram.iov != nullptr ? datagram.iov : &single;
+		int iovcnt = datagram.iov != nullptr ? datagram.iovcnt : 1;
+		if (!SendMessage(fd, iov, iovcnt, MSG_DONTWAIT))
+		{
+			if (!IsTransient(errno))
+			{
+				datagram.token->Disconnect();
+			}
+			return i;
+		}
+	}
+	return count;
+}
+
+bool UnixSocketTransport::SetBufferSizes(int sendsize, int receivesize)
+{
+	bool success = true;
+	unique_lock lock(listenmutex);
+	SendBufferSize = sendsize;
+	ReceiveBufferSize = receivesize;
+	for (auto &connection : connections)
+	{
+		success &= SetSocketBufferSizes(connection.second.filedescriptor, sendsize, receivesize);
+	}
+	return success;
+}
+
+void UnixSocketTransport::DisconnectClient(std::shared_ptr<ConnectionToken> token)
+{
+	unique_lock lock(listenmutex);
+	auto value = connections.find(token);
+	if (value == connections.end())
+	{
+		cerr << "Token not found in connections while disconnecting !" << endl;
+		return;
+	}
+	close(value->second.filedescriptor);
+	if (Server)
+	{
+		cout << "Unix Client " << value->second.name << "@fd" << value->second.filedescriptor << " disconnected." <<endl;
+	}
+	else
+	{
+		cout << "Unix Server " << value->second.name << "@fd" << value->second.filedescriptor << " disconnected." <<endl;
+		sockfd = -1;
+	}
+	connections.erase(value);
+}
@@ -0,0 +1,130 @@
+#include "Transport/WorkerPool.hpp"
+#include <Transport/thread-rename.hpp>
+
+#include <atomic>
+
+using namespace std;
+
+WorkerPool::Worker::Worker(WorkerPool* InPool)
+	:Task(), Pool(InPool)
+{
+}
+
+WorkerPool::Worker::~Worker()
+{
+	//the pool has woken us up already
+	if (ThreadHandle)
+	{
+		ThreadHandle->join();
+		ThreadHandle.reset();
+	}
+}
+
+void WorkerPool::Worker::ThreadEntryPoint()
+{
+	SetThreadName(Pool->Name.c_str());
+	Job job;
+	while (!killed && Pool->NextJob(job))
+	{
+		job();
+		job = nullptr;
+	}
+}
+
+WorkerPool::WorkerPool(int InNumThreads, std::string InName)
+	:Name(InName)
+{
+	if (InNumThreads <= 0)
+	{
+		InNumThreads = max<int>(thread::hardware_concurrency(), 1);
+	}
+	workers.reserve(InNumThreads);
+	for (int i = 0; i < InNumThreads; i++)
+	{
+		workers.push_back(make_unique<Worker>(this));
+		workers.back()->Start();
+	}
+}
+
+WorkerPool::~WorkerPool()
+{
+	{
+		unique_lock lock(jobmutex);
+		stopping = true;
+	}
+	jobcondition.notify_all();
+	for (auto &worker : workers)
+	{
+		worker->Kill();
+	}
+	workers.clear();
+}
+
+bool WorkerPool::NextJob(Job &job)
+{
+	unique_lock lock(jobmutex);
+	jobcondition.wait(lock, [this]{return stopping || !jobs.empty();});
+	if (stopping)
+	{
+		return false;
+	}
+	job = std::move(jobs.front());
+	jobs.pop_front();
+	return true;
+}
+
+void WorkerPool::Submit(Job job)
+{
+	{
+		unique_lock lock(jobmutex);
+		jobs.push_back(std::move(job));
+	}
+	jobcondition.notify_one();
+}
+
+void WorkerPool::ParallelFor(int count, const std::function<void(int)> &job)
+{
+	if (count <= 0)
+	{
+		return;
+	}
+	struct State
+	{
+		atomic<int> next{0};
+		int count;
+		const std::function<void(int)>* job;
+		mutex donemutex;
+		condition_variable donecondition;
+		int done = 0;
+	};
+	auto state = make_shared<State>();
+	state->count = count;
+	state->job = &job;
+	//helpers that start after every index is taken don't touch job
+	auto run = [state]()
+	{
+		int ran = 0;
+		for (int i = state->next++; i < state->count; i = state->next++)
+		{
+			(*state->job)(i);
+			ran++;
+		}
+		if (ran > 0)
+		{
+			unique_lock lock(state->donemutex);
+			state->done += ran;
+			if (state->done == state->count)
+			{
+				state->donecondition.notify_all();
+			}
+		}
+	};
+	int helpers = min<int>(count - 1, workers.size());
+	for (int i = 0; i < helpers; i++)
+	{
+		Submit(run);
+	}
+	run();
+	unique_lock lock(state->donemutex);
+	state->donecondition.wait(lock, [&state]{return state->done == state->count;});
+}